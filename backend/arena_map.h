@@ -0,0 +1,306 @@
+#ifndef ARENA_MAP_H_
+#define ARENA_MAP_H_
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "value_ref.h"
+
+namespace KvCache {
+
+// Bump allocator for the keys and small values of one generation of updates.
+// Nothing is freed individually; everything goes at once with the arena.
+class Arena {
+   public:
+    char* Allocate(size_t bytes) {
+        if (bytes > kBlockBytes_ / 4) {
+            // Large requests get a block of their own, so the current block
+            // is not wasted
+            blocks_.push_back(std::make_unique<char[]>(bytes));
+            bytes_ += bytes;
+            return blocks_.back().get();
+        }
+        if (bytes > left_ || cursor_ == nullptr) {
+            blocks_.push_back(std::make_unique<char[]>(kBlockBytes_));
+            bytes_ += kBlockBytes_;
+            cursor_ = blocks_.back().get();
+            left_ = kBlockBytes_;
+        }
+        char* ret = cursor_;
+        cursor_ += bytes;
+        left_ -= bytes;
+        return ret;
+    }
+
+    // Bytes reserved from the system
+    size_t Bytes() const { return bytes_; }
+
+   private:
+    static constexpr size_t kBlockBytes_ = 64 << 10;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* cursor_ = nullptr;
+    size_t left_ = 0;
+    size_t bytes_ = 0;
+};
+
+// Updated keys of one user in an open-addressing table with linear probing.
+// Each key is stored with its value in the arena of the generation. Values
+// over kArenaValueBytes_, such as file uploads, are kept in a shared buffer
+// instead, so that overwriting them gives the memory back and readers can hold
+// on to them without a copy.
+// An empty value is a deletion, keys are never removed.
+class CompactKvMap {
+   public:
+    typedef std::pair<std::string_view, std::string_view> value_type;
+
+    class const_iterator {
+       public:
+        const_iterator(const CompactKvMap* map, size_t index)
+            : map_(map), index_(index) {
+            Skip();
+        }
+
+        value_type operator*() const { return map_->Entry(index_); }
+
+        // Lets it->first and it->second work on the pair built on the fly
+        struct Arrow {
+            value_type entry;
+            const value_type* operator->() const { return &entry; }
+        };
+        Arrow operator->() const { return Arrow{map_->Entry(index_)}; }
+
+        const_iterator& operator++() {
+            ++index_;
+            Skip();
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return index_ == other.index_;
+        }
+        bool operator!=(const const_iterator& other) const {
+            return index_ != other.index_;
+        }
+
+       private:
+        void Skip() {
+            while (index_ < map_->slots_.size() &&
+                   map_->slots_[index_].record == nullptr) {
+                ++index_;
+            }
+        }
+
+        const CompactKvMap* map_;
+        size_t index_;
+    };
+
+    explicit CompactKvMap(Arena* arena) : arena_(arena) {}
+    CompactKvMap(const CompactKvMap&) = delete;
+    CompactKvMap& operator=(const CompactKvMap&) = delete;
+    CompactKvMap(CompactKvMap&& other) noexcept
+        : arena_(other.arena_),
+          slots_(std::move(other.slots_)),
+          size_(other.size_) {
+        other.slots_.clear();
+        other.size_ = 0;
+    }
+
+    ~CompactKvMap() {
+        for (const auto& slot : slots_) {
+            if (slot.record != nullptr && IsLarge(slot.value_len)) {
+                delete LargeValue(slot);
+            }
+        }
+    }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, slots_.size()); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const_iterator find(std::string_view key) const {
+        if (slots_.empty()) {
+            return end();
+        }
+        size_t index = Probe(key);
+        return slots_[index].record == nullptr ? end()
+                                               : const_iterator(this, index);
+    }
+
+    size_t count(std::string_view key) const { return find(key) != end(); }
+
+    // Value of key as a buffer the caller can keep, or nullptr if key is
+    // missing. Large values are shared; small ones are copied.
+    ValueRef Share(std::string_view key) const {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        const Slot& slot = slots_[Probe(key)];
+        if (slot.record == nullptr) {
+            return nullptr;
+        }
+        if (IsLarge(slot.value_len)) {
+            return *LargeValue(slot);
+        }
+        return std::make_shared<const std::string>(slot.record + slot.key_len,
+                                                   slot.value_len);
+    }
+
+    // Set key to value. Returns whether key is new; otherwise replaced is
+    // set to the size of the value it had.
+    bool Put(std::string_view key, std::string value, size_t& replaced) {
+        if ((size_ + 1) * 8 > slots_.size() * 7) {
+            Grow();
+        }
+        Slot& slot = slots_[Probe(key)];
+        bool added = slot.record == nullptr;
+        if (added) {
+            size_ += 1;
+        } else {
+            replaced = slot.value_len;
+            // A small value that fits over the old one reuses its bytes
+            if (!IsLarge(slot.value_len) && value.size() <= slot.value_len) {
+                memcpy(slot.record + slot.key_len, value.data(), value.size());
+                slot.value_len = value.size();
+                return false;
+            }
+            if (IsLarge(slot.value_len)) {
+                delete LargeValue(slot);
+            }
+        }
+
+        // Record of the key followed by the value, or by the address of the
+        // reference to a large value
+        bool large = IsLarge(value.size());
+        size_t value_bytes = large ? sizeof(ValueRef*) : value.size();
+        char* record = arena_->Allocate(key.size() + value_bytes);
+        memcpy(record, key.data(), key.size());
+        if (large) {
+            ValueRef* owned = new ValueRef(
+                std::make_shared<const std::string>(std::move(value)));
+            memcpy(record + key.size(), &owned, sizeof(owned));
+            slot.value_len = (*owned)->size();
+        } else {
+            memcpy(record + key.size(), value.data(), value.size());
+            slot.value_len = value.size();
+        }
+        slot.record = record;
+        slot.key_len = key.size();
+        return added;
+    }
+
+   private:
+    // record == nullptr marks a free slot
+    struct Slot {
+        char* record = nullptr;
+        uint32_t key_len = 0;
+        uint32_t value_len = 0;
+    };
+
+    static constexpr size_t kArenaValueBytes_ = 4096;
+    static constexpr size_t kInitialSlots_ = 4;
+
+    static bool IsLarge(size_t value_len) {
+        return value_len > kArenaValueBytes_;
+    }
+
+    static size_t Hash(std::string_view key) {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    static ValueRef* LargeValue(const Slot& slot) {
+        ValueRef* owned;
+        memcpy(&owned, slot.record + slot.key_len, sizeof(owned));
+        return owned;
+    }
+
+    value_type Entry(size_t index) const {
+        const Slot& slot = slots_[index];
+        const char* value = IsLarge(slot.value_len)
+                                ? (*LargeValue(slot))->data()
+                                : slot.record + slot.key_len;
+        return {std::string_view(slot.record, slot.key_len),
+                std::string_view(value, slot.value_len)};
+    }
+
+    // Index of the slot holding key, or of the free slot where it would go
+    size_t Probe(std::string_view key) const {
+        size_t mask = slots_.size() - 1;
+        size_t index = Hash(key) & mask;
+        while (slots_[index].record != nullptr &&
+               (slots_[index].key_len != key.size() ||
+                memcmp(slots_[index].record, key.data(), key.size()) != 0)) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+
+    void Grow() {
+        std::vector<Slot> old;
+        old.swap(slots_);
+        slots_.resize(old.empty() ? kInitialSlots_ : old.size() * 2);
+        for (const auto& slot : old) {
+            if (slot.record != nullptr) {
+                slots_[Probe(std::string_view(slot.record, slot.key_len))] =
+                    slot;
+            }
+        }
+    }
+
+    Arena* arena_;
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+};
+
+// One generation of updates of all users. The tables of all users allocate
+// from one arena, which is freed in one go when the generation is dropped.
+class UpdatesMap {
+   public:
+    typedef std::unordered_map<std::string, CompactKvMap> Users;
+    typedef Users::value_type value_type;
+
+    UpdatesMap() : arena_(std::make_unique<Arena>()) {}
+    UpdatesMap(const UpdatesMap&) = delete;
+    UpdatesMap& operator=(const UpdatesMap&) = delete;
+    // The moved-from map is left empty and ready for new updates
+    UpdatesMap(UpdatesMap&& other)
+        : arena_(std::move(other.arena_)), users_(std::move(other.users_)) {
+        other.clear();
+    }
+
+    Users::const_iterator begin() const { return users_.begin(); }
+    Users::const_iterator end() const { return users_.end(); }
+    Users::const_iterator find(const std::string& user) const {
+        return users_.find(user);
+    }
+    size_t size() const { return users_.size(); }
+    bool empty() const { return users_.empty(); }
+
+    // Table of user, created on first use
+    CompactKvMap& operator[](const std::string& user) {
+        return users_.try_emplace(user, arena_.get()).first->second;
+    }
+
+    void clear() {
+        users_.clear();
+        arena_ = std::make_unique<Arena>();
+    }
+
+    size_t ArenaBytes() const { return arena_->Bytes(); }
+
+   private:
+    std::unique_ptr<Arena> arena_;
+    Users users_;
+};
+
+}  // namespace KvCache
+
+#endif
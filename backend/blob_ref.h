@@ -0,0 +1,53 @@
+#ifndef BLOB_REF_H_
+#define BLOB_REF_H_
+
+#include <string>
+#include <string_view>
+
+namespace KvCache {
+// Content-addressed blobs shared by keys with identical values, such as the
+// same file uploaded to several folders or by several users.
+//
+// The blob of hash H lives in the row of kBlobUser, with its content under
+// key H and its number of references under key H + kBlobRefsSuffix. A key
+// bound to a blob holds a reference: kBlobRefMagic followed by H. Values
+// starting with kBlobRefMagic are reserved for references.
+
+const std::string kBlobUser = "#blobs";
+const std::string kBlobRefsSuffix = "#refs";
+const std::string kBlobRefMagic = std::string("\0KvBlobRef\0", 11);
+// Hex SHA-256 of the content
+constexpr size_t kBlobHashSize = 64;
+constexpr size_t kBlobRefSize = 11 + kBlobHashSize;
+
+bool IsBlobHash(std::string_view hash) {
+    if (hash.size() != kBlobHashSize) {
+        return false;
+    }
+    for (char c : hash) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HasBlobRefMagic(std::string_view value) {
+    return value.substr(0, kBlobRefMagic.size()) == kBlobRefMagic;
+}
+
+bool IsBlobRef(std::string_view value) {
+    return value.size() == kBlobRefSize && HasBlobRefMagic(value);
+}
+
+std::string MakeBlobRef(const std::string& hash) {
+    return kBlobRefMagic + hash;
+}
+
+std::string BlobRefHash(std::string_view ref) {
+    return std::string(ref.substr(kBlobRefMagic.size()));
+}
+
+}  // namespace KvCache
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef BLOOM_FILTER_H_
+#define BLOOM_FILTER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "chunk.h"
+#include "kv_config.h"
+
+namespace KvCache {
+
+// Fixed-size Bloom filter sized for an expected number of entries. Never
+// reports a present entry as missing.
+class BloomFilter {
+   public:
+    explicit BloomFilter(size_t expected_entries) {
+        size_t bits = std::max<size_t>(expected_entries * BLOOM_BITS_PER_KEY, 64);
+        bits_.assign((bits + 63) / 64, 0);
+        // k = ln(2) * bits per entry minimizes false positives
+        num_probes_ = std::clamp<size_t>(BLOOM_BITS_PER_KEY * 69 / 100, 1, 30);
+    }
+
+    void Add(const std::string& entry) {
+        uint64_t h = Hash(entry);
+        uint64_t delta = (h >> 33) | (h << 31);
+        size_t num_bits = bits_.size() * 64;
+        for (size_t i = 0; i < num_probes_; ++i) {
+            size_t bit = h % num_bits;
+            bits_[bit / 64] |= 1ULL << (bit % 64);
+            h += delta;
+        }
+    }
+
+    bool MayContain(const std::string& entry) const {
+        uint64_t h = Hash(entry);
+        uint64_t delta = (h >> 33) | (h << 31);
+        size_t num_bits = bits_.size() * 64;
+        for (size_t i = 0; i < num_probes_; ++i) {
+            size_t bit = h % num_bits;
+            if ((bits_[bit / 64] & (1ULL << (bit % 64))) == 0) {
+                return false;
+            }
+            h += delta;
+        }
+        return true;
+    }
+
+    size_t Bytes() const { return bits_.size() * sizeof(uint64_t); }
+
+    // Number of probes (uint32) followed by the bit words, for filters kept
+    // in files
+    std::string Encode() const {
+        std::string out;
+        uint32_t probes = num_probes_;
+        out.append(reinterpret_cast<const char*>(&probes), sizeof(probes));
+        out.append(reinterpret_cast<const char*>(bits_.data()), Bytes());
+        return out;
+    }
+
+    // Filter from the output of Encode. Returns nullptr if it is malformed.
+    static std::shared_ptr<BloomFilter> Decode(std::string_view encoded) {
+        uint32_t probes;
+        if (encoded.size() < sizeof(probes) + sizeof(uint64_t) ||
+            (encoded.size() - sizeof(probes)) % sizeof(uint64_t) != 0) {
+            return nullptr;
+        }
+        std::memcpy(&probes, encoded.data(), sizeof(probes));
+        if (probes < 1 || probes > 30) {
+            return nullptr;
+        }
+        auto filter = std::make_shared<BloomFilter>(0);
+        filter->num_probes_ = probes;
+        filter->bits_.resize((encoded.size() - sizeof(probes)) /
+                             sizeof(uint64_t));
+        std::memcpy(filter->bits_.data(), encoded.data() + sizeof(probes),
+                    filter->Bytes());
+        return filter;
+    }
+
+   private:
+    // FNV-1a with a final mix. Stable across builds, since encoded filters
+    // outlive the process.
+    static uint64_t Hash(const std::string& entry) {
+        uint64_t h = 0xCBF29CE484222325ULL;
+        for (unsigned char c : entry) {
+            h = (h ^ c) * 0x100000001B3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    std::vector<uint64_t> bits_;
+    size_t num_probes_;
+};
+
+// Bloom filters over the keys each user has in its chunk files, so that
+// lookups of missing keys are answered without touching the disk. Only what
+// is on disk is covered; buffered updates are checked before the filters. A
+// filter that has not been built yet answers "maybe". Like the chunk
+// directory, filters of the users that have been idle the longest are
+// dropped once they take more than the budget, and are built again when the
+// user is read. Safe to use from several threads.
+class LookupFilters {
+   public:
+    explicit LookupFilters(size_t budget_bytes = KEY_FILTER_BUDGET)
+        : budget_bytes_(budget_bytes) {}
+
+    // Whether key may be in the chunk files of user. Answers "maybe" until
+    // the filter of user is built.
+    bool MayHaveKey(const std::string& user, const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = keys_.find(user);
+        if (it == keys_.end()) {
+            return true;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+        return it->second.filter->MayContain(key);
+    }
+
+    bool HasKeyFilter(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return keys_.count(user) > 0;
+    }
+
+    // Rebuild the key filter of user from its loaded chunk metadata. The
+    // caller must hold the chunk lock of user.
+    void RebuildKeys(const std::string& user, const Chunk& chunk) {
+        auto filter = std::make_shared<BloomFilter>(chunk.metadata.size());
+        for (const auto& [key, loc] : chunk.metadata) {
+            filter->Add(key);
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = keys_.find(user);
+        if (it == keys_.end()) {
+            lru_.push_front(user);
+            it = keys_.emplace(user, Entry{nullptr, lru_.begin(), 0}).first;
+        } else {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            used_bytes_ -= it->second.bytes;
+        }
+        it->second.filter = filter;
+        it->second.bytes = filter->Bytes() + user.size() + kEntryOverhead_;
+        used_bytes_ += it->second.bytes;
+        EvictIdle();
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        keys_.clear();
+        lru_.clear();
+        used_bytes_ = 0;
+    }
+
+    size_t UsedBytes() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return used_bytes_;
+    }
+
+   private:
+    struct Entry {
+        std::shared_ptr<BloomFilter> filter;
+        std::list<std::string>::iterator lru_pos;
+        size_t bytes;
+    };
+
+    // Drop least recently used filters until the rest fit the budget. The
+    // most recently used one always stays.
+    void EvictIdle() {
+        while (used_bytes_ > budget_bytes_ && lru_.size() > 1) {
+            auto it = keys_.find(lru_.back());
+            used_bytes_ -= it->second.bytes;
+            keys_.erase(it);
+            lru_.pop_back();
+        }
+    }
+
+    // Map node, list node and the filter object around the bits
+    static constexpr size_t kEntryOverhead_ = 128;
+
+    std::mutex mtx_;
+    size_t budget_bytes_;
+    size_t used_bytes_ = 0;
+    // Most recently used user at the front
+    std::list<std::string> lru_;
+    std::unordered_map<std::string, Entry> keys_;
+};
+
+}  // namespace KvCache
+
+#endif
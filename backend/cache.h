@@ -1,54 +1,108 @@
 #ifndef MEMORY_H_
 #define MEMORY_H_
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <queue>
+#include <condition_variable>
 #include <regex>
+#include <shared_mutex>
 #include <sstream>
+#include <thread>
+#include <unordered_set>
 
+#include "../common/sha256.h"
+#include "arena_map.h"
+#include "blob_ref.h"
 #include "chunk.h"
+#include "chunk_engine.h"
+#include "io_scheduler.h"
 #include "kv_config.h"
+#include "lsm.h"
+#include "read_cache.h"
+#include "snapshot.h"
+#include "storage_engine.h"
+#include "user_registry.h"
+#include "value_log.h"
+#include "value_ref.h"
+#include "wal.h"
 
 namespace KvCache {
 namespace fs = ::std::filesystem;
-// KvStoreLogEntry Seq 123 user XXX key XXX Op XXX
 
-const std::string kPuts = "Puts";
-const std::string kDele = "Dele";
 const std::string kDir = "DIR";
 const std::string kFile = "FILE";
-const std::regex kLoggingHeaderRegex = std::regex(
-    "KvStoreLogEntry\\sSeq\\s([0-9]+)\\suser\\s([a-zA-Z0-9\\.\\-\\+\\_=]+)"
-    "\\skey\\s([a-"
-    "zA-Z0-9\\.\\-\\+\\_=]+)\\sop\\s([a-zA-Z]+)\\slength\\s([0-9]+)\n");
-const std::regex kLoggingSequenceIdHeader = std::regex(
-    "KvStoreLogEntry\\sCheckpointed\\sat\\sSequenceID:\\s([0-9]+)\n");
 const std::regex kFileTransportHeader = std::regex(
     "KvStoreSync\\sFilename:\\s([a-zA-Z0-9_\\.\\/"
     "\\-\\+\\_=]+)\\sType:\\s([a-zA-Z]+)\\ssize:\\s([0-9]+)\r\n");
 
 class KvCache {
    public:
-    KvCache() {}
+    KvCache() {
+        value_log_.SetPrefix(kLogFp_ + kValueLogSuffix_);
+        SetStorageEngine(storage_engine);
+    }
+    ~KvCache() { WaitForCheckpoint(); }
+
+    // Choose the engine flushed updates are kept in. Must be called before
+    // anything is read from or written to disk.
+    void SetStorageEngine(StorageEngineType type);
 
     int Puts(const std::string& user, const std::string& key,
-             const std::string& value, int seq_num,
-             bool logging_enabled = true);
+             const std::string& value, int seq_num);
+    // Bind key to the blob whose content hashes to hash, storing content as
+    // that blob unless it is stored already. content may be left empty when
+    // the blob is expected to exist; BLOB_ERROR asks for it if it does not.
+    int PutsBlob(const std::string& user, const std::string& key,
+                 const std::string& hash, const std::string& content,
+                 int seq_num);
+    // Hands out the value as a shared immutable buffer; large values are
+    // not copied on the way from the cache or the chunk file to the caller.
+    // Keys bound to a blob return its content, and values in the value log
+    // are read from there.
+    int Gets(const std::string& user, const std::string& key,
+             ValueRef& value);
     int Gets(const std::string& user, const std::string& key,
              std::string& value);
     int GetsAll(const std::string& user, kv_ret& kv_resp);
     int Cputs(const std::string& user, const std::string& key,
               const std::string& prev_value, const std::string& new_value,
               int seq_num);
-    int Dele(const std::string& user, const std::string& key, int seq_num,
-             bool logging_enabled = true);
+    int Dele(const std::string& user, const std::string& key, int seq_num);
 
     int InitCacheForPrimary();
 
-    // Checkpoint changes in memory
+    // Create the folder of a new user. Returns false if it could not be
+    // created.
+    bool CreateUser(const std::string& user);
+    bool HasUser(const std::string& user) { return users_.Has(user); }
+
+    // Checkpoint changes in memory. The current updates are frozen as an
+    // immutable generation and flushed to the chunk files by a background
+    // thread while new updates go to a fresh generation and a fresh log.
+    // Returns without waiting for the flush. Must not run concurrently with
+    // writes: an entry logged before the rotation whose update is applied
+    // after the freeze would be dropped with the rotated log.
     int Checkpoint();
+    // Retire the frozen generation if its flush has finished. Cheap enough to
+    // call after every command.
+    void ReapCheckpoint();
+    // Block until an in-flight checkpoint has finished and been retired.
+    void WaitForCheckpoint();
+    // Whether enough updates, log or time have piled up to checkpoint.
+    bool ShouldCheckpoint();
+    // Whether a write of value_size bytes must be refused until a
+    // checkpoint drains the buffered updates.
+    bool WriteBufferFull(size_t value_size) const;
+
+    // Whether this secondary missed a forwarded write. Writes are refused
+    // with SYNC_ERROR until it has synced with the primary again.
+    bool NeedsResync() const { return needs_resync_; }
+    void SetNeedsResync(bool needs_resync) { needs_resync_ = needs_resync; }
 
     // Only invoked when the current node is secondary. Could be called after
     // restart or when first starting up.
@@ -59,9 +113,18 @@ class KvCache {
 
     // Replay logging file to sync up memory state
     int ReplayLoggings();
+    // Whether the files under PREFIX belong to the chosen engine. Records
+    // the engine if no files do yet.
+    bool CheckStorageEngine();
+
+    ReadCacheStats ReadStats() { return read_cache_.Stats(); }
 
     void UpdateLogging(const std::string& new_logging_filepath) {
         kLogFp_ = new_logging_filepath;
+        log_writer_.SetPath(kLogFp_);
+        log_writer_.SetSyncMode(wal_sync_mode);
+        value_log_.SetPrefix(kLogFp_ + kValueLogSuffix_);
+        value_log_.SetSyncMode(wal_sync_mode);
     }
 
    private:
@@ -95,6 +158,9 @@ class KvCache {
     // Primary read local files and write to secondary during syncing.
     int ReadFileAndWriteTo(const std::string& filepath,
                            ssize_t expected_file_size, int fd);
+    // Send content to the secondary as the file at filepath
+    int WriteFileTo(const std::string& filepath, const std::string& content,
+                    int fd);
     bool OverwriteFile(const std::string& filepath, const std::string& content);
     bool MatchHeaderAndExtractContent(const std::string& filestr,
                                       std::string& file_path, std::string& type,
@@ -102,12 +168,92 @@ class KvCache {
     bool ExtractCheckpointSequenceIdFromLoggings(const std::string& loggings,
                                                  int& id);
 
-    int Log(const std::string& entry);
-
+    // Wait until the log entry of ticket is on disk
+    int Log(uint64_t ticket);
+    // Replay one logging file on top of the current memory state. Records
+    // are indexed in one pass, then applied by REPLAY_THREADS threads, each
+    // taking a share of the users in log order.
+    int ReplayLogFile(const std::string& filepath);
+    // Apply one logged entry without a sequence check. Entries of different
+    // users may be applied concurrently.
+    int ReplayRecord(const WalRecord& record);
+    // Rotate the log at checkpoint: entries so far move to the rotated file,
+    // which is removed once the frozen generation is durable.
+    bool RotateLog();
+    // Runs on the checkpoint thread. Snapshots the frozen generation, which
+    // was frozen at sequence id seq, in place of the rotated log, then
+    // flushes its users in parallel and drops the snapshot.
+    void FlushGeneration(std::shared_ptr<const UpdatesMap> generation,
+                         int seq);
+    // Load the snapshot of a generation whose flush did not finish into the
+    // updates. Log entries up to its sequence id are skipped by the replay.
+    int LoadSnapshot();
+    // Drop the frozen generation once its checkpoint thread has been joined,
+    // keeping it in memory if the flush failed.
+    void RetireGeneration();
+    // Move values of a flushed generation into the read cache so that hot
+    // keys keep hitting after the generation is retired.
+    void PromoteFlushedUpdates(const UpdatesMap& generation);
+
+    // Value of key with value pointers resolved, but not blob references
+    int Lookup(const std::string& user, const std::string& key,
+               ValueRef& value);
+    // Replace a value pointer by the value it points to
+    int ReadValueLog(const std::string& user, const std::string& key,
+                     std::string& value);
+    // Write value to the value log if it is large enough. Sets pointer, or
+    // leaves it empty if the value stays inline. Returns false if the value
+    // log could not be written.
+    bool WriteValueLog(const std::string& user, const std::string& key,
+                       const std::string& value, std::string& pointer);
+    // Values that look like blob references or value pointers are reserved
+    static bool IsReservedValue(const std::string& value) {
+        return HasBlobRefMagic(value) || HasValuePointerMagic(value);
+    }
+    // Move the values still pointed to out of value log segments that are
+    // mostly garbage, and retire the segments. Runs at checkpoints, before
+    // the updates are frozen, so that the moved pointers are flushed with
+    // them. The segments are deleted once that flush has succeeded.
+    void CollectValueLog();
+    // Copy of the log at path with value pointers replaced by the values, for
+    // a node with a different value log
+    bool InlineValueLog(const std::string& path, std::string& log);
+    // Apply a write. Releases the blob key was bound to, if any.
     int Puts(const std::string& user, const std::string& key,
-             const std::string& value);
-
-    bool ValidateAndUpdateSeqNum(int new_seq);
+             std::string value);
+    // Apply a PutsBlob that has been logged
+    void ApplyBlobPut(const std::string& user, const std::string& key,
+                      const std::string& hash, std::string content);
+    // Whether key holds a blob reference, found without reading values
+    // other than references from the chunk files. Sets hash if so.
+    bool ReadBlobRef(const std::string& user, const std::string& key,
+                     std::string& hash);
+    // Value of key as stored if it is no longer than max_size. Larger values
+    // are not read from the chunk files.
+    bool ReadSmallValue(const std::string& user, const std::string& key,
+                        size_t max_size, std::string& value);
+    // Whether the content of the blob of hash is stored, buffered or in the
+    // chunk files.
+    bool BlobStored(const std::string& hash);
+    // Add delta to the references of the blob of hash. Caller holds
+    // blob_mtx_.
+    void AdjustBlobRefs(const std::string& hash, int delta);
+    // Delete the blobs nothing refers to any more. Runs at checkpoints,
+    // when no write is in flight, so a blob cannot lose its content between
+    // the check of a PutsBlob without content and its update.
+    void CollectUnreferencedBlobs();
+    // Caller holds updates_mtx_ exclusively
+    void ApplyUpdate(const std::string& user, const std::string& key,
+                     std::string value);
+
+    // Writes run on several threads but enter the log in sequence order.
+    // Waits until the write before seq_num has taken its turn. Returns
+    // SEQ_ERROR if seq_num already had its turn. A write that never arrives
+    // is a gap: the primary skips it, a secondary returns SYNC_ERROR and
+    // needs a resync.
+    int AwaitSeqNum(int seq_num, int& expected);
+    // Ends the turn of seq_num and lets the next write in.
+    void FinishSeqNum(int seq_num);
     std::string FormatPuts(const std::string& user, const std::string& key,
                            const std::string& value, int seq_num);
     std::string FormatDele(const std::string& user, const std::string& key,
@@ -119,27 +265,74 @@ class KvCache {
     const std::string kSyncDone_ = "SYNC DONE";
     const std::string kSyncError_ = "SYNC ERROR";
     std::string kLogFp_ = PREFIX + "logging";
+    const std::string kRotatedSuffix_ = ".ckpt";
+    const std::string kValueLogSuffix_ = ".vlog-";
+    const std::string kSnapshotSuffix_ = ".snapshot";
+    // Names the engine that wrote the files under PREFIX
+    const std::string kEngineFile_ = "engine";
+    // Keeps the logging file open and groups appends into single writes
+    WalWriter log_writer_;
+    // Large values, written once and pointed to from everywhere else
+    ValueLog value_log_;
     // Monotonically increasing ID for serializing operations. If the
     // instruction received has sequence ID not equal to sequence_id_ + 1, then
-    // we will either report failures, or wait with a timeout (kTimeout).
+    // we will either report failures, or wait with a timeout (kSeqTimeout_).
     int sequence_id_ = 0;
-    // Cache reads. Map users to KV mappings
-    std::unordered_map<std::string, KV_Map> read_cache_;
+    // Sequence id of the snapshot loaded by the last replay, or 0
+    int snapshot_seq_ = 0;
+    const std::chrono::seconds kSeqTimeout_{5};
+    std::mutex seq_mtx_;
+    std::condition_variable seq_cv_;
+    std::atomic<bool> needs_resync_{false};
+    // Cache reads from chunk files, bounded by READ_CACHE_BUDGET
+    ReadCache read_cache_;
+    // Guards updates_cache_, frozen_updates_ and their sizes. Requests read
+    // and apply updates concurrently, checkpoints swap the generations.
+    mutable std::shared_mutex updates_mtx_;
     // Caches recent updates. Map users to KV mappings
-    std::unordered_map<std::string, KV_Map> updates_cache_;
+    UpdatesMap updates_cache_;
+    // Bytes of keys and values held by updates_cache_ and the frozen
+    // generation
+    size_t updates_bytes_ = 0;
+    size_t frozen_bytes_ = 0;
+    // When the updates started piling up since the last checkpoint
+    std::chrono::steady_clock::time_point last_checkpoint_ =
+        std::chrono::steady_clock::now();
+    // Generation being flushed by the checkpoint thread. Reads see it below
+    // updates_cache_ and above the chunk files until it is retired.
+    std::shared_ptr<const UpdatesMap> frozen_updates_;
+    std::thread checkpoint_thread_;
+    std::atomic<bool> checkpoint_done_{false};
+    std::atomic<int> checkpoint_status_{FINISHED};
+    // Users created on this node
+    UserRegistry users_;
+    // Keeps what checkpoints flush
+    StorageEngineType engine_type_ = STORAGE_CHUNK;
+    std::unique_ptr<StorageEngine> engine_;
+    // Serializes reference counting of blobs across users. Taken before
+    // updates_mtx_.
+    std::mutex blob_mtx_;
+    // Blobs whose content is logged but not applied yet, with the number of
+    // such writes
+    std::unordered_map<std::string, int> pending_blobs_;
+    // Blobs without references, deleted at the next checkpoint
+    std::unordered_set<std::string> unreferenced_blobs_;
 };
 
 int KvCache::InitCacheForPrimary() {
     debug_v2("#KvCache: Primary node initializing Kv Cache.\n");
+    if (!CheckStorageEngine()) {
+        return SYNC_ERROR;
+    }
     fs::path logging_file{kLogFp_};
+    fs::path rotated_file{kLogFp_ + kRotatedSuffix_};
+    fs::path snapshot_file{kLogFp_ + kSnapshotSuffix_};
 
-    if (!fs::exists(logging_file)) {
+    if (!fs::exists(logging_file) && !fs::exists(rotated_file) &&
+        !fs::exists(snapshot_file)) {
         debug_v2("#KvCache: Primary node creating new logging file.\n");
-        std::stringstream ss;
-        ss << "KvStoreLogEntry Checkpointed at SequenceID: " << sequence_id_
-           << "\n";
-
-        if (!OverwriteFile(kLogFp_, ss.str())) {
+        if (!log_writer_.Reset(EncodeWalHeader(sequence_id_)) ||
+            !value_log_.Open()) {
             return SYNC_ERROR;
         }
 
@@ -149,139 +342,496 @@ int KvCache::InitCacheForPrimary() {
     return ReplayLoggings();
 }
 
+void KvCache::SetStorageEngine(StorageEngineType type) {
+    WaitForCheckpoint();
+    engine_type_ = type;
+    if (type == STORAGE_LSM) {
+        engine_ = std::make_unique<LsmEngine>(users_);
+    } else {
+        engine_ = std::make_unique<ChunkEngine>(users_);
+    }
+}
+
+bool KvCache::CheckStorageEngine() {
+    std::string name = engine_type_ == STORAGE_LSM ? "lsm" : "chunk";
+    std::string path = PREFIX + kEngineFile_;
+    std::string stored;
+    if (std::ifstream(path) >> stored) {
+        if (stored != name) {
+            warn(
+                "#KvCacheError: Files under %s belong to the %s engine, not "
+                "%s.\n",
+                PREFIX.c_str(), stored.c_str(), name.c_str());
+            return false;
+        }
+        return true;
+    }
+    std::ofstream(path, std::ios::trunc) << name << "\n";
+    return true;
+}
+
+bool KvCache::CreateUser(const std::string& user) {
+    return users_.Add(user);
+}
+
 int KvCache::Gets(const std::string& user, const std::string& key,
                   std::string& value) {
-    if (read_cache_[user].find(key) == read_cache_[user].end()) {
-        // If the key is not in the read or updates cache, we need to load it
-        // from the KV store.
-        if (updates_cache_[user].find(key) == updates_cache_[user].end()) {
-            std::string& val = read_cache_[user][key];
-            Chunk chunk;
-            if (chunk.init(user) != FINISHED) {
-                warn("#KvCacheError: Failed to find user %s.\n", user.c_str());
-                return USER_ERROR;
+    ValueRef ref;
+    int ret = Gets(user, key, ref);
+    if (ret == FINISHED) {
+        value = *ref;
+    }
+    return ret;
+}
+
+int KvCache::Gets(const std::string& user, const std::string& key,
+                  ValueRef& value) {
+    int ret = Lookup(user, key, value);
+    if (ret != FINISHED || user == kBlobUser || !IsBlobRef(*value)) {
+        return ret;
+    }
+    ret = Lookup(kBlobUser, BlobRefHash(*value), value);
+    if (ret != FINISHED) {
+        warn("#KvCacheError: Missing blob of key %s, user %s.\n",
+             key.c_str(), user.c_str());
+        return KEY_ERROR;
+    }
+    return FINISHED;
+}
+
+int KvCache::Lookup(const std::string& user, const std::string& key,
+                    ValueRef& value) {
+    // Recent updates shadow whatever is in the chunk files, newest
+    // generation first. An empty value is a deletion.
+    ValueRef pointer;
+    {
+        std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+        std::vector<const UpdatesMap*> generations = {&updates_cache_};
+        if (frozen_updates_ != nullptr) {
+            generations.push_back(frozen_updates_.get());
+        }
+        for (const UpdatesMap* generation : generations) {
+            auto user_updates = generation->find(user);
+            if (user_updates == generation->end()) {
+                continue;
+            }
+            ValueRef updated = user_updates->second.Share(key);
+            if (updated != nullptr) {
+                if (updated->empty()) {
+                    return KEY_ERROR;
+                }
+                if (IsValuePointer(*updated)) {
+                    pointer = std::move(updated);
+                    break;
+                }
+                value = std::move(updated);
+                return FINISHED;
             }
+        }
+    }
 
-            int chunk_ret = chunk.get_value(key, val);
-            if (chunk_ret != FINISHED) {
-                warn(
-                    "#KvCacheError: Failed to retrieve value for key %s, user "
-                    "%s.\n",
-                    key.c_str(), user.c_str());
-                return chunk_ret;
+    // Recent large values are read from the value log
+    if (pointer != nullptr) {
+        std::string val(*pointer);
+        int ret = ReadValueLog(user, key, val);
+        if (ret == FINISHED) {
+            value = std::make_shared<const std::string>(std::move(val));
+        }
+        return ret;
+    }
+
+    if (read_cache_.Get(user, key, value)) {
+        return FINISHED;
+    }
+
+    // If the key is not in the read or updates cache, we need to load it
+    // from the KV store.
+    std::string val;
+    int chunk_ret = engine_->Get(user, key, val);
+    if (chunk_ret == USER_ERROR) {
+        warn("#KvCacheError: Failed to find user %s.\n", user.c_str());
+    }
+    if (chunk_ret != FINISHED) {
+        return chunk_ret;
+    }
+    chunk_ret = ReadValueLog(user, key, val);
+    if (chunk_ret != FINISHED) {
+        return chunk_ret;
+    }
+
+    value = std::make_shared<const std::string>(std::move(val));
+    read_cache_.Put(user, key, value);
+    return FINISHED;
+}
+
+int KvCache::ReadValueLog(const std::string& user, const std::string& key,
+                          std::string& value) {
+    if (!IsValuePointer(value)) {
+        return FINISHED;
+    }
+    std::string pointer;
+    pointer.swap(value);
+    if (!value_log_.Read(pointer, value)) {
+        warn(
+            "#KvCacheError: Failed to read value of key %s, user %s from the "
+            "value log.\n",
+            key.c_str(), user.c_str());
+        return KEY_ERROR;
+    }
+    return FINISHED;
+}
+
+bool KvCache::WriteValueLog(const std::string& user, const std::string& key,
+                            const std::string& value, std::string& pointer) {
+    if (value.size() < VALUE_LOG_MIN_BYTES || IsReservedValue(value)) {
+        return true;
+    }
+    if (!value_log_.Append(user, key, value, pointer)) {
+        warn(
+            "#KvCacheError: Failed to write value of key %s, user %s to the "
+            "value log.\n",
+            key.c_str(), user.c_str());
+        return false;
+    }
+    return true;
+}
+
+void KvCache::CollectValueLog() {
+    struct LiveRecord {
+        std::string user;
+        std::string key;
+        size_t offset;
+        size_t size;
+    };
+
+    for (uint64_t segment : value_log_.GcCandidates(VALUE_LOG_GC_SEGMENTS)) {
+        MappedFile file;
+        if (!file.Open(value_log_.SegmentPath(segment))) {
+            continue;
+        }
+
+        // A record is live if its key still points to it
+        std::string_view data = file.View();
+        io_scheduler.Acquire(IO_COMPACTION, data.size());
+        std::vector<LiveRecord> live;
+        size_t live_bytes = 0;
+        WalReader reader(data);
+        WalRecord record;
+        size_t offset = reader.Offset();
+        while (reader.Next(record)) {
+            LiveRecord entry{std::string(record.user), std::string(record.key),
+                             offset, reader.Offset() - offset};
+            std::string stored;
+            if (ReadSmallValue(entry.user, entry.key, kValuePointerSize,
+                               stored) &&
+                stored == EncodeValuePointer({segment, offset, entry.size})) {
+                live_bytes += entry.size;
+                live.push_back(std::move(entry));
+            }
+            offset = reader.Offset();
+        }
+        if (reader.Corrupted()) {
+            warn("#KvCacheError: Ckpt: value log segment %lu is corrupted.\n",
+                 segment);
+            continue;
+        }
+        if ((data.size() - live_bytes) * 100 <
+            data.size() * VALUE_LOG_GC_PERCENT) {
+            continue;
+        }
+
+        debug("#KvCache: Ckpt: moving %zu values out of value log segment "
+              "%lu\n",
+              live.size(), segment);
+        bool moved = true;
+        for (const auto& entry : live) {
+            std::string pointer;
+            if (!value_log_.AppendRecord(
+                    std::string(data.substr(entry.offset, entry.size)),
+                    pointer)) {
+                moved = false;
+                break;
             }
+            std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+            ApplyUpdate(entry.user, entry.key, pointer);
+        }
+        if (moved) {
+            value_log_.Retire(segment);
+        }
+    }
+}
 
-            value = read_cache_[user][key];
-            return FINISHED;
+bool KvCache::InlineValueLog(const std::string& path, std::string& log) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        return false;
+    }
+    std::string_view data = file.View();
+    int checkpoint_seq = 0;
+    if (!DecodeWalHeader(data, checkpoint_seq)) {
+        // Text logs come from before the value log
+        log.assign(data);
+        return true;
+    }
+
+    log = EncodeWalHeader(checkpoint_seq);
+    WalReader reader(data);
+    WalRecord record;
+    size_t offset = reader.Offset();
+    while (reader.Next(record)) {
+        if (record.codec != CODEC_NONE || !IsValuePointer(record.value)) {
+            log.append(data.substr(offset, reader.Offset() - offset));
+            offset = reader.Offset();
+            continue;
+        }
+        offset = reader.Offset();
+
+        std::string user(record.user);
+        std::string key(record.key);
+        std::string value;
+        if (!value_log_.Read(record.value, value)) {
+            return false;
+        }
+        if (record.op == kWalPutsBlob) {
+            std::string packed;
+            Codec codec = PackValue(value, /*background=*/false, packed);
+            log += EncodeWalBlobRecord(record.seq, user, key,
+                                       std::string(record.blob_hash),
+                                       codec == CODEC_NONE ? value : packed,
+                                       codec);
         } else {
-            value = updates_cache_[user][key];
-            return FINISHED;
+            log += FormatPuts(user, key, value, record.seq);
         }
     }
-    value = read_cache_[user][key];
-    return FINISHED;
+    return true;
 }
 
 int KvCache::GetsAll(const std::string& user, kv_ret& kv_resp) {
-    Chunk chunk;
-    if (chunk.init(user) != FINISHED) {
+    KV_Map chunk_kvs;
+    if (engine_->GetAll(user, chunk_kvs) != FINISHED) {
         warn("#KvCacheError: Failed to find user %s when getting all.\n",
              user.c_str());
         kv_resp.set_status(USER_ERROR);
         return USER_ERROR;
     }
 
-    KV_Map chunk_kvs = chunk.get_all_kv();
-
-    for (const auto& [key, value] : updates_cache_[user]) {
-        if (value != "") {
-            chunk_kvs[key] = value;
-        } else {
-            chunk_kvs.erase(key);
+    // Apply the frozen generation first, then the newer updates.
+    {
+        std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+        std::vector<const UpdatesMap*> generations;
+        if (frozen_updates_ != nullptr) {
+            generations.push_back(frozen_updates_.get());
+        }
+        generations.push_back(&updates_cache_);
+        for (const UpdatesMap* generation : generations) {
+            auto user_updates = generation->find(user);
+            if (user_updates == generation->end()) {
+                continue;
+            }
+            for (const auto& [key, value] : user_updates->second) {
+                if (!value.empty()) {
+                    chunk_kvs[std::string(key)] = value;
+                } else {
+                    chunk_kvs.erase(std::string(key));
+                }
+            }
         }
     }
 
     kv_resp.clear_key_values();
-    for (const auto& [key, value] : chunk_kvs) {
+    for (auto& [key, value] : chunk_kvs) {
         auto* new_kv = kv_resp.add_key_values();
         new_kv->set_key(key);
-        new_kv->set_value(value);
+        ValueRef content;
+        if (user != kBlobUser && IsBlobRef(value) &&
+            Lookup(kBlobUser, BlobRefHash(value), content) == FINISHED) {
+            new_kv->set_value(*content);
+        } else {
+            ReadValueLog(user, key, value);
+            new_kv->set_value(value);
+        }
     }
 
     return FINISHED;
 }
 
 int KvCache::Puts(const std::string& user, const std::string& key,
-                  const std::string& value, int seq_num, bool logging_enabled) {
-    if (!ValidateAndUpdateSeqNum(seq_num)) {
+                  const std::string& value, int seq_num) {
+    // A large value is written out before the turn, the log only gets the
+    // pointer to it
+    std::string pointer;
+    bool written = WriteValueLog(user, key, value, pointer);
+    const std::string& stored = pointer.empty() ? value : pointer;
+    int expected = 0;
+    std::string entry = FormatPuts(user, key, stored, seq_num);
+    int turn = AwaitSeqNum(seq_num, expected);
+    if (turn != FINISHED) {
         warn(
             "#KvCacheError: Failed to perform Puts operation due to invalid "
             "seq "
             "number %d. "
             "Expecting %d.\n",
-            seq_num, sequence_id_ + 1);
-        return SEQ_ERROR;
+            seq_num, expected);
+        return turn;
+    }
+    if (IsReservedValue(value)) {
+        FinishSeqNum(seq_num);
+        return VALUE_ERROR;
+    }
+    if (!written) {
+        FinishSeqNum(seq_num);
+        return LOG_ERROR;
     }
 
     // Log the operation
-    if (logging_enabled) {
-        int log_ret = Log(FormatPuts(user, key, value, seq_num));
-        if (log_ret != FINISHED) {
-            return log_ret;
-        }
+    uint64_t ticket = log_writer_.Enqueue(entry);
+    FinishSeqNum(seq_num);
+    int log_ret = Log(ticket);
+    if (log_ret != FINISHED) {
+        return log_ret;
     }
 
-    return Puts(user, key, value);
+    return Puts(user, key, stored);
 }
 
 int KvCache::Cputs(const std::string& user, const std::string& key,
                    const std::string& prev_value, const std::string& new_value,
                    int seq_num) {
-    if (!ValidateAndUpdateSeqNum(seq_num)) {
+    // The value log is written even if the comparison fails, which leaves
+    // garbage for its collection
+    std::string pointer;
+    bool written = WriteValueLog(user, key, new_value, pointer);
+    const std::string& stored = pointer.empty() ? new_value : pointer;
+    int expected = 0;
+    std::string entry = FormatPuts(user, key, stored, seq_num);
+    int turn = AwaitSeqNum(seq_num, expected);
+    if (turn != FINISHED) {
         warn(
             "#KvCacheError: Failed to perform CPuts operation due to invalid "
             "seq "
             "number %d. "
             "Expecting %d.\n",
-            seq_num, sequence_id_ + 1);
-        return SEQ_ERROR;
+            seq_num, expected);
+        return turn;
     }
 
     std::string old_value = "";
+    // A missing key matches an empty previous value. This is how new
+    // passwords and mailboxes are created.
     int ret = Gets(user, key, old_value);
-    if (ret != FINISHED) {
+    if (ret == KEY_ERROR) {
+        old_value = "";
+    } else if (ret != FINISHED) {
+        FinishSeqNum(seq_num);
         return ret;
     }
 
-    if (old_value.compare(prev_value) != 0) {
+    if (old_value.compare(prev_value) != 0 || IsReservedValue(new_value)) {
+        FinishSeqNum(seq_num);
         return VALUE_ERROR;
     }
+    if (!written) {
+        FinishSeqNum(seq_num);
+        return LOG_ERROR;
+    }
 
-    int log_ret = Log(FormatPuts(user, key, new_value, seq_num));
+    uint64_t ticket = log_writer_.Enqueue(entry);
+    FinishSeqNum(seq_num);
+    int log_ret = Log(ticket);
     if (log_ret != FINISHED) {
         return log_ret;
     }
 
-    return Puts(user, key, new_value);
+    return Puts(user, key, stored);
+}
+
+int KvCache::PutsBlob(const std::string& user, const std::string& key,
+                      const std::string& hash, const std::string& content,
+                      int seq_num) {
+    // Hash, and compress or write to the value log, before taking the turn
+    bool valid = IsBlobHash(hash) && user != kBlobUser &&
+                 !IsReservedValue(content) &&
+                 (content.empty() || sha256_hex(content) == hash);
+    bool written = true;
+    std::string pointer;
+    std::string packed;
+    Codec codec = CODEC_NONE;
+    if (valid && !content.empty()) {
+        written = WriteValueLog(kBlobUser, hash, content, pointer);
+        if (pointer.empty()) {
+            codec = PackValue(content, /*background=*/false, packed);
+        }
+    }
+    const std::string& stored = pointer.empty() ? content : pointer;
+    std::string entry = EncodeWalBlobRecord(
+        seq_num, user, key, hash, codec == CODEC_NONE ? stored : packed,
+        codec);
+
+    int expected = 0;
+    int turn = AwaitSeqNum(seq_num, expected);
+    if (turn != FINISHED) {
+        warn(
+            "#KvCacheError: Failed to perform PutsBlob operation due to "
+            "invalid seq number %d. Expecting %d.\n",
+            seq_num, expected);
+        return turn;
+    }
+    if (!valid) {
+        FinishSeqNum(seq_num);
+        return VALUE_ERROR;
+    }
+    if (!written) {
+        FinishSeqNum(seq_num);
+        return LOG_ERROR;
+    }
+
+    // Decided in sequence order, so that every node agrees on whether the
+    // blob is there
+    {
+        std::lock_guard<std::mutex> lock(blob_mtx_);
+        if (content.empty() && pending_blobs_.count(hash) == 0 &&
+            !BlobStored(hash)) {
+            FinishSeqNum(seq_num);
+            return BLOB_ERROR;
+        }
+        if (!content.empty()) {
+            pending_blobs_[hash] += 1;
+        }
+    }
+
+    uint64_t ticket = log_writer_.Enqueue(entry);
+    FinishSeqNum(seq_num);
+    int log_ret = Log(ticket);
+
+    std::lock_guard<std::mutex> lock(blob_mtx_);
+    if (log_ret == FINISHED) {
+        ApplyBlobPut(user, key, hash, stored);
+    }
+    if (!content.empty() && --pending_blobs_[hash] == 0) {
+        pending_blobs_.erase(hash);
+    }
+    return log_ret;
 }
 
-int KvCache::Dele(const std::string& user, const std::string& key, int seq_num,
-                  bool logging_enabled) {
-    if (!ValidateAndUpdateSeqNum(seq_num)) {
+int KvCache::Dele(const std::string& user, const std::string& key,
+                  int seq_num) {
+    int expected = 0;
+    int turn = AwaitSeqNum(seq_num, expected);
+    if (turn != FINISHED) {
         warn(
             "KvCacheError: Failed to perform Dele operation due to invalid seq "
             "number %d. "
             "Expecting %d.\n",
-            seq_num, sequence_id_ + 1);
-        return SEQ_ERROR;
+            seq_num, expected);
+        return turn;
     }
 
     // Log the operation
-    if (logging_enabled) {
-        int log_ret = Log(FormatDele(user, key, seq_num));
-        if (log_ret != FINISHED) {
-            return log_ret;
-        }
+    uint64_t ticket = log_writer_.Enqueue(FormatDele(user, key, seq_num));
+    FinishSeqNum(seq_num);
+    int log_ret = Log(ticket);
+    if (log_ret != FINISHED) {
+        return log_ret;
     }
 
     return Puts(user, key, "");
@@ -289,30 +839,195 @@ int KvCache::Dele(const std::string& user, const std::string& key, int seq_num,
 
 int KvCache::Checkpoint() {
     debug("#KvCache: Node checkpointing....\n");
-    for (const auto& [user, kv_map] : updates_cache_) {
-        Chunk chunk;
-        chunk.init(user);
-        chunk.append_kvs(kv_map);
+    ReapCheckpoint();
+    CollectUnreferencedBlobs();
+    if (checkpoint_thread_.joinable()) {
+        // Only one generation is flushed at a time. The updates stay in
+        // memory and in the log until the next checkpoint.
+        debug("#KvCache: Ckpt: previous checkpoint still running.\n");
+        return FINISHED;
+    }
+    CollectValueLog();
+
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    if (updates_cache_.empty()) {
+        return FINISHED;
     }
 
-    // Clear the logging file.
-    debug("#KvCache: Ckpt: clearing up logging file\n");
-    std::ofstream ofs;
-    ofs.open(kLogFp_, std::ofstream::out | std::ofstream::trunc);
-    ofs.close();
+    // Entries logged so far belong to the generation being frozen.
+    if (!RotateLog()) {
+        warn("#KvCacheError: Ckpt: failed to rotate logging file.\n");
+        return LOG_ERROR;
+    }
 
-    // Clear up updates cache and read cache
-    debug("#KvCache: Ckpt: clearing up updates and read caches in memory\n");
+    debug("#KvCache: Ckpt: freezing updates of %zu users, %zu bytes\n",
+          updates_cache_.size(), updates_bytes_);
+    frozen_updates_ = std::make_shared<const UpdatesMap>(
+        std::move(updates_cache_));
     updates_cache_.clear();
-    read_cache_.clear();
+    frozen_bytes_ = updates_bytes_;
+    updates_bytes_ = 0;
+    last_checkpoint_ = std::chrono::steady_clock::now();
+
+    checkpoint_done_ = false;
+    checkpoint_thread_ = std::thread(&KvCache::FlushGeneration, this,
+                                     frozen_updates_, sequence_id_);
+    return FINISHED;
+}
+
+void KvCache::ReapCheckpoint() {
+    if (!checkpoint_thread_.joinable() || !checkpoint_done_) {
+        return;
+    }
+    checkpoint_thread_.join();
+    RetireGeneration();
+}
+
+void KvCache::RetireGeneration() {
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    if (!frozen_updates_) {
+        return;
+    }
+    ReadCacheStats stats = read_cache_.Stats();
+    debug(
+        "#KvCache: Ckpt finished with status %d. Read cache hits %lu misses "
+        "%lu evictions %lu rejections %lu packed %lu\n",
+        checkpoint_status_.load(), stats.hits, stats.misses, stats.evictions,
+        stats.rejections, stats.packed);
+    debug("#KvCache: Disk I/O since start:\n%s",
+          io_scheduler.Report().c_str());
+
+    if (checkpoint_status_ == FINISHED) {
+        PromoteFlushedUpdates(*frozen_updates_);
+        // The moved values are durable at their new place
+        value_log_.DropRetired();
+    } else {
+        // The chunk files may be missing part of the generation. Keep it
+        // under the newer updates so the next checkpoint writes it again.
+        for (const auto& [user, kv_map] : *frozen_updates_) {
+            for (const auto& [key, value] : kv_map) {
+                auto user_updates = updates_cache_.find(user);
+                if (user_updates == updates_cache_.end() ||
+                    user_updates->second.count(key) == 0) {
+                    ApplyUpdate(user, std::string(key), std::string(value));
+                }
+            }
+        }
+    }
+    frozen_updates_.reset();
+    frozen_bytes_ = 0;
+}
+
+void KvCache::PromoteFlushedUpdates(const UpdatesMap& generation) {
+    // The read cache only holds values, so entries that were not updated stay
+    // valid even if compaction moved their records. Flushed values replace
+    // what the cache held for their keys unless a newer update shadows them.
+    for (const auto& [user, kv_map] : generation) {
+        auto user_updates = updates_cache_.find(user);
+        for (const auto& [key, value] : kv_map) {
+            if (user_updates != updates_cache_.end() &&
+                user_updates->second.count(key) > 0) {
+                continue;
+            }
+            if (value.empty() || value.size() > READ_CACHE_PROMOTE_BYTES ||
+                IsValuePointer(value)) {
+                read_cache_.Erase(user, std::string(key));
+            } else {
+                read_cache_.Put(user, std::string(key), kv_map.Share(key));
+            }
+        }
+    }
+}
+
+void KvCache::WaitForCheckpoint() {
+    if (checkpoint_thread_.joinable()) {
+        checkpoint_thread_.join();
+        checkpoint_done_ = true;
+    }
+    RetireGeneration();
+}
+
+bool KvCache::ShouldCheckpoint() {
+    std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+    if (updates_cache_.empty() || checkpoint_thread_.joinable()) {
+        return false;
+    }
+    if (updates_bytes_ >= FLUSH_BUFFER_BYTES ||
+        log_writer_.Bytes() >= FLUSH_LOG_BYTES) {
+        return true;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - last_checkpoint_;
+    return elapsed >= std::chrono::seconds(FLUSH_INTERVAL_SEC);
+}
+
+bool KvCache::WriteBufferFull(size_t value_size) const {
+    // Large values only take the room of their pointer
+    if (value_size >= VALUE_LOG_MIN_BYTES) {
+        value_size = kValuePointerSize;
+    }
+    std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+    size_t buffered = updates_bytes_ + frozen_bytes_;
+    // A single oversized value is still let in once the buffer is empty
+    return buffered > 0 && buffered + value_size > WRITE_BUFFER_LIMIT;
+}
+
+bool KvCache::RotateLog() {
+    std::string rotated = kLogFp_ + kRotatedSuffix_;
+    log_writer_.Close();
+
+    // A rotated log left by a failed flush still has to be replayed, so the
+    // new entries are added to it rather than replacing it.
+    if (fs::exists(rotated)) {
+        MappedFile current;
+        if (!current.Open(kLogFp_) || !IsBinaryWal(current.View())) {
+            return false;
+        }
+        std::string_view records = current.View().substr(kWalHeaderSize);
+        std::ofstream out(rotated, std::ios::binary | std::ios::app);
+        out.write(records.data(), records.size());
+        out.close();
+        if (!out) {
+            return false;
+        }
+    } else if (std::rename(kLogFp_.c_str(), rotated.c_str()) != 0) {
+        return false;
+    }
 
     // Record the sequence id at the time of checkpoint in logging file for
     // recovery and syncing.
-    std::stringstream ss;
-    ss << "KvStoreLogEntry Checkpointed at SequenceID: " << sequence_id_
-       << "\n";
+    return log_writer_.Reset(EncodeWalHeader(sequence_id_));
+}
+
+void KvCache::FlushGeneration(std::shared_ptr<const UpdatesMap> generation,
+                              int seq) {
+    // The snapshot holds everything the rotated log does, including what a
+    // failed flush left for this generation, with one entry per key. If it
+    // cannot be written the rotated log is kept instead.
+    std::string rotated = kLogFp_ + kRotatedSuffix_;
+    std::string snapshot = kLogFp_ + kSnapshotSuffix_;
+    if (WriteSnapshot(snapshot, seq, *generation)) {
+        std::remove(rotated.c_str());
+    } else {
+        warn("#KvCacheError: Ckpt: failed to write snapshot.\n");
+    }
 
-    return Log(ss.str());
+    bool ok = engine_->Flush(*generation);
+
+    // Clear the snapshot and the rotated logging file only once everything
+    // they cover is on disk. Otherwise they are kept and loaded on recovery.
+    // A stale snapshot must not come back after a crash, as it would shadow
+    // newer flushes.
+    if (ok) {
+        std::remove(rotated.c_str());
+        std::remove(snapshot.c_str());
+        if (wal_sync_mode != WAL_SYNC_NONE &&
+            !sync_path(fs::path(kLogFp_).parent_path().string())) {
+            warn("#KvCacheError: Ckpt: failed to sync removal of snapshot.\n");
+            ok = false;
+        }
+    }
+    checkpoint_status_ = ok ? FINISHED : LOG_ERROR;
+    checkpoint_done_ = true;
 }
 
 int KvCache::PrimarySyncSecondary(int secondary_fd) {
@@ -322,6 +1037,9 @@ int KvCache::PrimarySyncSecondary(int secondary_fd) {
         return SYNC_ERROR;
     }
 
+    // Files and the logging header must not change while they are sent.
+    WaitForCheckpoint();
+
     debug_v2("#KvCache: Primary start syncing secondary with fd %d.\n",
              secondary_fd);
     int logging_sent = PrimarySendLogging(secondary_fd);
@@ -520,12 +1238,16 @@ int KvCache::SecondaryRecoverFromPrimary(int primary_fd) {
 bool KvCache::NeedFullSync(const std::string& loggings) {
     debug_v2("#KvCache-Secondary: Secondary check NeedFullSync.\n");
 
+    // A rotated logging file holds the last checkpoint known to be durable.
     int last_checkpoint_id = 0;
-    fs::path logging_file{kLogFp_};
+    fs::path logging_file{kLogFp_ + kRotatedSuffix_};
+    if (!fs::exists(logging_file)) {
+        logging_file = kLogFp_;
+    }
     if (fs::exists(logging_file)) {
         debug_v2("#KvCache-Secondary: Secondary parsing local loggings.\n");
         std::string local_loggings = "";
-        if (!read_file(kLogFp_, local_loggings)) {
+        if (!read_file(logging_file.string(), local_loggings)) {
             warn(
                 "#KvCacheError: Failed to read local loggings. Requiring full "
                 "sync from primary.\n");
@@ -588,11 +1310,23 @@ bool KvCache::NeedFullSync(const std::string& loggings) {
 }
 
 void KvCache::ResetLocalStateForFullSync() {
+    WaitForCheckpoint();
     sequence_id_ = 0;
+    snapshot_seq_ = 0;
     max_sequence = 0;
     updates_cache_.clear();
-    read_cache_.clear();
+    updates_bytes_ = 0;
+    read_cache_.Clear();
+    engine_->Clear();
+    users_.Clear();
+    {
+        std::lock_guard<std::mutex> lock(blob_mtx_);
+        pending_blobs_.clear();
+        unreferenced_blobs_.clear();
+    }
 
+    log_writer_.Close();
+    value_log_.Close();
     fs::path dir{PREFIX};
     fs::remove_all(dir);
     debug_v2(
@@ -704,10 +1438,17 @@ int KvCache::PrimarySendLogging(int secondary_fd) {
         return SYNC_ERROR;
     }
 
+    // The secondary has a value log of its own, so it gets the values
+    std::string loggings;
+    if (!InlineValueLog(kLogFp_, loggings)) {
+        warn("#KvCacheError: Failed to read logging file %s for syncing.\n",
+             kLogFp_.c_str());
+        return SYNC_ERROR;
+    }
+
     debug_v2("#KvCache: Primary sending loggings to secondary with fd %d.\n",
              secondary_fd);
-    return ReadFileAndWriteTo(kLogFp_, fs::file_size(logging_file),
-                              secondary_fd);
+    return WriteFileTo(kLogFp_, loggings, secondary_fd);
 }
 
 int KvCache::PrimarySendAllContent(int secondary_fd) {
@@ -755,7 +1496,11 @@ int KvCache::PrimarySendAllContent(int secondary_fd) {
 
 int KvCache::OverwriteLoggingAndReplay(const std::string& loggings) {
     debug_v2("#KvCache-Secondary: Secondary overwrite logging.\n");
-    if (!OverwriteFile(kLogFp_, loggings)) {
+    // The primary's log starts at or before the local durable checkpoint, so
+    // it supersedes a local rotated log. A local snapshot is kept: the
+    // entries it covers are skipped when the log is replayed.
+    std::remove((kLogFp_ + kRotatedSuffix_).c_str());
+    if (!log_writer_.Reset(loggings)) {
         warn(
             "#KvCacheError: Failed to overwrite log file during syncing. Sync "
             "failed.\n");
@@ -766,151 +1511,490 @@ int KvCache::OverwriteLoggingAndReplay(const std::string& loggings) {
 }
 
 int KvCache::ReplayLoggings() {
-    std::string loggings;
-    if (!read_file(kLogFp_, loggings)) {
+    WaitForCheckpoint();
+    if (!CheckStorageEngine()) {
+        return REC_ERROR;
+    }
+    // Clear up the caches before replaying.
+    updates_cache_.clear();
+    updates_bytes_ = 0;
+    read_cache_.Clear();
+    if (!value_log_.Open()) {
+        warn("#KvCacheError: Failed to open the value log.\n");
+        return REC_ERROR;
+    }
+    int snapshot_ret = LoadSnapshot();
+    if (snapshot_ret != FINISHED) {
+        return snapshot_ret;
+    }
+
+    // A rotated logging file means the last checkpoint never finished
+    // flushing. Its entries come before the ones in the current file, and
+    // after those of a snapshot.
+    std::string rotated = kLogFp_ + kRotatedSuffix_;
+    bool has_rotated = fs::exists(rotated);
+    if (has_rotated) {
+        int ret = ReplayLogFile(rotated);
+        if (ret != FINISHED) {
+            return ret;
+        }
+    }
+    if (!has_rotated || fs::exists(kLogFp_)) {
+        int ret = ReplayLogFile(kLogFp_);
+        if (ret != FINISHED) {
+            return ret;
+        }
+    }
+
+    // Fold both files into one log headed by the last durable checkpoint.
+    if (has_rotated) {
+        std::string merged, current;
+        if (!read_file(rotated, merged)) {
+            return REC_ERROR;
+        }
+        if (read_file(kLogFp_, current) && current.size() > kWalHeaderSize) {
+            merged.append(current, kWalHeaderSize, std::string::npos);
+        }
+        if (!log_writer_.Reset(merged)) {
+            warn("#KvCacheError: Failed to merge rotated logging file.\n");
+            return REC_ERROR;
+        }
+        std::remove(rotated.c_str());
+    }
+
+    max_sequence = sequence_id_;
+    debug_v2(
+        "#KvCache-Replay: Max sequence updated to align with sequence_id_: "
+        "%d\n",
+        max_sequence);
+
+    // The file may have been replaced while syncing
+    if (!log_writer_.Open()) {
+        warn("#KvCacheError: Failed to reopen logging file after replay.\n");
+        return REC_ERROR;
+    }
+    return FINISHED;
+}
+
+int KvCache::LoadSnapshot() {
+    snapshot_seq_ = 0;
+    std::string path = kLogFp_ + kSnapshotSuffix_;
+    if (!fs::exists(path)) {
+        return FINISHED;
+    }
+    MappedFile snapshot;
+    int seq = 0;
+    if (!snapshot.Open(path) || !DecodeWalHeader(snapshot.View(), seq)) {
+        warn("#KvCacheError: Failed to open snapshot %s.\n", path.c_str());
+        return REC_ERROR;
+    }
+
+    // Entries are applied as they were buffered. Blob references counted
+    // before the snapshot are part of it, so nothing is counted again.
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    WalReader reader(snapshot.View());
+    WalRecord record;
+    size_t entries = 0;
+    while (reader.Next(record)) {
+        std::string value;
+        if (record.op == kWalPuts &&
+            !DecompressValue(record.codec, record.value, value)) {
+            warn("#KvCacheError: Failed to decompress snapshot value of user "
+                 "%.*s.\n",
+                 (int)record.user.size(), record.user.data());
+            return REC_ERROR;
+        }
+        ApplyUpdate(std::string(record.user), std::string(record.key),
+                    std::move(value));
+        entries += 1;
+    }
+    // Snapshots are renamed into place whole, so any damage is real
+    if (reader.Corrupted()) {
+        warn("#KvCacheError: Snapshot %s is corrupted at offset %zu.\n",
+             path.c_str(), reader.Offset());
+        return REC_ERROR;
+    }
+
+    snapshot_seq_ = seq;
+    sequence_id_ = std::max(sequence_id_, seq);
+    debug("#KvCache-Replay: Loaded snapshot at sequence id %d with %zu "
+          "entries\n",
+          seq, entries);
+    return FINISHED;
+}
+
+int KvCache::ReplayLogFile(const std::string& filepath) {
+    MappedFile log_file;
+    if (!log_file.Open(filepath)) {
         warn(
             "#KvCacheError: Failed to open logging file for syncing. Recovery "
             "FAILED, this could lead to inconsistent state.\n");
         return REC_ERROR;
     }
 
-    if (!ExtractCheckpointSequenceIdFromLoggings(loggings, sequence_id_)) {
+    // Logs written in the old text format are converted once.
+    if (!IsBinaryWal(log_file.View())) {
+        std::string text(log_file.View());
+        std::string binary;
+        if (!ConvertTextWal(text, binary) || !OverwriteFile(filepath, binary) ||
+            !log_file.Open(filepath)) {
+            warn(
+                "#KvCacheError: Failed to convert text logging file. Recovery "
+                "FAILED, this could lead to inconsistent state.\n");
+            return REC_ERROR;
+        }
+        debug("#KvCache-Replay: Converted text logging file to binary.\n");
+    }
+
+    std::string_view loggings = log_file.View();
+    int checkpoint_seq = 0;
+    if (!DecodeWalHeader(loggings, checkpoint_seq)) {
         warn(
             "#KvCacheError: Failed to extract last checkpoint sequence ID "
             "during replying. Recovery "
             "FAILED, this could lead to inconsistent state.\n");
         return REC_ERROR;
     }
+    sequence_id_ = std::max(checkpoint_seq, snapshot_seq_);
 
     debug_v2(
-        "#KvCache-Replay: Cleared up memory state and start replying "
-        "loggings with sequence_id_ %d\n", sequence_id_);
-    // Clear up the caches before replaying.
-    updates_cache_.clear();
-    read_cache_.clear();
+        "#KvCache-Replay: Start replying loggings %s with sequence_id_ %d\n",
+        filepath.c_str(), sequence_id_);
+
+    // Index the records. Conditional puts that fail use up a sequence
+    // number without being logged, so sequence ids may skip numbers but never
+    // go back. Records of one user stay in log order within their share.
+    size_t threads = REPLAY_THREADS > 0
+                         ? REPLAY_THREADS
+                         : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<WalRecord>> shares(threads);
+    std::hash<std::string_view> hash_user;
+    WalReader reader(loggings);
+    WalRecord record;
+    int last_seq = sequence_id_;
+    size_t records = 0;
+    while (reader.Next(record)) {
+        // Already applied by the snapshot
+        if (record.seq <= snapshot_seq_) {
+            continue;
+        }
+        if (record.seq <= last_seq) {
+            warn(
+                "#KvCacheError: Replay FAILED at sequence id %d after %d.\n",
+                record.seq, last_seq);
+            return REC_ERROR;
+        }
+        last_seq = record.seq;
+        shares[hash_user(record.user) % threads].push_back(record);
+        records += 1;
+    }
 
-    int seq_num = 0;
-    std::smatch match;
-    while (std::regex_search(loggings, match, kLoggingHeaderRegex)) {
-        int seq_num = std::stoi(match[1]);
-        std::string user = match[2];
-        std::string key = match[3];
-        std::string op_type = match[4];
-        int length = std::stoi(match[5]);
-        int new_str_start = match.position() + match.length();
-
-        if (op_type.compare(kPuts) == 0) {
-            // Replay puts
-            std::string value = loggings.substr(new_str_start, length);
-            // Plus one for the newline char
-            new_str_start += value.size() + 1;
-
-            if (Puts(user, key, value, seq_num, /*logging_enabled=*/false) !=
-                FINISHED) {
-                warn(
-                    "#KvCacheError: Replay FAILED for PUTS request for user %s "
-                    "and "
-                    "key %s.\n",
-                    user.c_str(), key.c_str());
-                return REC_ERROR;
+    // Blob references are counted under blob_mtx_. Counts only add up, so
+    // users sharing a blob may be replayed in any order.
+    std::atomic<bool> failed{false};
+    auto replay_share = [&](const std::vector<WalRecord>& share) {
+        for (const WalRecord& entry : share) {
+            if (failed) {
+                return;
             }
-
-        } else if (op_type.compare(kDele) == 0) {
-            if (Dele(user, key, seq_num, /*logging_enabled=*/false) !=
-                FINISHED) {
-                warn(
-                    "#KvCacheError: Replay FAILED for Dele request for user %s "
-                    "and "
-                    "key %s.\n",
-                    user.c_str(), key.c_str());
-                return REC_ERROR;
+            if (ReplayRecord(entry) != FINISHED) {
+                failed = true;
             }
-
-        } else {
-            warn("#KvCacheError: Invalid operation %s when replaying.\n",
-                 op_type.c_str());
         }
-
-        loggings = loggings.substr(new_str_start, loggings.length());
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        if (!shares[i].empty()) {
+            workers.emplace_back(replay_share, std::cref(shares[i]));
+        }
+    }
+    replay_share(shares[0]);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (failed) {
+        return REC_ERROR;
+    }
+    sequence_id_ = last_seq;
+    debug("#KvCache-Replay: Replayed %zu entries of %s on %zu threads\n",
+          records, filepath.c_str(), threads);
+
+    // A torn record at the tail is what a crash in the middle of an append
+    // leaves behind. Everything before it has been replayed.
+    // The torn bytes are cut off so new entries are not appended after them.
+    if (reader.Corrupted()) {
+        warn(
+            "#KvCacheError: Replay stopped at corrupted record at offset %zu "
+            "of %zu bytes.\n",
+            reader.Offset(), loggings.size());
+        if (truncate(filepath.c_str(), reader.Offset()) != 0) {
+            warn("#KvCacheError: Failed to cut off corrupted log tail.\n");
+            return REC_ERROR;
+        }
     }
 
-    max_sequence = sequence_id_;
-    debug_v2(
-        "#KvCache-Replay: Max sequence updated to align with sequence_id_: "
-        "%d\n",
-        max_sequence);
     return FINISHED;
 }
 
-int KvCache::Log(const std::string& entry) {
-    std::fstream fs;
+int KvCache::ReplayRecord(const WalRecord& record) {
+    std::string user(record.user);
+    std::string key(record.key);
 
-    fs.open(kLogFp_, std::ios::out | std::ios::app | std::ios::binary);
-    if (!fs.is_open()) {
+    if (record.op == kWalDele) {
+        return Puts(user, key, "");
+    }
+    if (record.op != kWalPuts && record.op != kWalPutsBlob) {
+        warn("#KvCacheError: Invalid operation %d when replaying.\n",
+             record.op);
+        return FINISHED;
+    }
+
+    std::string value;
+    if (!DecompressValue(record.codec, record.value, value)) {
         warn(
-            "#KvCacheError: Failed to open loging file for recording entry. "
-            "Entry %s is "
-            "not "
-            "logged.\n",
-            entry.c_str());
-        return LOG_ERROR;
+            "#KvCacheError: Replay FAILED to decompress value of user %s and "
+            "key %s.\n",
+            user.c_str(), key.c_str());
+        return REC_ERROR;
     }
 
-    debug_v3("#KvCache: writing entry to logging: %s\n", entry.c_str());
-    fs << entry;
-    fs.close();
+    // Large values logged in full, e.g. by another node, move to the value
+    // log now
+    std::string pointer;
+    const std::string& owner = record.op == kWalPuts ? user : kBlobUser;
+    const std::string& owner_key =
+        record.op == kWalPuts ? key : std::string(record.blob_hash);
+    if (!WriteValueLog(owner, owner_key, value, pointer)) {
+        warn(
+            "#KvCacheError: Replay FAILED for PUTS request for user %s and key "
+            "%s.\n",
+            user.c_str(), key.c_str());
+        return REC_ERROR;
+    }
+    if (!pointer.empty()) {
+        value.swap(pointer);
+    }
+
+    if (record.op == kWalPuts) {
+        return Puts(user, key, std::move(value));
+    }
+    std::lock_guard<std::mutex> lock(blob_mtx_);
+    ApplyBlobPut(user, key, std::string(record.blob_hash), std::move(value));
+    return FINISHED;
+}
+
+int KvCache::Log(uint64_t ticket) {
+    if (!log_writer_.Wait(ticket)) {
+        warn(
+            "#KvCacheError: Failed to append to logging file. Entry %lu is "
+            "not logged.\n",
+            ticket);
+        return LOG_ERROR;
+    }
     return FINISHED;
 }
 
 int KvCache::Puts(const std::string& user, const std::string& key,
-                  const std::string& value) {
-    if (updates_cache_.find(user) == updates_cache_.end()) {
-        // Load from KV and update
-        updates_cache_[user] = {};
+                  std::string value) {
+    std::string old_hash;
+    if (user != kBlobUser && ReadBlobRef(user, key, old_hash)) {
+        std::lock_guard<std::mutex> lock(blob_mtx_);
+        AdjustBlobRefs(old_hash, -1);
     }
-    updates_cache_[user][key] = value;
 
-    // Update read cache if the updated KV pair was in the read-only cache as
-    // well.
-    if (read_cache_.find(user) != updates_cache_.end()) {
-        auto& user_map = read_cache_[user];
-        if (user_map.find(key) != user_map.end()) {
-            user_map.erase(key);
-        }
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    ApplyUpdate(user, key, std::move(value));
+    return FINISHED;
+}
 
-        if (user_map.empty()) {
-            read_cache_.erase(user);
+void KvCache::ApplyBlobPut(const std::string& user, const std::string& key,
+                           const std::string& hash, std::string content) {
+    if (!content.empty() && !BlobStored(hash)) {
+        if (!users_.Has(kBlobUser)) {
+            CreateUser(kBlobUser);
         }
+        std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+        ApplyUpdate(kBlobUser, hash, std::move(content));
     }
+    // Count the new reference before dropping the old one, in case both are
+    // to the same blob
+    AdjustBlobRefs(hash, 1);
 
-    return FINISHED;
+    std::string old_hash;
+    if (ReadBlobRef(user, key, old_hash)) {
+        AdjustBlobRefs(old_hash, -1);
+    }
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    ApplyUpdate(user, key, MakeBlobRef(hash));
 }
 
-bool KvCache::ValidateAndUpdateSeqNum(int new_seq) {
-    if (new_seq != sequence_id_ + 1) {
+bool KvCache::ReadBlobRef(const std::string& user, const std::string& key,
+                          std::string& hash) {
+    std::string value;
+    if (!ReadSmallValue(user, key, kBlobRefSize, value) || !IsBlobRef(value)) {
         return false;
     }
-
-    sequence_id_ = new_seq;
+    hash = BlobRefHash(value);
     return true;
 }
 
+bool KvCache::ReadSmallValue(const std::string& user, const std::string& key,
+                             size_t max_size, std::string& value) {
+    {
+        std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+        std::vector<const UpdatesMap*> generations = {&updates_cache_};
+        if (frozen_updates_ != nullptr) {
+            generations.push_back(frozen_updates_.get());
+        }
+        for (const UpdatesMap* generation : generations) {
+            auto user_updates = generation->find(user);
+            if (user_updates == generation->end()) {
+                continue;
+            }
+            auto it = user_updates->second.find(key);
+            if (it != user_updates->second.end()) {
+                if (it->second.empty() || it->second.size() > max_size) {
+                    return false;
+                }
+                value = it->second;
+                return true;
+            }
+        }
+    }
+
+    return engine_->GetSmall(user, key, max_size, value);
+}
+
+bool KvCache::BlobStored(const std::string& hash) {
+    {
+        std::shared_lock<std::shared_mutex> lock(updates_mtx_);
+        std::vector<const UpdatesMap*> generations = {&updates_cache_};
+        if (frozen_updates_ != nullptr) {
+            generations.push_back(frozen_updates_.get());
+        }
+        for (const UpdatesMap* generation : generations) {
+            auto blobs = generation->find(kBlobUser);
+            if (blobs == generation->end()) {
+                continue;
+            }
+            auto it = blobs->second.find(hash);
+            if (it != blobs->second.end()) {
+                return !it->second.empty();
+            }
+        }
+    }
+
+    return engine_->Contains(kBlobUser, hash);
+}
+
+void KvCache::AdjustBlobRefs(const std::string& hash, int delta) {
+    std::string refs_key = hash + kBlobRefsSuffix;
+    ValueRef stored;
+    long count = 0;
+    if (Lookup(kBlobUser, refs_key, stored) == FINISHED) {
+        count = std::stol(*stored);
+    }
+    count += delta;
+
+    // Zero references are stored as a deletion
+    std::string refs;
+    if (count <= 0) {
+        unreferenced_blobs_.insert(hash);
+    } else {
+        unreferenced_blobs_.erase(hash);
+        refs = std::to_string(count);
+    }
+    std::unique_lock<std::shared_mutex> lock(updates_mtx_);
+    ApplyUpdate(kBlobUser, refs_key, refs);
+}
+
+void KvCache::CollectUnreferencedBlobs() {
+    std::lock_guard<std::mutex> lock(blob_mtx_);
+    if (unreferenced_blobs_.empty()) {
+        return;
+    }
+    debug("#KvCache: Ckpt: deleting %zu unreferenced blobs\n",
+          unreferenced_blobs_.size());
+    std::unique_lock<std::shared_mutex> updates_lock(updates_mtx_);
+    for (const auto& hash : unreferenced_blobs_) {
+        ApplyUpdate(kBlobUser, hash, "");
+    }
+    unreferenced_blobs_.clear();
+}
+
+void KvCache::ApplyUpdate(const std::string& user, const std::string& key,
+                          std::string value) {
+    CompactKvMap& user_updates = updates_cache_[user];
+    if (user_updates.empty()) {
+        updates_bytes_ += user.size();
+    }
+    size_t value_size = value.size();
+    size_t replaced = 0;
+    if (user_updates.Put(key, std::move(value), replaced)) {
+        updates_bytes_ += key.size() + value_size;
+    } else {
+        updates_bytes_ += value_size;
+        updates_bytes_ -= replaced;
+    }
+
+    // Update read cache if the updated KV pair was in the read-only cache as
+    // well.
+    read_cache_.Erase(user, key);
+}
+
+int KvCache::AwaitSeqNum(int seq_num, int& expected) {
+    std::unique_lock<std::mutex> lock(seq_mtx_);
+    if (!needs_resync_) {
+        seq_cv_.wait_for(lock, kSeqTimeout_,
+                         [&] { return seq_num <= sequence_id_ + 1; });
+    }
+    expected = sequence_id_ + 1;
+    if (seq_num == expected && !needs_resync_) {
+        return FINISHED;
+    }
+    if (seq_num < expected) {
+        return SEQ_ERROR;
+    }
+    if (needs_resync_) {
+        return SYNC_ERROR;
+    }
+
+    // The writes between expected and seq_num never arrived
+    if (isPrimary) {
+        warn("#KvCacheError: Skipping missing seq %d to %d.\n", expected,
+             seq_num - 1);
+        sequence_id_ = seq_num - 1;
+        expected = seq_num;
+        return FINISHED;
+    }
+    warn("#KvCacheError: Missing seq %d to %d, node needs a resync.\n",
+         expected, seq_num - 1);
+    needs_resync_ = true;
+    return SYNC_ERROR;
+}
+
+void KvCache::FinishSeqNum(int seq_num) {
+    {
+        std::lock_guard<std::mutex> lock(seq_mtx_);
+        sequence_id_ = seq_num;
+    }
+    seq_cv_.notify_all();
+}
+
 std::string KvCache::FormatPuts(const std::string& user, const std::string& key,
                                 const std::string& value, int seq_num) {
-    std::stringstream ss;
-    ss << "KvStoreLogEntry Seq " << seq_num << " user " << user << " key "
-       << key << " op " << kPuts << " length " << value.size() << "\n"
-       << value << "\n";
-    return ss.str();
+    // Runs before the sequence turn, so only the fast codec is used
+    std::string packed;
+    Codec codec = PackValue(value, /*background=*/false, packed);
+    if (codec == CODEC_NONE) {
+        return EncodeWalRecord(kWalPuts, seq_num, user, key, value);
+    }
+    return EncodeWalRecord(kWalPuts, seq_num, user, key, packed, codec);
 }
 
 std::string KvCache::FormatDele(const std::string& user, const std::string& key,
                                 int seq_num) {
-    std::stringstream ss;
-    ss << "KvStoreLogEntry Seq " << seq_num << " user " << user << " key "
-       << key << " op " << kDele << " length 0"
-       << "\n";
-    return ss.str();
+    return EncodeWalRecord(kWalDele, seq_num, user, key, "");
 }
 
 bool KvCache::OverwriteFile(const std::string& filepath,
@@ -931,6 +2015,8 @@ bool KvCache::OverwriteFile(const std::string& filepath,
 
 int KvCache::ReadFileAndWriteTo(const std::string& filepath,
                                 ssize_t expected_file_size, int fd) {
+    // Streaming paces itself to leave the disk to the users of the node
+    io_scheduler.Acquire(IO_SYNC, expected_file_size);
     std::string content;
     if (!read_file(filepath, content)) {
         warn(
@@ -949,6 +2035,11 @@ int KvCache::ReadFileAndWriteTo(const std::string& filepath,
             filepath.c_str(), content.size(), expected_file_size);
     }
 
+    return WriteFileTo(filepath, content, fd);
+}
+
+int KvCache::WriteFileTo(const std::string& filepath,
+                         const std::string& content, int fd) {
     std::stringstream ss;
     std::string sent_fp = filepath.substr(PREFIX.length(), filepath.length());
     ss << "KvStoreSync Filename: " << sent_fp << " Type: " << kFile
@@ -983,6 +2074,11 @@ bool KvCache::MatchHeaderAndExtractContent(const std::string& filestr,
 
 bool KvCache::ExtractCheckpointSequenceIdFromLoggings(
     const std::string& loggings, int& id) {
+    if (DecodeWalHeader(loggings, id)) {
+        return true;
+    }
+
+    // Text log from before the binary format
     std::smatch match;
     if (!std::regex_search(loggings, match, kLoggingSequenceIdHeader)) {
         warn(
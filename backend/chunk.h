@@ -1,19 +1,79 @@
 #ifndef CHUNK_H_
 #define CHUNK_H_
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <string_view>
 #include <utility>
 #include <unordered_set>
 #include <unordered_map>
 
+#include "compression.h"
+#include "io_scheduler.h"
 #include "kv_config.h"
+#include "wal.h"
 #include "../common/kv_interface.h"
 #include "../common/file_operation.h"
 
 #define SIZE_LIMIT (1 << 26)
+// Rewrite the manifest once it holds this many records per live key
+#define MANIFEST_COMPACT_RATIO 2
+// Manifests smaller than this many records are never rewritten
+#define MANIFEST_COMPACT_MIN 1024
+
+// Compact a chunk once this percentage of its bytes is garbage
+#define COMPACT_GARBAGE_PERCENT 50
+// Chunks with less garbage than this are left alone
+#define COMPACT_MIN_DEAD_BYTES (1 << 20)
+// Most chunks compacted by one checkpoint
+#define COMPACT_MAX_CHUNKS 4
+
+// Operation of one manifest record
+enum ManifestOp : uint8_t{
+    MANIFEST_PUT = 1,
+    MANIFEST_TOMBSTONE = 2,
+    // A put whose location is followed by the codec of the value
+    MANIFEST_PUT_PACKED = 3,
+};
+
+// A manifest starts with this magic, which holds its version, then holds
+// records of
+//   op (uint8) | key size (uint32) | key | [id, offset, length (uint64)
+//   each) | [codec (uint8)] | crc32 of the record before it (uint32)
+constexpr char kManifestMagic[8] = {'K', 'V', 'M', 'A', 'N', '0', '0', '1'};
 
 typedef std::unordered_map<std::string, std::string> KV_Map;
 
+// Where the value of one key lives in the chunk files
+struct ChunkLocation{
+    uint64_t id = 0;
+    uint64_t offset = 0;
+    // Stored bytes, which are packed unless codec is CODEC_NONE
+    uint64_t length = 0;
+    uint8_t codec = CODEC_NONE;
+};
+
+// Flush one file (or directory) to disk
+bool sync_path(const std::string& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    bool ret = (fsync(fd) == 0);
+    close(fd);
+    return ret;
+}
+
+// Bytes of current and overwritten records in one chunk file
+struct ChunkStats{
+    uint64_t live_bytes = 0;
+    uint64_t dead_bytes = 0;
+};
+
 // Chunk information for each user (in disk)
 struct Chunk{
     uint64_t append_index;
@@ -22,15 +82,22 @@ struct Chunk{
     std::string usr;
     std::string folder;
 
-    // The mapping from key to chunk id
-    std::unordered_map<std::string, uint64_t> metadata;
-    // The key (and the chunk id) to delete
-    std::vector<std::pair<std::string, uint64_t>> del_list;
+    // The mapping from key to the location of its value
+    std::unordered_map<std::string, ChunkLocation> metadata;
+    // Live and dead bytes of each chunk, to pick what to compact
+    std::unordered_map<uint64_t, ChunkStats> stats;
+    // Keys whose location changed since the manifest was last written
+    std::unordered_set<std::string> dirty;
+    // Number of records in the manifest file
+    uint64_t manifest_records = 0;
+    // Whether the manifest file has the format without checksums
+    // Chunks written since the last sync_files
+    std::unordered_set<uint64_t> unsynced;
     
     // Read the chunk information
     int init(std::string _usr){
         usr = _usr;
-        folder = PREFIX + usr;
+        folder = user_folder(usr);
         if(!exist_file(folder.c_str())){
 			return USER_ERROR;
 		}
@@ -47,51 +114,323 @@ struct Chunk{
             current_size = 0;
         }
 
-        if(read_file(folder + "/chunk_metadata", text)){
-            auto vec = split(text, '\n');
-            for(auto it = vec.begin();it != vec.end();){
-                std::string key = *it;
-                it += 1;
-                if(it == vec.end())
-                    break;
-                uint64_t value = stoull(*it);
-                it += 1;
-                metadata[key] = value;
+        if(!load_manifest())
+            load_text_metadata();
+
+        // Overwritten records are tracked as dead bytes, the delete list of
+        // older versions is no longer used
+        std::remove((folder + "/delete_list").c_str());
+        load_stats();
+        return FINISHED;
+    }
+
+    // Text metadata from before the manifest existed. It is replaced by a
+    // full manifest at the next checkpoint.
+    bool load_text_metadata(){
+        std::string text;
+        if(!read_file(folder + "/chunk_metadata", text))
+            return false;
+
+        // Each key is followed by "id offset length". Metadata written
+        // before offsets were recorded only holds the chunk id, and those
+        // chunks are scanned once to locate the values.
+        std::unordered_set<uint64_t> unindexed;
+        auto vec = split(text, '\n');
+        for(auto it = vec.begin();it != vec.end();){
+            std::string key = *it;
+            it += 1;
+            if(it == vec.end())
+                break;
+            auto fields = split(*it, ' ');
+            it += 1;
+            ChunkLocation& loc = metadata[key];
+            loc.id = stoull(fields[0]);
+            if(fields.size() == 3){
+                loc.offset = stoull(fields[1]);
+                loc.length = stoull(fields[2]);
+            }
+            else{
+                unindexed.insert(loc.id);
             }
         }
 
-        return FINISHED;
+        for(uint64_t index : unindexed){
+            for(auto& [key, loc] : scan_chunk(index)){
+                auto found = metadata.find(key);
+                if(found != metadata.end() && found->second.id == index)
+                    found->second = loc;
+            }
+        }
+
+        return true;
     }
 
-    // Read the value of key in the chunk
-    int get_value(std::string key, std::string& value){
-        if(metadata.find(key) == metadata.end())
-            return KEY_ERROR;
-        
-        std::string path = folder + "/chunk-" + std::to_string(metadata[key]);
-        std::ifstream file(path, std::ios::binary);
-        if(!file.is_open())
-            return KEY_ERROR;
+    std::string manifest_path(){
+        return folder + "/chunk_manifest";
+    }
+
+    // Replay the manifest, the last record of each key wins. A torn or
+    // corrupted tail is cut off, so that later appends follow the last
+    // record that could be read.
+    bool load_manifest(){
+        std::vector<char> data;
+        if(!read_file(manifest_path(), data))
+            return false;
+
+        const char* begin = data.data();
+        const char* end = begin + data.size();
+        size_t magic_size = std::min(data.size(), sizeof(kManifestMagic));
+        if(memcmp(begin, kManifestMagic, magic_size) != 0){
+            // Kept aside, so that new records do not follow it
+            warn("#KvCacheError: Manifest of user %s has an unknown format, "
+                 "moving it aside.\n", usr.c_str());
+            std::rename(manifest_path().c_str(), (manifest_path() + ".bad").c_str());
+            return false;
+        }
+        if(data.size() < sizeof(kManifestMagic)){
+            // Torn before the first record was written
+            truncate(manifest_path().c_str(), 0);
+            return true;
+        }
+
+        const char* p = begin + sizeof(kManifestMagic);
+        const char* valid = p;
+        while(p < end){
+            std::string key;
+            ChunkLocation loc;
+            uint8_t op;
+            if(!decode_manifest_record(p, end, op, key, loc))
+                break;
+            if(op == MANIFEST_TOMBSTONE)
+                metadata.erase(key);
+            else
+                metadata[key] = loc;
+            manifest_records += 1;
+            valid = p;
+        }
+
+        if(valid != end){
+            warn("#KvCacheError: Manifest of user %s is corrupted at offset "
+                 "%ld, dropping %ld bytes.\n",
+                 usr.c_str(), valid - begin, end - valid);
+            truncate(manifest_path().c_str(), valid - begin);
+        }
+        return true;
+    }
+
+    // Decode the record at p and move p past it. Returns false for a torn
+    // record, a checksum mismatch or an unknown op.
+    bool decode_manifest_record(const char*& p, const char* end, uint8_t& op,
+                                std::string& key, ChunkLocation& loc){
+        uint32_t key_size;
+        if(end - p < (long)(sizeof(op) + sizeof(key_size)))
+            return false;
+        memcpy(&op, p, sizeof(op));
+        memcpy(&key_size, p + sizeof(op), sizeof(key_size));
+        if(op != MANIFEST_PUT && op != MANIFEST_TOMBSTONE
+                && op != MANIFEST_PUT_PACKED)
+            return false;
+
+        size_t size = sizeof(op) + sizeof(key_size) + key_size;
+        if(op != MANIFEST_TOMBSTONE)
+            size += 3 * sizeof(uint64_t);
+        if(op == MANIFEST_PUT_PACKED)
+            size += sizeof(loc.codec);
+        if((size_t)(end - p) < size + sizeof(uint32_t))
+            return false;
+        if(KvCache::ReadRaw<uint32_t>(p + size) != KvCache::Crc32(p, size))
+            return false;
+
+        p += sizeof(op) + sizeof(key_size);
+        key.assign(p, key_size);
+        p += key_size;
+        if(op != MANIFEST_TOMBSTONE){
+            memcpy(&loc.id, p, sizeof(uint64_t));
+            memcpy(&loc.offset, p + sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&loc.length, p + 2 * sizeof(uint64_t), sizeof(uint64_t));
+            p += 3 * sizeof(uint64_t);
+        }
+        if(op == MANIFEST_PUT_PACKED){
+            loc.codec = *p;
+            p += sizeof(loc.codec);
+        }
+        p += sizeof(uint32_t);
+        return true;
+    }
+
+    // Encode the current state of key as one manifest record
+    void encode_manifest_record(std::string& out, const std::string& key){
+        size_t start = out.size();
+        auto it = metadata.find(key);
+        uint8_t op = MANIFEST_TOMBSTONE;
+        if(it != metadata.end())
+            op = (it->second.codec == CODEC_NONE)? MANIFEST_PUT : MANIFEST_PUT_PACKED;
+        uint32_t key_size = key.size();
+        out.append((const char*)&op, sizeof(op));
+        out.append((const char*)&key_size, sizeof(key_size));
+        out.append(key);
+        if(op != MANIFEST_TOMBSTONE){
+            out.append((const char*)&it->second.id, sizeof(uint64_t));
+            out.append((const char*)&it->second.offset, sizeof(uint64_t));
+            out.append((const char*)&it->second.length, sizeof(uint64_t));
+        }
+        if(op == MANIFEST_PUT_PACKED)
+            out.append((const char*)&it->second.codec, sizeof(uint8_t));
+        KvCache::AppendRaw<uint32_t>(
+            out, KvCache::Crc32(out.data() + start, out.size() - start));
+    }
+
+    bool need_manifest_compaction(){
+        if(manifest_records == 0)
+            return !metadata.empty();
+        return manifest_records > MANIFEST_COMPACT_MIN
+            && manifest_records > MANIFEST_COMPACT_RATIO * metadata.size();
+    }
+
+    // Rewrite the manifest with one record per live key
+    bool compact_manifest(){
+        std::string data(kManifestMagic, sizeof(kManifestMagic));
+        for(auto it = metadata.begin();it != metadata.end();++it){
+            encode_manifest_record(data, it->first);
+        }
+
+        std::string tmp = manifest_path() + ".tmp";
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), data.size());
+        file.close();
+        if(!file || std::rename(tmp.c_str(), manifest_path().c_str()) != 0)
+            return false;
+
+        manifest_records = metadata.size();
+        std::remove((folder + "/chunk_metadata").c_str());
+        return true;
+    }
+
+    // Append the records of changed keys to the manifest
+    bool append_manifest(){
+        std::string data;
+        for(auto it = dirty.begin();it != dirty.end();++it){
+            encode_manifest_record(data, *it);
+        }
+
+        std::ofstream file(manifest_path(), std::ios::binary | std::ios::app);
+        file.seekp(0, std::ios::end);
+        if(file.tellp() == 0)
+            data.insert(0, kManifestMagic, sizeof(kManifestMagic));
+        file.write(data.data(), data.size());
+        file.close();
+        if(!file)
+            return false;
+
+        manifest_records += dirty.size();
+        return true;
+    }
+
+    std::string chunk_path(uint64_t index){
+        return folder + "/chunk-" + std::to_string(index);
+    }
 
+    // Locate every record in one chunk file without reading the values
+    std::vector<std::pair<std::string, ChunkLocation>> scan_chunk(uint64_t index){
+        std::vector<std::pair<std::string, ChunkLocation>> ret;
+        std::ifstream file(chunk_path(index), std::ios::binary);
         std::string _key, _size;
-        std::vector<char> _value;
-        bool find = false;
+
         while(std::getline(file, _key)){
             std::getline(file, _size);
-            uint64_t size = stoull(_size);
-            if(key == _key){
-                _value.resize(size);
-	            file.read(_value.data(), size);
-                value = binary_to_text(_value);
-                find = true;
-            }
-            else{
-                file.seekg(size + file.tellg());
-            }
+            ChunkLocation loc;
+            loc.id = index;
+            loc.offset = file.tellg();
+            // "length" or, for packed values, "length codec"
+            size_t pos = 0;
+            loc.length = stoull(_size, &pos);
+            if(pos < _size.size())
+                loc.codec = stoul(_size.substr(pos + 1));
+            ret.push_back({_key, loc});
+            file.seekg(loc.offset + loc.length);
         }
+
+        return ret;
+    }
+
+    // A demoted chunk: the whole chunk file packed with CODEC_DENSE
+    std::string cold_path(uint64_t index){
+        return chunk_path(index) + ".cold";
+    }
+
+    // Replace the file at path by data in one rename
+    static bool replace_file(const std::string& path, const std::string& data){
+        std::string tmp = path + ".tmp";
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file.write(data.data(), data.size());
         file.close();
+        if(!file || (wal_sync_mode != WAL_SYNC_NONE && !sync_path(tmp))
+                || std::rename(tmp.c_str(), path.c_str()) != 0){
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Recompress a chunk that is no longer appended to into the cold format
+    // and drop the original. Returns the bytes saved, or 0 if the chunk is
+    // left as it is, e.g. because it does not compress.
+    uint64_t demote(uint64_t index){
+        std::string raw, packed;
+        if(index == append_index || !read_file(chunk_path(index), raw)
+                || raw.empty() || !CompressValue(CODEC_DENSE, raw, packed))
+            return 0;
+        io_scheduler.Charge(IO_COMPACTION, raw.size() + packed.size());
+        if(!replace_file(cold_path(index), packed)
+                || (wal_sync_mode != WAL_SYNC_NONE && !sync_path(folder)))
+            return 0;
+        std::remove(chunk_path(index).c_str());
+        return raw.size() - packed.size();
+    }
+
+    // Bring a demoted chunk back, so that the offsets in the metadata point
+    // into it again. io is the class of whoever needs the chunk.
+    bool promote(uint64_t index, IoClass io){
+        std::string packed, raw;
+        if(!read_file(cold_path(index), packed)
+                || !DecompressValue(CODEC_DENSE, packed, raw))
+            return false;
+        io_scheduler.Charge(io, packed.size() + raw.size());
+        if(!replace_file(chunk_path(index), raw)
+                || (wal_sync_mode != WAL_SYNC_NONE && !sync_path(folder)))
+            return false;
+        std::remove(cold_path(index).c_str());
+        return true;
+    }
+
+    // Read the value of key in the chunk with a single positioned read. A
+    // demoted chunk is promoted first.
+    int get_value(const std::string& key, std::string& value){
+        auto it = metadata.find(key);
+        if(it == metadata.end())
+            return KEY_ERROR;
+
+        const ChunkLocation& loc = it->second;
+        std::ifstream file(chunk_path(loc.id), std::ios::binary);
+        if(!file.is_open() && exist_file(cold_path(loc.id).c_str())){
+            if(!promote(loc.id, IO_FOREGROUND))
+                return KEY_ERROR;
+            file.open(chunk_path(loc.id), std::ios::binary);
+        }
+        if(!file.is_open())
+            return KEY_ERROR;
+
+        std::string packed;
+        std::string& stored = (loc.codec == CODEC_NONE)? value : packed;
+        stored.resize(loc.length);
+        io_scheduler.Charge(IO_FOREGROUND, loc.length);
+        file.seekg(loc.offset);
+        if(!file.read(stored.data(), loc.length))
+            return KEY_ERROR;
+        if(loc.codec != CODEC_NONE && !DecompressValue((Codec)loc.codec, packed, value))
+            return KEY_ERROR;
 
-        return find? FINISHED : KEY_ERROR;
+        return FINISHED;
     }
 
     // Get all key-value pairs
@@ -108,46 +447,82 @@ struct Chunk{
         return ret;
     }
 
-    // Append one key-value pair in chunk
-    bool append_kv(std::ofstream& file, std::string key, std::string value){
-        std::string data = key + "\n" + std::to_string(value.size())
-                    + "\n" + value;
-        file.write(data.data(), data.size());
-        return true;
+    // Append one key-value pair in chunk, return the offset of the value.
+    // A packed value records its codec after the length.
+    uint64_t append_kv(std::ofstream& file, const std::string& key, std::string_view value,
+                       uint8_t codec = CODEC_NONE){
+        std::string header = key + "\n" + std::to_string(value.size());
+        if(codec != CODEC_NONE)
+            header += " " + std::to_string(codec);
+        header += "\n";
+        uint64_t offset = (uint64_t)file.tellp() + header.size();
+        file.write(header.data(), header.size());
+        file.write(value.data(), value.size());
+        return offset;
     }
 
-    // Append key-value pairs in chunk (for checkpoint)
-    int append_kvs(KV_Map mp){
-        std::string path = folder + "/chunk-" + std::to_string(append_index);
-        std::ofstream file(path, std::ios::binary | std::ios::app);
+    // Append key-value pairs in chunk (for checkpoint). Works on any map
+    // whose entries convert to string views, e.g. KV_Map and CompactKvMap.
+    template <typename Map>
+    int append_kvs(const Map& mp){
+        std::ofstream file(chunk_path(append_index), std::ios::binary | std::ios::app);
+        file.seekp(0, std::ios::end);
+        unsynced.insert(append_index);
+        std::string packed;
+
+        for(auto it = mp.begin();it != mp.end() && file;++it){
+            std::string key(it->first);
+            std::string_view value = it->second;
+            auto old = metadata.find(key);
+            if(old != metadata.end()){
+                mark_dead(key, old->second);
+            }
 
-        for(auto it = mp.begin();it != mp.end();++it){
-            if(it->second == ""){
-                del_list.push_back({it->first, metadata[it->first]});
-                metadata.erase(it->first);
+            if(value.empty()){
+                if(old != metadata.end()){
+                    metadata.erase(old);
+                    dirty.insert(key);
+                }
             }
             else{
-                if(metadata.find(it->first) != metadata.end()){
-                    del_list.push_back({it->first, metadata[it->first]});
-                }
+                // Flushes run in the background, so values may use the
+                // dense codec
+                Codec codec = PackValue(value, /*background=*/true, packed);
+                std::string_view stored = (codec == CODEC_NONE)? value : packed;
+                io_scheduler.Charge(IO_FLUSH, key.size() + stored.size());
+                ChunkLocation& loc = metadata[key];
+                loc.id = append_index;
+                loc.offset = append_kv(file, key, stored, codec);
+                loc.length = stored.size();
+                loc.codec = codec;
+                dirty.insert(key);
+                stats[append_index].live_bytes += record_bytes(key, loc);
 
-                append_kv(file, it->first, it->second);
-                metadata[it->first] = append_index;
-                
                 current_size = file.tellp();
                 if(current_size > SIZE_LIMIT){
                     append_index += 1;
                     current_size = 0;
                     file.close();
-                    path = folder + "/chunk-" + std::to_string(append_index);
-                    file.open(path, std::ios::binary | std::ios::app);
+                    file.open(chunk_path(append_index), std::ios::binary | std::ios::app);
+                    unsynced.insert(append_index);
                 }
             }
         }
 
         file.close();
-        write_meta_back();
-        lazy_delete();
+        // A failed write leaves the index and the manifest as they were, so
+        // the checkpoint keeps its snapshot and log and writes this again
+        if(!file){
+            warn("#KvCacheError: failed to append to chunk %lu of user %s.\n",
+                 append_index, folder.c_str());
+            return LOG_ERROR;
+        }
+        if(!write_meta_back()){
+            warn("#KvCacheError: failed to write the manifest of user %s.\n",
+                 folder.c_str());
+            return LOG_ERROR;
+        }
+        compact();
         return FINISHED;
     }
 
@@ -159,90 +534,158 @@ struct Chunk{
         std::string data = std::to_string(append_index) + "\n" + std::to_string(current_size);
         file.write(data.data(), data.size());
         file.close();
+        if(!file)
+            return false;
 
-        path = folder + "/chunk_metadata";
-        file.open(path, std::ios::binary);
-        for(auto it = metadata.begin();it != metadata.end();++it){
-            data = it->first + "\n" + std::to_string(it->second) + "\n";
-            file.write(data.data(), data.size());
-        }
-        file.close();
+        // Only changed keys are written, unless the manifest has grown too
+        // large compared to the live keys
+        bool ok = need_manifest_compaction()? compact_manifest() : append_manifest();
+        if(ok)
+            dirty.clear();
+
+        return ok;
+    }
 
-        path = folder + "/delete_list";
-        file.open(path, std::ios::binary | std::ios::app);
-        for(auto it = del_list.begin();it != del_list.end();++it){
-            data = it->first + "\n" + std::to_string(it->second) + "\n";
-            file.write(data.data(), data.size());
+    // Make everything written by checkpoints durable
+    bool sync_files(){
+        bool ok = true;
+        for(uint64_t index : unsynced){
+            if(exist_file(chunk_path(index).c_str()))
+                ok = sync_path(chunk_path(index)) && ok;
         }
-        file.close();
+        if(exist_file(manifest_path().c_str()))
+            ok = sync_path(manifest_path()) && ok;
+        ok = sync_path(folder + "/chunk_index") && ok;
+        // Renames and new files live in the directory entry
+        ok = sync_path(folder) && ok;
+        if(ok)
+            unsynced.clear();
+        return ok;
+    }
 
-        return true;
+    // Size of one record in a chunk file
+    static uint64_t record_bytes(const std::string& key, const ChunkLocation& loc){
+        uint64_t codec_bytes = (loc.codec == CODEC_NONE)? 0 : 1 + std::to_string(loc.codec).size();
+        return key.size() + 1 + std::to_string(loc.length).size() + codec_bytes + 1 + loc.length;
     }
 
-    // Load one chunk file
-    std::vector<std::pair<std::string, std::string>> load_chunk(std::ifstream& file){
-        std::vector<std::pair<std::string, std::string>> ret;
-        std::string _key, _size;
-        std::vector<char> _value;
+    // The record at loc no longer holds the value of key
+    void mark_dead(const std::string& key, const ChunkLocation& loc){
+        uint64_t bytes = record_bytes(key, loc);
+        ChunkStats& st = stats[loc.id];
+        st.live_bytes -= std::min(st.live_bytes, bytes);
+        st.dead_bytes += bytes;
+    }
 
-        while(std::getline(file, _key)){
-            std::getline(file, _size);
-            uint64_t size = stoull(_size);
-            _value.resize(size);
-	        file.read(_value.data(), size);
-            ret.push_back({_key, binary_to_text(_value)});
+    // Rebuild the live/dead byte counts from the metadata and the file sizes
+    void load_stats(){
+        stats.clear();
+        for(auto it = metadata.begin();it != metadata.end();++it){
+            stats[it->second.id].live_bytes += record_bytes(it->first, it->second);
         }
 
-        return ret;
-    } 
+        std::error_code code;
+        for(const auto& dirent : std::filesystem::directory_iterator(folder, code)){
+            std::string name = dirent.path().filename().string();
+            if(name.rfind("chunk-", 0) != 0 || name.find('.') != std::string::npos)
+                continue;
+            uint64_t index = stoull(name.substr(6));
+            uint64_t size = dirent.file_size(code);
+            ChunkStats& st = stats[index];
+            st.dead_bytes = size > st.live_bytes? size - st.live_bytes : 0;
+        }
+    }
 
-    // Delete key-value pairs in chunks based on the delete list
-    bool lazy_delete(){
-        std::string text;
-        std::string path = folder + "/delete_list";
+    // Chunks worth compacting, most garbage first
+    std::vector<uint64_t> pick_victims(){
+        std::vector<std::pair<uint64_t, uint64_t>> candidates;
+        for(auto it = stats.begin();it != stats.end();++it){
+            const ChunkStats& st = it->second;
+            uint64_t total = st.live_bytes + st.dead_bytes;
+            if(st.dead_bytes < COMPACT_MIN_DEAD_BYTES)
+                continue;
+            if(st.dead_bytes * 100 >= total * COMPACT_GARBAGE_PERCENT)
+                candidates.push_back({st.dead_bytes, it->first});
+        }
 
-        if(!read_file(path, text))
-            return false;
-        
-        std::unordered_map<uint64_t, std::unordered_map<std::string, uint32_t>> del_mp;
+        std::sort(candidates.rbegin(), candidates.rend());
+        if(candidates.size() > COMPACT_MAX_CHUNKS)
+            candidates.resize(COMPACT_MAX_CHUNKS);
 
-        auto vec = split(text, '\n');
-        for(auto it = vec.begin();it != vec.end();){
-            std::string key = *it;
-            it += 1;
-            if(it == vec.end())
-                break;
-            uint64_t value = stoull(*it);
-            it += 1;
-            del_mp[value][key] += 1;
-        }
+        std::vector<uint64_t> ret;
+        for(auto& c : candidates)
+            ret.push_back(c.second);
+        return ret;
+    }
 
-        for(auto it = del_mp.begin();it != del_mp.end();++it){
-            uint64_t index = it->first;
-            std::string path = folder + "/chunk-" + std::to_string(index);
-            std::ifstream file(path, std::ios::binary);
-            auto vec = load_chunk(file);
-            file.close();
+    // Copy the live records of the chunks with the most garbage into a fresh
+    // chunk, then drop the old files once the new locations are persisted.
+    bool compact(){
+        auto victims = pick_victims();
+        if(victims.empty())
+            return false;
+        // Records are copied out of the plain chunk files
+        for(uint64_t index : victims){
+            if(!exist_file(chunk_path(index).c_str())
+                    && !promote(index, IO_COMPACTION))
+                return false;
+        }
 
-            auto mp = it->second;
-            for(auto kv = vec.begin();kv != vec.end();){
-                if(mp[kv->first] > 0){
-                    mp[kv->first] -= 1;
-                    kv = vec.erase(kv);
-                }
-                else{
-                    kv += 1;
-                }
+        uint64_t fresh = append_index + 1;
+        std::string tmp = chunk_path(fresh) + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        std::unordered_map<std::string, ChunkLocation> moved;
+        std::string value;
+
+        for(uint64_t index : victims){
+            std::ifstream in(chunk_path(index), std::ios::binary);
+            for(auto& [key, rec] : scan_chunk(index)){
+                auto loc = metadata.find(key);
+                if(loc == metadata.end() || loc->second.id != index
+                        || loc->second.offset != rec.offset)
+                    continue;
+
+                value.resize(rec.length);
+                // Read once and written once
+                io_scheduler.Charge(IO_COMPACTION, 2 * rec.length);
+                in.seekg(rec.offset);
+                in.read(value.data(), rec.length);
+                // Packed values are moved as they are
+                ChunkLocation& dst = moved[key];
+                dst.id = fresh;
+                dst.offset = append_kv(out, key, value, rec.codec);
+                dst.length = rec.length;
+                dst.codec = rec.codec;
             }
+        }
 
-            std::ofstream out(path, std::ios::binary);
-            for(auto kv = vec.begin();kv != vec.end();++kv){
-                append_kv(out, kv->first, kv->second);
-            }
-            out.close();
+        uint64_t fresh_size = out.tellp();
+        out.close();
+        if(!out || std::rename(tmp.c_str(), chunk_path(fresh).c_str()) != 0){
+            std::remove(tmp.c_str());
+            return false;
         }
 
-        remove_file(path.c_str());
+        // New appends continue in the compacted chunk
+        for(auto& [key, loc] : moved){
+            metadata[key] = loc;
+            dirty.insert(key);
+        }
+        append_index = fresh;
+        current_size = fresh_size;
+        unsynced.insert(fresh);
+        stats[fresh].live_bytes = fresh_size;
+        if(!write_meta_back())
+            return false;
+        // The moved records may no longer be in the log or a snapshot, so
+        // their new places must be durable before the old ones go
+        if(wal_sync_mode != WAL_SYNC_NONE && !sync_files())
+            return false;
+
+        for(uint64_t index : victims){
+            std::remove(chunk_path(index).c_str());
+            stats.erase(index);
+        }
         return true;
     }
 };
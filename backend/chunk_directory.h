@@ -0,0 +1,174 @@
+#ifndef CHUNK_DIRECTORY_H_
+#define CHUNK_DIRECTORY_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "chunk.h"
+#include "kv_config.h"
+
+// A loaded Chunk and the lock that serializes reads and checkpoint appends on
+// it.
+struct ResidentChunk {
+    std::mutex mtx;
+    Chunk chunk;
+    // Held while chunk is loaded from disk. Set once it has loaded.
+    std::mutex load_mtx;
+    std::atomic<bool> loaded{false};
+};
+
+// Resident per-user chunk metadata. Chunk::init parses chunk_index and
+// the manifest once per user; later lookups and checkpoints reuse and
+// update the loaded Chunk in place. Users that have been idle the longest are
+// dropped when the estimated footprint exceeds the budget. Safe to use from
+// several threads; callers lock the returned chunk while using it.
+class ChunkDirectory {
+   public:
+    explicit ChunkDirectory(size_t budget_bytes = CHUNK_DIRECTORY_BUDGET)
+        : budget_bytes_(budget_bytes) {}
+
+    // Returns the chunk information of user, loading it from disk on a miss.
+    // Returns nullptr if the user folder does not exist. Loading happens
+    // outside the directory lock; lookups of the same user wait for it.
+    std::shared_ptr<ResidentChunk> Get(const std::string& user) {
+        std::shared_ptr<ResidentChunk> resident;
+        std::unique_lock<std::mutex> load_lock;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto it = entries_.find(user);
+            if (it != entries_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+                resident = it->second.resident;
+            } else {
+                resident = std::make_shared<ResidentChunk>();
+                load_lock = std::unique_lock<std::mutex>(resident->load_mtx);
+                lru_.push_front(user);
+                Entry& entry = entries_[user];
+                entry.resident = resident;
+                entry.lru_pos = lru_.begin();
+            }
+        }
+
+        if (!load_lock.owns_lock()) {
+            if (!resident->loaded) {
+                std::lock_guard<std::mutex> wait(resident->load_mtx);
+                if (!resident->loaded) {
+                    return nullptr;
+                }
+            }
+            return resident;
+        }
+
+        bool ok = resident->chunk.init(user) == FINISHED;
+        size_t bytes = ok ? EstimateBytes(resident->chunk) : 0;
+        resident->loaded = ok;
+        load_lock.unlock();
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        // The entry may have been erased or cleared meanwhile
+        auto it = entries_.find(user);
+        if (it == entries_.end() || it->second.resident != resident) {
+            return ok ? resident : nullptr;
+        }
+        if (!ok) {
+            lru_.erase(it->second.lru_pos);
+            entries_.erase(it);
+            return nullptr;
+        }
+        it->second.bytes = bytes;
+        used_bytes_ += bytes;
+        EvictIdle();
+        return resident;
+    }
+
+    // Re-account the footprint of user after its metadata changed in place.
+    // The caller must hold the chunk lock of user.
+    void Update(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = entries_.find(user);
+        if (it == entries_.end() || !it->second.resident->loaded) {
+            return;
+        }
+        used_bytes_ -= it->second.bytes;
+        it->second.bytes = EstimateBytes(it->second.resident->chunk);
+        used_bytes_ += it->second.bytes;
+        EvictIdle();
+    }
+
+    void Erase(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = entries_.find(user);
+        if (it == entries_.end()) {
+            return;
+        }
+        used_bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru_pos);
+        entries_.erase(it);
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        entries_.clear();
+        lru_.clear();
+        used_bytes_ = 0;
+    }
+
+    size_t UsedBytes() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return used_bytes_;
+    }
+
+   private:
+    struct Entry {
+        std::shared_ptr<ResidentChunk> resident;
+        std::list<std::string>::iterator lru_pos;
+        size_t bytes = 0;
+    };
+
+    // Rough per-key cost of a metadata entry: the key, its location and the
+    // hash node around them.
+    static size_t EstimateBytes(const Chunk& chunk) {
+        size_t bytes = sizeof(Entry) + sizeof(ResidentChunk) +
+                       chunk.usr.size() + chunk.folder.size();
+        for (const auto& [key, loc] : chunk.metadata) {
+            bytes += key.size() + sizeof(ChunkLocation) + kNodeOverhead_;
+        }
+        return bytes;
+    }
+
+    // Drop least recently used users until the directory fits the budget.
+    // The most recently used user always stays resident, and so do users
+    // still referenced by a reader or a checkpoint, so that nobody reloads
+    // metadata that is being changed.
+    void EvictIdle() {
+        auto it = lru_.end();
+        while (used_bytes_ > budget_bytes_ && it != lru_.begin()) {
+            --it;
+            if (it == lru_.begin()) {
+                break;
+            }
+            auto entry = entries_.find(*it);
+            if (entry->second.resident.use_count() > 1) {
+                continue;
+            }
+            used_bytes_ -= entry->second.bytes;
+            entries_.erase(entry);
+            it = lru_.erase(it);
+        }
+    }
+
+    static constexpr size_t kNodeOverhead_ = 64;
+
+    std::mutex mtx_;
+    size_t budget_bytes_;
+    size_t used_bytes_ = 0;
+    // Most recently used user at the front
+    std::list<std::string> lru_;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef CHUNK_ENGINE_H_
+#define CHUNK_ENGINE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "chunk.h"
+#include "chunk_directory.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+#include "packed_store.h"
+#include "storage_engine.h"
+
+namespace KvCache {
+
+// Values in the order they were flushed, with an index from key to record.
+// Small users are packed into segment files shared with other users. A user
+// that outgrows PACKED_USER_MAX_BYTES moves to a folder of chunk files of
+// its own, as did every user before packing; checkpoints append to its
+// newest chunk and chunks that are mostly garbage are compacted. A folder of
+// a user that is still packed is left over from an interrupted move and
+// ignored. Chunks of users nobody reads go cold, see Tier.
+class ChunkEngine : public StorageEngine {
+   public:
+    explicit ChunkEngine(UserRegistry& users) : StorageEngine(users) {}
+
+    int Get(const std::string& user, const std::string& key,
+            std::string& value) override {
+        if (!users_.Has(user)) {
+            return USER_ERROR;
+        }
+        if (packed_.Has(user)) {
+            return packed_.Get(user, key, value);
+        }
+        // Keys that are not on disk are ruled out without loading the chunk
+        // metadata.
+        if (!filters_.MayHaveKey(user, key)) {
+            return KEY_ERROR;
+        }
+        MarkRead(user);
+
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            return KEY_ERROR;
+        }
+        std::lock_guard<std::mutex> lock(resident->mtx);
+        if (!filters_.HasKeyFilter(user)) {
+            filters_.RebuildKeys(user, resident->chunk);
+        }
+        return resident->chunk.get_value(key, value);
+    }
+
+    bool GetSmall(const std::string& user, const std::string& key,
+                  size_t max_size, std::string& value) override {
+        if (!users_.Has(user)) {
+            return false;
+        }
+        if (packed_.Has(user)) {
+            return packed_.GetSmall(user, key, max_size, value);
+        }
+        if (!filters_.MayHaveKey(user, key)) {
+            return false;
+        }
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(resident->mtx);
+        auto loc = resident->chunk.metadata.find(key);
+        return loc != resident->chunk.metadata.end() &&
+               loc->second.length <= max_size &&
+               resident->chunk.get_value(key, value) == FINISHED;
+    }
+
+    bool Contains(const std::string& user, const std::string& key) override {
+        if (!users_.Has(user)) {
+            return false;
+        }
+        if (packed_.Has(user)) {
+            return packed_.Contains(user, key);
+        }
+        if (!filters_.MayHaveKey(user, key)) {
+            return false;
+        }
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(resident->mtx);
+        return resident->chunk.metadata.count(key) > 0;
+    }
+
+    int GetAll(const std::string& user, KV_Map& kvs) override {
+        if (!users_.Has(user)) {
+            return USER_ERROR;
+        }
+        if (packed_.Has(user)) {
+            return packed_.GetAll(user, kvs) ? FINISHED : KEY_ERROR;
+        }
+        MarkRead(user);
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            kvs.clear();
+            return FINISHED;
+        }
+        std::lock_guard<std::mutex> lock(resident->mtx);
+        kvs = resident->chunk.get_all_kv();
+        return FINISHED;
+    }
+
+    // Users are flushed in parallel. Packed users are committed together
+    // once all are written. Cold chunks are demoted afterwards.
+    bool Flush(const UpdatesMap& generation) override {
+        std::vector<const UpdatesMap::value_type*> users;
+        for (const auto& entry : generation) {
+            users.push_back(&entry);
+        }
+
+        std::atomic<size_t> next{0};
+        std::atomic<bool> ok{true};
+        auto flush_users = [&]() {
+            for (size_t i = next++; i < users.size(); i = next++) {
+                const std::string& user = users[i]->first;
+                if (!users_.Has(user)) {
+                    warn("#KvCacheError: Ckpt: failed to find user %s.\n",
+                         user.c_str());
+                    continue;
+                }
+                if (!FlushUser(user, users[i]->second)) {
+                    ok = false;
+                }
+            }
+        };
+
+        size_t workers = std::min<size_t>(CHECKPOINT_THREADS, users.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < workers; ++i) {
+            threads.emplace_back(flush_users);
+        }
+        flush_users();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        if (!packed_.Commit()) {
+            warn("#KvCacheError: Ckpt: failed to commit packed users.\n");
+            return false;
+        }
+        packed_.CollectGarbage();
+        Tier();
+        return ok;
+    }
+
+    void Clear() override {
+        chunk_dir_.Clear();
+        filters_.Clear();
+        packed_.Clear();
+    }
+
+   private:
+    void MarkRead(const std::string& user) {
+        if (TIER_COLD_SEC <= 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(tier_mtx_);
+        last_read_[user] = std::chrono::steady_clock::now();
+    }
+
+    // Recompress the chunk files of users nobody has read for TIER_COLD_SEC
+    // into the cold format, at most every TIER_INTERVAL_SEC. Only files not
+    // written for that long either are demoted, and a read of one promotes
+    // it back. Every user counts as read when the node started. A user whose
+    // chunks do not compress is tried again after another period.
+    void Tier() {
+        using Clock = std::chrono::steady_clock;
+        if (TIER_COLD_SEC <= 0) {
+            return;
+        }
+        auto now = Clock::now();
+        auto cold = std::chrono::seconds(TIER_COLD_SEC);
+        {
+            std::lock_guard<std::mutex> lock(tier_mtx_);
+            if (now - started_ < cold ||
+                now - last_tier_ < std::chrono::seconds(TIER_INTERVAL_SEC)) {
+                return;
+            }
+            last_tier_ = now;
+            for (auto it = last_read_.begin(); it != last_read_.end();) {
+                it = now - it->second >= cold ? last_read_.erase(it)
+                                              : std::next(it);
+            }
+        }
+        auto written_before =
+            std::filesystem::file_time_type::clock::now() - cold;
+
+        size_t demoted = 0;
+        uint64_t saved = 0;
+        std::error_code code;
+        for (const auto& folder :
+             std::filesystem::directory_iterator(PREFIX + USER_DIR, code)) {
+            if (demoted >= TIER_MAX_CHUNKS) {
+                break;
+            }
+            std::string user = folder.path().filename().string();
+            if (!folder.is_directory(code) || packed_.Has(user)) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(tier_mtx_);
+                if (last_read_.count(user) > 0) {
+                    continue;
+                }
+            }
+
+            // Found from the file times, without loading the metadata
+            std::vector<uint64_t> candidates;
+            for (const auto& file :
+                 std::filesystem::directory_iterator(folder.path(), code)) {
+                std::string name = file.path().filename().string();
+                if (name.rfind("chunk-", 0) == 0 &&
+                    name.find('.') == std::string::npos &&
+                    file.last_write_time(code) < written_before) {
+                    candidates.push_back(std::stoull(name.substr(6)));
+                }
+            }
+            if (candidates.empty()) {
+                continue;
+            }
+
+            auto resident = chunk_dir_.Get(user);
+            if (resident == nullptr) {
+                continue;
+            }
+            for (uint64_t index : candidates) {
+                uint64_t bytes = 0;
+                {
+                    std::lock_guard<std::mutex> lock(resident->mtx);
+                    if (index == resident->chunk.append_index ||
+                        demoted >= TIER_MAX_CHUNKS) {
+                        continue;
+                    }
+                    bytes = resident->chunk.demote(index);
+                }
+                // Readers of the user are not held up by the throttling
+                io_scheduler.Pace(IO_COMPACTION);
+                if (bytes == 0) {
+                    std::lock_guard<std::mutex> tier_lock(tier_mtx_);
+                    last_read_[user] = now;
+                    continue;
+                }
+                demoted += 1;
+                saved += bytes;
+            }
+        }
+        if (demoted > 0) {
+            debug("#KvCache: Ckpt: demoted %zu cold chunks, saving %lu "
+                  "bytes\n",
+                  demoted, saved);
+        }
+    }
+
+    // Users without a folder of their own are packed
+    bool IsPacked(const std::string& user) {
+        return packed_.Has(user) || !exist_file(user_folder(user).c_str());
+    }
+
+    bool FlushUser(const std::string& user, const CompactKvMap& updates) {
+        if (IsPacked(user)) {
+            bool outgrown = false;
+            if (!packed_.Write(user, updates, outgrown)) {
+                warn("#KvCacheError: Ckpt: failed to write packed user %s.\n",
+                     user.c_str());
+                return false;
+            }
+            return !outgrown || MoveToFolder(user);
+        }
+
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            warn("#KvCacheError: Ckpt: failed to find user %s.\n",
+                 user.c_str());
+            return true;
+        }
+        bool ok;
+        {
+            std::lock_guard<std::mutex> lock(resident->mtx);
+            ok = resident->chunk.append_kvs(updates) == FINISHED;
+            filters_.RebuildKeys(user, resident->chunk);
+            ok = ok && (wal_sync_mode == WAL_SYNC_NONE ||
+                        resident->chunk.sync_files());
+        }
+        // Chunks only charge their transfers, so that the throttling happens
+        // without the lock of the user
+        io_scheduler.Pace(IO_FLUSH);
+        io_scheduler.Pace(IO_COMPACTION);
+        if (!ok) {
+            warn("#KvCacheError: Ckpt: failed to flush user %s.\n",
+                 user.c_str());
+        }
+        chunk_dir_.Update(user);
+        return ok;
+    }
+
+    // Write every value of a packed user to a fresh folder, then stop
+    // packing it. Until the folder is durable the user stays packed.
+    bool MoveToFolder(const std::string& user) {
+        KV_Map kvs;
+        if (!packed_.GetAll(user, kvs)) {
+            return false;
+        }
+        std::string folder = user_folder(user);
+        std::error_code code;
+        std::filesystem::remove_all(folder, code);
+        chunk_dir_.Erase(user);
+        bool created_dir = create_dir((PREFIX + USER_DIR).c_str());
+        if (!create_dir(folder.c_str())) {
+            warn("#KvCacheError: Ckpt: failed to create folder of user %s.\n",
+                 user.c_str());
+            return false;
+        }
+
+        auto resident = chunk_dir_.Get(user);
+        if (resident == nullptr) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(resident->mtx);
+            if (resident->chunk.append_kvs(kvs) != FINISHED) {
+                return false;
+            }
+            filters_.RebuildKeys(user, resident->chunk);
+            if (wal_sync_mode != WAL_SYNC_NONE &&
+                (!resident->chunk.sync_files() ||
+                 !sync_path(PREFIX + USER_DIR) ||
+                 (created_dir && !sync_path(PREFIX)))) {
+                return false;
+            }
+        }
+        io_scheduler.Pace(IO_FLUSH);
+        chunk_dir_.Update(user);
+        debug("#KvCache: Ckpt: user %s moved to a folder with %zu keys\n",
+              user.c_str(), kvs.size());
+        packed_.Remove(user);
+        return true;
+    }
+
+    // Resident chunk metadata of recently used users with folders
+    ChunkDirectory chunk_dir_;
+    // Answers lookups of missing keys without reading chunk files
+    LookupFilters filters_;
+    PackedStore packed_;
+    // Guards the tiering state below
+    std::mutex tier_mtx_;
+    // Users read within the last TIER_COLD_SEC
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+        last_read_;
+    std::chrono::steady_clock::time_point started_ =
+        std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_tier_;
+};
+
+}  // namespace KvCache
+
+#endif
@@ -1,9 +1,43 @@
 
 #ifndef CLUSTER_INTERFACE_H_
 #define CLUSTER_INTERFACE_H_
+#include <algorithm>
+#include <memory>
+
 #include "../common/kv_interface.h"
 #include "kv_config.h"
 #include "cache.h"
+#include "secondary_sender.h"
+
+// Senders of the primary to each secondary. Only changed while no command
+// is being forwarded.
+static std::vector<std::unique_ptr<SecondarySender>> senders;
+
+/**
+ * Open a sender to each secondary if this node is the primary
+*/
+void connect_to_other(){
+	std::vector<std::unique_ptr<SecondarySender>> previous;
+	previous.swap(senders);
+	if (!isPrimary) {
+		return;
+	}
+	// Secondaries still in the cluster keep their sender and its queue
+	for (const auto& node : secondary) {
+		if (node.port == my_addr.port){
+			continue;
+		}
+		auto kept = std::find_if(previous.begin(), previous.end(),
+			[&](const std::unique_ptr<SecondarySender>& sender) {
+				return sender && sender->Addr().port == node.port;
+			});
+		if (kept != previous.end()) {
+			senders.push_back(std::move(*kept));
+		} else {
+			senders.push_back(std::make_unique<SecondarySender>(node));
+		}
+	}
+}
 
 /**
  * Store cluster information including primary node's address
@@ -18,6 +52,7 @@ bool parse_secondary_from_master(const kv_command& ret) {
 	if (my_addr.port == secondary.at(0).port){
 		isPrimary = true;
 	}
+	connect_to_other();
 	init = true;
 	return true;
 }
@@ -49,41 +84,21 @@ bool backend_initial(int master_fd, std::string addr) {
 }
 
 /**
- * For primary to broadcast commands to secondaries
+ * For primary to broadcast commands to secondaries. Commands are queued and
+ * reach each secondary in the order they were forwarded.
 */
-void connect_to_other(){
-    int client_fd;
-    for (auto node : secondary) {
-        if (node.port != my_addr.port){
-            client_fd = tcp_client_socket(node);
-            if (client_fd < 0) {
-                warn("Warn: Cannot open socket (%s)\n", strerror(errno));
-            }
-            fds.push_back(client_fd);
-        }
-    }
-}
-
 bool forward_to_secondary(kv_command& command){
-	//connect to other backends
-	fds.clear();
-	connect_to_other();
-    // kv_ret ret;
 	std::string send;
-	int res = true;
-    if(!command.SerializeToString(&send))
+	if(!command.SerializeToString(&send))
 		return false;
-	for (auto fd : fds) {
-		if(!kv_trans(fd, command)){
-		    res = LINK_ERROR;
-        }
-		close(fd);
+	for (auto& sender : senders) {
+		sender->Send(send);
 	}
-	return res;
+	return true;
 }
 
 
-void checkpoint(KvCache::KvCache cache){
+void checkpoint(KvCache::KvCache& cache){
     kv_command command;
 	kv_ret ret;
     
@@ -0,0 +1,290 @@
+#ifndef COMPRESSION_H_
+#define COMPRESSION_H_
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "kv_config.h"
+
+// Codec of one stored value. The number is written to the log, the chunk
+// files and the manifest, so existing codecs must keep their numbers.
+enum Codec : uint8_t {
+    CODEC_NONE = 0,
+    // LZ77 with a byte-oriented format, in the style of LZ4. Cheap enough
+    // for the write path.
+    CODEC_FAST = 1,
+    // Deflate through zlib. Denser and slower, used when flushing chunks.
+    CODEC_DENSE = 2,
+};
+
+// Packed form of a value: the raw size (uint64), then the codec output.
+constexpr size_t kPackedHeaderSize = sizeof(uint64_t);
+
+namespace compression_internal {
+
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 65535;
+
+inline uint32_t Read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Lengths over 15 continue in bytes of 255 and a final byte below 255
+inline void AppendLength(std::string& out, size_t length) {
+    while (length >= 255) {
+        out.push_back((char)255);
+        length -= 255;
+    }
+    out.push_back((char)length);
+}
+
+inline bool ReadLength(const char*& p, const char* end, size_t& length) {
+    uint8_t byte;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        byte = (uint8_t)*p++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Sequences of a token (literal length << 4 | match length - 4), the
+// literals, a 16-bit offset and the rest of the match length. The last
+// sequence only has literals.
+inline void FastCompress(std::string_view raw, std::string& out) {
+    size_t bits = 8;
+    while (bits < 16 && ((size_t)1 << bits) < raw.size()) {
+        bits += 1;
+    }
+    // Positions plus one, zero is empty
+    std::vector<uint32_t> table((size_t)1 << bits, 0);
+    auto hash = [bits](uint32_t v) {
+        return (v * 2654435761U) >> (32 - bits);
+    };
+
+    const char* src = raw.data();
+    size_t n = raw.size();
+    size_t ip = 0;
+    size_t anchor = 0;
+    while (ip + kMinMatch <= n) {
+        uint32_t v = Read32(src + ip);
+        uint32_t& slot = table[hash(v)];
+        size_t candidate = slot;
+        slot = ip + 1;
+        if (candidate == 0 || ip - (candidate - 1) > kMaxOffset ||
+            Read32(src + candidate - 1) != v) {
+            // Skip faster through data that does not match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        candidate -= 1;
+
+        size_t match = kMinMatch;
+        while (ip + match < n && src[candidate + match] == src[ip + match]) {
+            match += 1;
+        }
+
+        size_t literals = ip - anchor;
+        size_t extra = match - kMinMatch;
+        out.push_back((char)((std::min<size_t>(literals, 15) << 4) |
+                             std::min<size_t>(extra, 15)));
+        if (literals >= 15) {
+            AppendLength(out, literals - 15);
+        }
+        out.append(src + anchor, literals);
+        uint16_t offset = ip - candidate;
+        out.append((const char*)&offset, sizeof(offset));
+        if (extra >= 15) {
+            AppendLength(out, extra - 15);
+        }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    size_t literals = n - anchor;
+    out.push_back((char)(std::min<size_t>(literals, 15) << 4));
+    if (literals >= 15) {
+        AppendLength(out, literals - 15);
+    }
+    out.append(src + anchor, literals);
+}
+
+inline bool FastDecompress(std::string_view packed, char* dst, size_t size) {
+    const char* p = packed.data();
+    const char* end = p + packed.size();
+    size_t op = 0;
+    while (p < end) {
+        uint8_t token = (uint8_t)*p++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !ReadLength(p, end, literals)) {
+            return false;
+        }
+        if ((size_t)(end - p) < literals || size - op < literals) {
+            return false;
+        }
+        memcpy(dst + op, p, literals);
+        p += literals;
+        op += literals;
+        if (p == end) {
+            break;
+        }
+
+        uint16_t offset;
+        if (end - p < (long)sizeof(offset)) {
+            return false;
+        }
+        memcpy(&offset, p, sizeof(offset));
+        p += sizeof(offset);
+        size_t match = token & 15;
+        if (match == 15 && !ReadLength(p, end, match)) {
+            return false;
+        }
+        match += kMinMatch;
+        if (offset == 0 || offset > op || size - op < match) {
+            return false;
+        }
+        // Matches may overlap what they produce
+        const char* from = dst + op - offset;
+        if (offset >= match) {
+            memcpy(dst + op, from, match);
+        } else {
+            for (size_t i = 0; i < match; ++i) {
+                dst[op + i] = from[i];
+            }
+        }
+        op += match;
+    }
+    return op == size;
+}
+
+// Order-0 entropy in bits per byte of up to 16 slices spread over value
+inline double SampleEntropy(std::string_view value) {
+    constexpr size_t kSlices = 16;
+    constexpr size_t kSliceBytes = 256;
+    size_t counts[256] = {0};
+    size_t total = 0;
+    auto count = [&](size_t start, size_t length) {
+        for (size_t i = start; i < start + length; ++i) {
+            counts[(uint8_t)value[i]] += 1;
+        }
+        total += length;
+    };
+    if (value.size() <= kSlices * kSliceBytes) {
+        count(0, value.size());
+    } else {
+        size_t stride = value.size() / kSlices;
+        for (size_t i = 0; i < kSlices; ++i) {
+            count(i * stride, kSliceBytes);
+        }
+    }
+
+    double entropy = 0;
+    for (size_t c : counts) {
+        if (c > 0) {
+            double p = (double)c / total;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+}  // namespace compression_internal
+
+// Pick a codec for value by its size and the entropy of a sample. Values
+// that are small or look already compressed, such as images, are left raw.
+// Only values flushed in the background may use the dense codec.
+inline Codec ChooseCodec(std::string_view value, bool background) {
+    if (compression_mode == COMPRESSION_OFF ||
+        value.size() < COMPRESS_MIN_BYTES ||
+        compression_internal::SampleEntropy(value) > COMPRESS_MAX_ENTROPY) {
+        return CODEC_NONE;
+    }
+    if (background && compression_mode == COMPRESSION_AUTO &&
+        value.size() >= COMPRESS_DENSE_BYTES) {
+        return CODEC_DENSE;
+    }
+    return CODEC_FAST;
+}
+
+// Compress raw with codec into out. Returns false if codec is CODEC_NONE or
+// compressing saves less than an eighth of raw; the value should then be
+// stored raw.
+inline bool CompressValue(Codec codec, std::string_view raw,
+                          std::string& out) {
+    uint64_t raw_size = raw.size();
+    out.assign((const char*)&raw_size, sizeof(raw_size));
+    if (codec == CODEC_FAST) {
+        out.reserve(kPackedHeaderSize + raw.size() + raw.size() / 255 + 16);
+        compression_internal::FastCompress(raw, out);
+    } else if (codec == CODEC_DENSE) {
+        uLongf bound = compressBound(raw.size());
+        out.resize(kPackedHeaderSize + bound);
+        if (compress2((Bytef*)out.data() + kPackedHeaderSize, &bound,
+                      (const Bytef*)raw.data(), raw.size(),
+                      Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return false;
+        }
+        out.resize(kPackedHeaderSize + bound);
+    } else {
+        return false;
+    }
+    return out.size() <= raw.size() - raw.size() / 8;
+}
+
+// Restore a value stored with codec. CODEC_NONE copies stored. Returns false
+// if stored is corrupted.
+inline bool DecompressValue(Codec codec, std::string_view stored,
+                            std::string& out) {
+    if (codec == CODEC_NONE) {
+        out.assign(stored);
+        return true;
+    }
+    uint64_t raw_size;
+    if (stored.size() < kPackedHeaderSize) {
+        return false;
+    }
+    memcpy(&raw_size, stored.data(), sizeof(raw_size));
+    if (raw_size > MAX_MESSAGE_BYTES) {
+        return false;
+    }
+    std::string_view packed = stored.substr(kPackedHeaderSize);
+    out.resize(raw_size);
+
+    if (codec == CODEC_FAST) {
+        return compression_internal::FastDecompress(packed, out.data(),
+                                                    raw_size);
+    }
+    if (codec == CODEC_DENSE) {
+        uLongf size = raw_size;
+        return uncompress((Bytef*)out.data(), &size,
+                          (const Bytef*)packed.data(),
+                          packed.size()) == Z_OK &&
+               size == raw_size;
+    }
+    return false;
+}
+
+// Encode value for storage. Returns the codec used, with the stored bytes in
+// packed; for CODEC_NONE the value is stored as it is and packed is unused.
+inline Codec PackValue(std::string_view value, bool background,
+                       std::string& packed) {
+    Codec codec = ChooseCodec(value, background);
+    if (codec != CODEC_NONE && CompressValue(codec, value, packed)) {
+        return codec;
+    }
+    return CODEC_NONE;
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "kv_config.h"
+#include "value_ref.h"
+
+// Buffers of one non-blocking frontend connection. Messages use the framing
+// of tcp_write_msg: the length as a size_t, then the bytes. Reads collect
+// whatever has arrived and hand out complete messages; replies are queued
+// and written as far as the socket accepts them. A reply can end in a shared
+// value, which is written straight from its buffer with scatter-gather I/O.
+class Connection {
+   public:
+    explicit Connection(int fd) : fd_(fd) {}
+
+    int Fd() const { return fd_; }
+
+    static bool SetNonBlocking(int fd, bool non_blocking) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0) {
+            return false;
+        }
+        flags = non_blocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+        return fcntl(fd, F_SETFL, flags) == 0;
+    }
+
+    // Read what is available, up to kMaxReadBytes_ so that one fast peer
+    // cannot hold up the others. The rest is read once epoll, which is level
+    // triggered, reports the socket again. Returns false on errors. Messages
+    // that arrived before the peer closed the connection can still be taken.
+    bool Receive() {
+        char buf[kReadChunk_];
+        size_t received = 0;
+        while (received < kMaxReadBytes_) {
+            ssize_t n = read(fd_, buf, sizeof(buf));
+            if (n > 0) {
+                in_.append(buf, n);
+                received += n;
+                continue;
+            }
+            if (n == 0) {
+                peer_closed = true;
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        return true;
+    }
+
+    // Take the next complete message off the read buffer. Returns false if
+    // it has not fully arrived yet. Sets oversized if the announced length
+    // is over MAX_MESSAGE_BYTES, after which the connection is unusable.
+    bool NextMessage(std::string& msg, bool& oversized) {
+        oversized = false;
+        size_t length = 0;
+        if (in_.size() - in_start_ < sizeof(length)) {
+            return false;
+        }
+        in_.copy(reinterpret_cast<char*>(&length), sizeof(length), in_start_);
+        if (length > MAX_MESSAGE_BYTES) {
+            oversized = true;
+            return false;
+        }
+        if (in_.size() - in_start_ - sizeof(length) < length) {
+            return false;
+        }
+
+        msg.assign(in_, in_start_ + sizeof(length), length);
+        in_start_ += sizeof(length) + length;
+        // Drop consumed bytes once they make up most of the buffer
+        if (in_start_ == in_.size()) {
+            in_.clear();
+            in_start_ = 0;
+        } else if (in_start_ > in_.size() / 2) {
+            in_.erase(0, in_start_);
+            in_start_ = 0;
+        }
+        return true;
+    }
+
+    // Queue a message made of msg followed by the bytes of tail, if any.
+    void QueueMessage(const std::string& msg, ValueRef tail = nullptr) {
+        size_t length = msg.size() + (tail != nullptr ? tail->size() : 0);
+        std::string head;
+        head.reserve(sizeof(length) + msg.size());
+        head.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        head.append(msg);
+        out_.push_back(std::make_shared<const std::string>(std::move(head)));
+        if (tail != nullptr && !tail->empty()) {
+            out_.push_back(std::move(tail));
+        }
+    }
+
+    // Write queued replies until the socket would block. Returns false on
+    // errors.
+    bool Send() {
+        while (!out_.empty()) {
+            struct iovec iov[kMaxIov_];
+            size_t count = 0;
+            size_t start = out_start_;
+            for (auto it = out_.begin(); it != out_.end() && count < kMaxIov_;
+                 ++it) {
+                iov[count].iov_base = const_cast<char*>((*it)->data()) + start;
+                iov[count].iov_len = (*it)->size() - start;
+                start = 0;
+                count += 1;
+            }
+
+            struct msghdr header = {};
+            header.msg_iov = iov;
+            header.msg_iovlen = count;
+            ssize_t n = sendmsg(fd_, &header, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            // Drop the buffers that went out completely
+            size_t sent = n;
+            while (sent > 0) {
+                size_t left = out_.front()->size() - out_start_;
+                if (sent < left) {
+                    out_start_ += sent;
+                    break;
+                }
+                sent -= left;
+                out_.pop_front();
+                out_start_ = 0;
+            }
+        }
+        return true;
+    }
+
+    bool HasPendingOutput() const { return !out_.empty(); }
+
+    // Whether a command of this connection is being run. Its next message
+    // waits in the read buffer until the reply has been queued.
+    bool busy = false;
+    // Whether the peer has closed its side
+    bool peer_closed = false;
+    // Events the connection is currently registered for in epoll
+    uint32_t events = 0;
+
+   private:
+    static constexpr size_t kReadChunk_ = 64 << 10;
+    // Bytes read from the socket per wakeup
+    static constexpr size_t kMaxReadBytes_ = 1 << 20;
+    // Buffers handed to one sendmsg call
+    static constexpr size_t kMaxIov_ = 64;
+
+    int fd_;
+    std::string in_;
+    size_t in_start_ = 0;
+    // Queued output, never holding empty buffers
+    std::deque<ValueRef> out_;
+    // Bytes of the first buffer already sent
+    size_t out_start_ = 0;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef IO_SCHEDULER_H_
+#define IO_SCHEDULER_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "kv_config.h"
+
+// Class of one disk transfer, in order of priority. Foreground reads and
+// log appends are what users wait for; the others are maintenance.
+enum IoClass {
+    IO_FOREGROUND = 0,
+    IO_WAL = 1,
+    // Checkpoint writes of a frozen generation: chunk files, packed
+    // segments, level 0 tables and snapshots
+    IO_FLUSH = 2,
+    // Full-sync streaming of the storage folder to a secondary
+    IO_SYNC = 3,
+    // Rewrites of data already on disk: chunk and table compaction, garbage
+    // collection of segments, demotion of cold chunks
+    IO_COMPACTION = 4,
+    kIoClasses = 5,
+};
+
+struct IoClassStats {
+    uint64_t bytes = 0;
+    // Transfers that had to wait for tokens, and how long they waited
+    uint64_t throttled = 0;
+    uint64_t throttled_us = 0;
+};
+
+// Shared scheduler of the disk transfers of a node. Foreground and log I/O
+// are only counted. Each maintenance class draws from a token bucket filled
+// at its configured rate; a transfer takes its bytes out right away and
+// sleeps off any debt, so large writes are paced by the ones after them.
+//
+// While foreground or log I/O was seen within IO_BUSY_WINDOW_MS, classes
+// after IO_FLUSH run at IO_BUSY_PERCENT of their rate. Flushes keep their
+// rate, since they free memory and shorten the log. A class also waits out
+// the debt of the maintenance classes above it, so compaction gives way to
+// a throttled flush.
+class IoScheduler {
+   public:
+    IoScheduler() {
+        for (auto& bucket : buckets_) {
+            bucket.refill = Clock::now();
+        }
+    }
+    IoScheduler(const IoScheduler&) = delete;
+    IoScheduler& operator=(const IoScheduler&) = delete;
+
+    // Account for bytes of class io, waiting if its bucket is in debt
+    void Acquire(IoClass io, uint64_t bytes) {
+        Charge(io, bytes);
+        Pace(io);
+    }
+
+    // Account for bytes of class io without waiting, for transfers made
+    // under a lock that readers may need. Pace once the lock is released.
+    void Charge(IoClass io, uint64_t bytes) {
+        counters_[io].bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (io <= IO_WAL) {
+            last_busy_.store(Clock::now().time_since_epoch().count(),
+                             std::memory_order_relaxed);
+            return;
+        }
+        if (Rate(io) == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx_);
+        Refill(io, Clock::now());
+        buckets_[io].tokens -= bytes;
+    }
+
+    // Sleep off the debt of class io and of the maintenance classes above it
+    void Pace(IoClass io) {
+        if (io <= IO_WAL || Rate(io) == 0) {
+            return;
+        }
+        double wait_sec = 0;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto now = Clock::now();
+            for (int c = IO_FLUSH; c <= io; ++c) {
+                Bucket& bucket = buckets_[c];
+                Refill((IoClass)c, now);
+                if (bucket.tokens < 0 && bucket.rate > 0) {
+                    wait_sec = std::max(wait_sec, -bucket.tokens / bucket.rate);
+                }
+            }
+        }
+        // Short debts are left for the next transfer to sleep off
+        if (wait_sec * 1000 < 1) {
+            return;
+        }
+        auto wait = std::chrono::microseconds((uint64_t)(wait_sec * 1e6));
+        std::this_thread::sleep_for(wait);
+        counters_[io].throttled.fetch_add(1, std::memory_order_relaxed);
+        counters_[io].throttled_us.fetch_add(wait.count(),
+                                             std::memory_order_relaxed);
+    }
+
+    IoClassStats Stats(IoClass io) const {
+        IoClassStats ret;
+        ret.bytes = counters_[io].bytes.load(std::memory_order_relaxed);
+        ret.throttled =
+            counters_[io].throttled.load(std::memory_order_relaxed);
+        ret.throttled_us =
+            counters_[io].throttled_us.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    // One line per class: bytes moved, and how often and how long it was
+    // throttled since the start
+    std::string Report() const {
+        static const char* kNames[kIoClasses] = {"foreground", "wal", "flush",
+                                                 "sync", "compaction"};
+        std::string ret;
+        char line[160];
+        for (int c = 0; c < kIoClasses; ++c) {
+            IoClassStats stats = Stats((IoClass)c);
+            snprintf(line, sizeof(line),
+                     "  %-10s %12lu bytes, throttled %lu times for %lu ms\n",
+                     kNames[c], stats.bytes, stats.throttled,
+                     stats.throttled_us / 1000);
+            ret += line;
+        }
+        return ret;
+    }
+
+   private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Counters {
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> throttled{0};
+        std::atomic<uint64_t> throttled_us{0};
+    };
+
+    struct Bucket {
+        double tokens = 0;
+        // Rate the bucket was last filled at, in bytes per second
+        double rate = 0;
+        Clock::time_point refill;
+    };
+
+    static uint64_t Rate(IoClass io) {
+        switch (io) {
+            case IO_FLUSH:
+                return IO_FLUSH_BYTES_PER_SEC;
+            case IO_SYNC:
+                return IO_SYNC_BYTES_PER_SEC;
+            case IO_COMPACTION:
+                return IO_COMPACTION_BYTES_PER_SEC;
+            default:
+                return 0;
+        }
+    }
+
+    bool Busy(Clock::time_point now) const {
+        Clock::time_point last(
+            Clock::duration(last_busy_.load(std::memory_order_relaxed)));
+        return now - last < std::chrono::milliseconds(IO_BUSY_WINDOW_MS);
+    }
+
+    // Buckets hold at most IO_BURST_MS worth of tokens
+    void Refill(IoClass io, Clock::time_point now) {
+        Bucket& bucket = buckets_[io];
+        double rate = Rate(io);
+        if (io > IO_FLUSH && Busy(now)) {
+            rate = rate * IO_BUSY_PERCENT / 100;
+        }
+        double elapsed =
+            std::chrono::duration<double>(now - bucket.refill).count();
+        bucket.tokens = std::min(bucket.tokens + elapsed * bucket.rate,
+                                 rate * IO_BURST_MS / 1000);
+        bucket.rate = rate;
+        bucket.refill = now;
+    }
+
+    std::mutex mtx_;
+    std::array<Bucket, kIoClasses> buckets_;
+    std::array<Counters, kIoClasses> counters_;
+    // Clock ticks of the last foreground or log transfer
+    std::atomic<Clock::rep> last_busy_{0};
+};
+
+static IoScheduler io_scheduler;
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <queue>
 #include <mutex>
+#include <unordered_map>
 #include <time.h>
 
 #include "../common/kv_interface.h"
@@ -15,11 +16,23 @@ static bool init = false;
 
 // Which folder the data should be put
 static std::string PREFIX = "/home/cis5050/";
+// Folders of users, kept in a directory of their own under PREFIX so that
+// no user name can stand for one of the files of the node
+static const std::string USER_DIR = "users.d/";
+
+inline std::string user_folder(const std::string& user) {
+    return PREFIX + USER_DIR + user;
+}
 
 // mutex corresponding to sockfd_queue
 static std::mutex sockfd_mtx;
 // queue of fd to frontend servers
 static std::queue<int> sockfd_queue;
+// eventfd waking the connection thread for new fds in sockfd_queue and for
+// finished commands
+static int reactor_event_fd = -1;
+// Largest message accepted from a connection
+static size_t MAX_MESSAGE_BYTES = 1UL << 30;
 
 static int port = -1;
 static Address my_addr;
@@ -36,11 +49,133 @@ static bool killed = false;
 static int max_sequence = 0;
 // Need to reset after kill/restart
 static std::vector<Address> secondary;
-// Need to reset after kill/restart
-static std::vector<int> fds;
 
-static int CHECKPOINT_PERIOD = 5;
-static clock_t last_checkpoint_time;
+// How the log reaches the disk: WAL_SYNC_NONE leaves flushing to the OS,
+// WAL_SYNC_BATCH syncs once per group of appended entries and
+// WAL_SYNC_ALWAYS syncs after every entry
+enum WalSyncMode {
+    WAL_SYNC_NONE = 0,
+    WAL_SYNC_BATCH = 1,
+    WAL_SYNC_ALWAYS = 2,
+};
+static WalSyncMode wal_sync_mode = WAL_SYNC_BATCH;
+
+// A checkpoint starts once the buffered updates or the log reach these
+// sizes, or once updates have been buffered for this long
+static size_t FLUSH_BUFFER_BYTES = 64 << 20;
+static size_t FLUSH_LOG_BYTES = 128 << 20;
+static int FLUSH_INTERVAL_SEC = 30;
+// Writes are refused with BUSY_ERROR while the buffered updates, including a
+// generation still being flushed, are over this limit
+static size_t WRITE_BUFFER_LIMIT = 512 << 20;
+
+// Threads flushing users in parallel during a checkpoint
+static size_t CHECKPOINT_THREADS = 4;
+// Threads replaying the log at recovery, each taking a share of the users.
+// 0 uses one per core.
+static size_t REPLAY_THREADS = 0;
+// Memory budget of the read cache in front of the chunk files
+static size_t READ_CACHE_BUDGET = 256 << 20;
+// Flushed values up to this size are kept in the read cache after a
+// checkpoint. Larger ones are read back from the chunk files when needed.
+static size_t READ_CACHE_PROMOTE_BYTES = 1 << 20;
+// Memory budget of the resident per-user chunk metadata
+static size_t CHUNK_DIRECTORY_BUDGET = 64 << 20;
+// Memory budget of the Bloom filters over the keys of users with folders
+static size_t KEY_FILTER_BUDGET = 16 << 20;
+// Threads running frontend requests. Requests of one user run in order on
+// the same thread.
+static size_t WORKER_THREADS = 8;
+// Users sharing a worker thread take turns by deficit round robin. Each
+// round a user may move this many bytes of requests and replies times its
+// weight; users not listed in USER_WEIGHTS have weight 1.
+static size_t FAIR_QUEUE_QUANTUM = 64 << 10;
+static std::unordered_map<std::string, size_t> USER_WEIGHTS;
+// Requests of a user are refused with BUSY_ERROR while the bytes of its
+// requests queued or running are over this limit. 0 turns the limit off.
+static size_t USER_IN_FLIGHT_BYTES = 64 << 20;
+// Bits per entry of the Bloom filters over the keys of each user and of LSM
+// tables. 10 bits give about 1% false positives.
+static size_t BLOOM_BITS_PER_KEY = 10;
+
+// Which codecs values are compressed with: COMPRESSION_OFF stores everything
+// raw, COMPRESSION_FAST only uses the fast codec and COMPRESSION_AUTO also
+// uses the dense codec for large values flushed to chunk files
+enum CompressionMode {
+    COMPRESSION_OFF = 0,
+    COMPRESSION_FAST = 1,
+    COMPRESSION_AUTO = 2,
+};
+static CompressionMode compression_mode = COMPRESSION_AUTO;
+// Values smaller than this are never compressed
+static size_t COMPRESS_MIN_BYTES = 256;
+// Values from this size on use the dense codec when flushed to chunk files
+static size_t COMPRESS_DENSE_BYTES = 4096;
+// Values whose sample has more bits of entropy per byte than this are taken
+// to be compressed already
+static double COMPRESS_MAX_ENTROPY = 7.0;
+// Whether read cache entries that have gone cold are held compressed
+static bool READ_CACHE_COMPRESS_COLD = true;
+
+// Values of at least this size are written once to the value log. The log,
+// the buffered updates and the chunk files only hold a pointer to them.
+static size_t VALUE_LOG_MIN_BYTES = 64 << 10;
+// The value log, and the segments shared by packed users, move on to a new
+// segment file at this size
+static size_t VALUE_LOG_SEGMENT_BYTES = 64 << 20;
+// Rewrite a segment once this percentage of it is garbage
+static size_t VALUE_LOG_GC_PERCENT = 50;
+// Segments checked for garbage at each checkpoint
+static size_t VALUE_LOG_GC_SEGMENTS = 2;
+
+// Users whose value records take up to this many bytes are packed into
+// segment files shared with other users. Larger ones move to a folder of
+// chunk files of their own.
+static size_t PACKED_USER_MAX_BYTES = 1 << 20;
+// Memory budget of the resident indexes of packed users
+static size_t PACKED_INDEX_BUDGET = 32 << 20;
+
+// Chunk files of users with a folder that nobody has read for this long are
+// recompressed into a dense cold format, and promoted back when read. 0
+// turns tiering off.
+static int TIER_COLD_SEC = 7 * 24 * 3600;
+// How often checkpoints look for cold chunks, and the most chunk files
+// demoted at once
+static int TIER_INTERVAL_SEC = 3600;
+static size_t TIER_MAX_CHUNKS = 64;
+
+// Which engine keeps the flushed updates on disk: STORAGE_CHUNK appends to
+// per-user chunk files and STORAGE_LSM merges them into a log-structured
+// merge tree of sorted tables. Nodes of a cluster must use the same engine.
+enum StorageEngineType {
+    STORAGE_CHUNK = 0,
+    STORAGE_LSM = 1,
+};
+static StorageEngineType storage_engine = STORAGE_CHUNK;
+// LSM tables are split at this size and hold their entries in blocks of
+// this size
+static size_t LSM_TABLE_BYTES = 4 << 20;
+static size_t LSM_BLOCK_BYTES = 4 << 10;
+// Level 0 of the LSM tree is merged into level 1 once it holds this many
+// tables
+static size_t LSM_L0_TABLES = 4;
+// Size limit of level 1; each deeper level may be this many times larger
+static size_t LSM_LEVEL1_BYTES = 32 << 20;
+static size_t LSM_LEVEL_RATIO = 10;
+
+// Disk bandwidth of maintenance I/O in bytes per second, 0 for unlimited:
+// checkpoint flushes, full-sync streaming to a secondary, and compaction,
+// garbage collection and tiering. Foreground reads and log appends are never
+// throttled.
+static uint64_t IO_FLUSH_BYTES_PER_SEC = 256 << 20;
+static uint64_t IO_SYNC_BYTES_PER_SEC = 128 << 20;
+static uint64_t IO_COMPACTION_BYTES_PER_SEC = 64 << 20;
+// While foreground I/O was seen within this window, sync and compaction run
+// at this percentage of their rate
+static int IO_BUSY_WINDOW_MS = 100;
+static int IO_BUSY_PERCENT = 25;
+// Maintenance classes may burst this long at their rate after being idle
+static int IO_BURST_MS = 100;
 
 
 #endif
@@ -1,17 +1,140 @@
+#include <netinet/tcp.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <time.h>
 
+#include <unordered_map>
+
 #include "../common/file_operation.h"
 #include "../common/kv_interface.h"
 #include "../common/master_interface.h"
 #include "../common/tcp_operation.h"
 #include "cache.h"
 #include "cluster_interface.h"
+#include "connection.h"
 #include "kv_config.h"
+#include "worker_pool.h"
 KvCache::KvCache cache;
 
-void run_command(kv_command& command, int sender_fd, kv_ret& ret) {
-    std::string dir = PREFIX + command.usr() + "/";
+bool is_write_command(const kv_command& command) {
+    return command.com() == "PUTS" || command.com() == "CPUT" ||
+           command.com() == "DELE" || command.com() == "PUTB";
+}
+
+// Commands that only touch the data of one user run on the worker pool.
+// Everything else changes the state of the node or the cluster, and runs on
+// the connection thread once all queued commands have finished.
+bool is_data_command(const kv_command& command) {
+    return is_write_command(command) || command.com() == "GETS" ||
+           command.com() == "ALL";
+}
+
+// User names become folder names, see user_folder
+bool valid_user_name(const std::string& user) {
+    return !user.empty() && user != "." && user != ".." &&
+           user.find('/') == std::string::npos;
+}
+
+// Refuse a write on the primary while the write buffer is over its limit.
+// Checked before the command is forwarded or sequenced, so that secondaries
+// stay in step.
+bool write_buffer_full(kv_command& command, kv_ret& ret,
+                       ShardedWorkerPool& workers) {
+    if (!isPrimary) {
+        return false;
+    }
+    size_t size = command.value1().size() + command.value2().size();
+    if (!cache.WriteBufferFull(size)) {
+        return false;
+    }
+
+    debug("[KvStore %s]: Write buffer full, refusing %s\n",
+          my_addr.name.c_str(), command.com().c_str());
+    if (cache.ShouldCheckpoint()) {
+        workers.Drain();
+        checkpoint(cache);
+    }
+    ret.set_status(BUSY_ERROR);
+    return true;
+}
+
+// Refuse a request while the requests of its user already queued or running
+// are over USER_IN_FLIGHT_BYTES. Writes are only refused on the primary,
+// before they are forwarded, so that secondaries stay in step.
+bool user_over_limit(kv_command& command, kv_ret& ret,
+                     ShardedWorkerPool& workers) {
+    if (USER_IN_FLIGHT_BYTES == 0 ||
+        (is_write_command(command) && !isPrimary)) {
+        return false;
+    }
+    // A request over the limit on its own still runs, once nothing else of
+    // its user is in flight
+    size_t in_flight = workers.InFlightBytes(command.usr());
+    if (in_flight == 0 ||
+        in_flight + command.ByteSizeLong() <= USER_IN_FLIGHT_BYTES) {
+        return false;
+    }
+
+    debug("[KvStore %s]: User %s has %zu bytes in flight, refusing %s\n",
+          my_addr.name.c_str(), command.usr().c_str(), in_flight,
+          command.com().c_str());
+    ret.set_status(BUSY_ERROR);
+    return true;
+}
+
+// Guards max_sequence and the order of forwarded writes
+std::mutex sequence_mtx;
+
+// Give a write its sequence number. The primary numbers writes and forwards
+// them with their number, which secondaries use as it is, so that every node
+// applies writes in the same order. Forwarding only queues the write for the
+// senders. Returns 0 for reads.
+int sequence_command(kv_command& command) {
+    if (!is_write_command(command)) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(sequence_mtx);
+    if (isPrimary) {
+        command.set_seq(++max_sequence);
+        forward_to_secondary(command);
+        return command.seq();
+    }
+    if (command.has_seq()) {
+        max_sequence = std::max<int>(max_sequence, command.seq());
+        return command.seq();
+    }
+    return ++max_sequence;
+}
+
+// Connect to the primary and sync with it. Returns false if the primary
+// cannot be reached or syncing fails.
+bool sync_from_primary() {
+    Address primary = secondary.at(0);
+    int primary_fd = -1;
+    int max_attempt = 5;
+    while (max_attempt > 0 && primary_fd < 0) {
+        primary_fd = tcp_client_socket(primary);
+        max_attempt--;
+        sleep(1);
+    }
+    if (primary_fd < 0) {
+        warn("[KvStore]: Failed to connect to primary.\n");
+        return false;
+    }
+
+    bool ok = cache.SecondaryRecoverFromPrimary(primary_fd) == FINISHED;
+    // send msg to primary indicate sync finished
+    cache.SecondarySendFinishedRecovery(primary_fd, ok);
+    close(primary_fd);
+    return ok;
+}
+
+// Runs a command. Writes carry the sequence number from sequence_command.
+// The value read by GETS is set in shared_value rather than in ret, see
+// serialize_reply.
+void run_command(kv_command& command, int sender_fd, kv_ret& ret,
+                 ValueRef& shared_value, int seq_num = 0) {
     std::string path = PREFIX + command.usr() + "/" + command.key();
 
     debug_v2(
@@ -25,37 +148,18 @@ void run_command(kv_command& command, int sender_fd, kv_ret& ret) {
         killed = false;
 
         // Recover
-        int primary_fd = -1;
         if (isPrimary) {
             if (cache.InitCacheForPrimary() != FINISHED) {
                 error(
                     "[KvStore]: Failed to initialize primary during syncing. "
                     "Exiting....\n");
             }
-        } else {
-            // Connect to primary, and ask to sync
-            Address primary = secondary.at(0);
-            int max_attempt = 5;
-            while (max_attempt > 0 && primary_fd < 0) {
-                primary_fd = tcp_client_socket(primary);
-                max_attempt--;
-                sleep(1);
-            }
-
-            if (primary_fd < 0) {
-                error("[KvStore]: Failed to connect to primary. Exiting....\n");
-            }
-
-            if (cache.SecondaryRecoverFromPrimary(primary_fd) != FINISHED) {
-                cache.SecondarySendFinishedRecovery(primary_fd,
-                                                    /*success=*/false);
-                error(
-                    "Failed to initialize node due to syncing error. "
-                    "Exiting....\n");
-            }
-            // send msg to primary indicate sync finished
-            cache.SecondarySendFinishedRecovery(primary_fd, /*success=*/true);
+        } else if (!sync_from_primary()) {
+            error(
+                "Failed to initialize node due to syncing error. "
+                "Exiting....\n");
         }
+        cache.SetNeedsResync(false);
         return;
     } else if (command.com() == "CLUSTER") {
         debug("[KvStore %s]: Received CLUSTER command\n", my_addr.name.c_str());
@@ -70,18 +174,19 @@ void run_command(kv_command& command, int sender_fd, kv_ret& ret) {
     }
 
     if (command.com() == "PUTS") {
-        if (isPrimary) {
-            forward_to_secondary(command);
-        }
         int res = cache.Puts(command.usr(), command.key(), command.value1(),
-                             ++max_sequence);
+                             seq_num);
+        ret.set_status(res);
+    }
+
+    else if (command.com() == "PUTB") {
+        // value2 is the hash of the blob, value1 its content if resent
+        int res = cache.PutsBlob(command.usr(), command.key(),
+                                 command.value2(), command.value1(), seq_num);
         ret.set_status(res);
     }
 
     else if (command.com() == "CPUT") {
-        if (isPrimary) {
-            forward_to_secondary(command);
-        }
         std::string old_value;
         // if gets return FINISHED
         if (cache.Gets(command.usr(), command.key(), old_value) == FINISHED) {
@@ -92,30 +197,25 @@ void run_command(kv_command& command, int sender_fd, kv_ret& ret) {
         const std::string& prev_val = command.value1();
 
         // if pwd file empty and folder not exist, and prev value empty
-        if (command.key() == "pwd" && !exist_file(dir.c_str()) &&
+        if (command.key() == "pwd" && !cache.HasUser(command.usr()) &&
             prev_val == "" && old_value == "") {
-            create_dir(dir.c_str());
+            cache.CreateUser(command.usr());
         }
 
         int res = cache.Cputs(command.usr(), command.key(), command.value1(),
-                              command.value2(), ++max_sequence);
+                              command.value2(), seq_num);
         ret.set_status(res);
         // max_sequence += 1;
 
     }
 
     else if (command.com() == "GETS") {
-        std::string val;
-        int res = cache.Gets(command.usr(), command.key(), val);
+        int res = cache.Gets(command.usr(), command.key(), shared_value);
         ret.set_status(res);
-        ret.set_value(val);
     }
 
     else if (command.com() == "DELE") {
-        if (isPrimary) {
-            forward_to_secondary(command);
-        }
-        int res = cache.Dele(command.usr(), command.key(), ++max_sequence);
+        int res = cache.Dele(command.usr(), command.key(), seq_num);
         ret.set_status(res);
     } else if (command.com() == "CKPT") {
         debug("[KvStore %s]: Checkpointing\n", my_addr.name.c_str());
@@ -151,67 +251,287 @@ void run_command(kv_command& command, int sender_fd, kv_ret& ret) {
     }
 }
 
+// Reply of a command run on a worker, handed back to the connection thread
+struct Completion {
+    int fd;
+    std::string reply;
+    // Sent right after reply, from the buffer of the cache
+    ValueRef value;
+};
+std::mutex completion_mtx;
+std::vector<Completion> completions;
+
+const int kMaxEvents = 64;
+
+// Serialize ret, leaving room for value as its value field. The bytes of
+// value are sent after the returned message straight from the shared buffer;
+// protobuf parsers accept fields in any order, so large values are never
+// copied into the reply.
+std::string serialize_reply(kv_ret& ret, const ValueRef& value) {
+    std::string msg;
+    ret.SerializeToString(&msg);
+    if (value != nullptr) {
+        // Length-delimited field header: tag, then length, as varints
+        uint64_t tag = (kv_ret::kValueFieldNumber << 3) | 2;
+        for (uint64_t n : {tag, static_cast<uint64_t>(value->size())}) {
+            while (n >= 0x80) {
+                msg.push_back(static_cast<char>(n | 0x80));
+                n >>= 7;
+            }
+            msg.push_back(static_cast<char>(n));
+        }
+    }
+    return msg;
+}
+
+void queue_reply(Connection& conn, kv_ret& ret, const ValueRef& value) {
+    if (isPrimary) {
+        conn.QueueMessage(serialize_reply(ret, value), value);
+    }
+}
+
+// Called on a worker once a command has run
+void post_completion(int fd, kv_ret& ret, ValueRef value) {
+    Completion completion{fd, serialize_reply(ret, value), std::move(value)};
+    {
+        std::lock_guard<std::mutex> lock(completion_mtx);
+        completions.push_back(std::move(completion));
+    }
+    eventfd_write(reactor_event_fd, 1);
+}
+
+// Run a control command in place, or hand a data command to the workers.
+void dispatch_command(Connection& conn, const std::string& msg,
+                      ShardedWorkerPool& workers) {
+    auto command = std::make_shared<kv_command>();
+    command->ParseFromString(msg);
+    int fd = conn.Fd();
+
+    kv_ret ret;
+    ret.set_status(FINISHED);
+    ValueRef value;
+    if (killed || !is_data_command(*command)) {
+        workers.Drain();
+        // Control commands such as SYNC talk to the peer directly
+        Connection::SetNonBlocking(fd, false);
+        run_command(*command, fd, ret, value);
+        Connection::SetNonBlocking(fd, true);
+        queue_reply(conn, ret, value);
+        // Writes wait for each other in the order of their sequence numbers.
+        // Secondaries get them numbered and must run them in that order.
+        workers.SetOrdered(!isPrimary);
+    } else if (!valid_user_name(command->usr())) {
+        ret.set_status(USER_ERROR);
+        queue_reply(conn, ret, value);
+    } else if ((is_write_command(*command) &&
+                write_buffer_full(*command, ret, workers)) ||
+               user_over_limit(*command, ret, workers)) {
+        queue_reply(conn, ret, value);
+    } else {
+        // Commands of one user run in order on one worker, which charges
+        // the user for the bytes of the command and of its reply. The
+        // primary numbers a write once a worker starts it, since workers
+        // take turns between users. Secondaries do not reply, so the writes
+        // forwarded by the primary are queued without waiting for each other.
+        bool primary = isPrimary;
+        int seq_num = primary ? 0 : sequence_command(*command);
+        size_t bytes = command->ByteSizeLong();
+        conn.busy = primary;
+        workers.Submit(command->usr(), bytes,
+                       [command, fd, primary, seq_num, bytes]() mutable {
+            if (primary) {
+                seq_num = sequence_command(*command);
+            }
+            kv_ret ret;
+            ret.set_status(FINISHED);
+            ValueRef value;
+            run_command(*command, fd, ret, value, seq_num);
+            size_t moved = bytes + ret.ByteSizeLong() +
+                           (value != nullptr ? value->size() : 0);
+            if (primary) {
+                post_completion(fd, ret, std::move(value));
+            }
+            return moved;
+        });
+    }
+}
+
+void close_connection(
+    int epoll_fd, std::unordered_map<int, std::unique_ptr<Connection>>& conns,
+    int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    conns.erase(fd);
+}
+
+// Run the complete messages buffered for a connection, one command at a
+// time, and write out its replies. Closes the connection once the peer has
+// closed it and nothing is left to do.
+void serve_connection(
+    int epoll_fd, std::unordered_map<int, std::unique_ptr<Connection>>& conns,
+    Connection& conn, ShardedWorkerPool& workers) {
+    std::string msg;
+    bool oversized = false;
+    while (!conn.busy && conn.NextMessage(msg, oversized)) {
+        dispatch_command(conn, msg, workers);
+    }
+
+    if (!conn.Send() || oversized || (conn.peer_closed && !conn.busy)) {
+        if (oversized) {
+            warn("#KvServerError: Message over %zu bytes on fd %d.\n",
+                 MAX_MESSAGE_BYTES, conn.Fd());
+        }
+        close_connection(epoll_fd, conns, conn.Fd());
+        return;
+    }
+
+    // Stop reading while a command runs, so that a client cannot queue
+    // unbounded input
+    uint32_t events =
+        (conn.busy || conn.peer_closed ? 0u : (uint32_t)EPOLLIN) |
+        (conn.HasPendingOutput() ? (uint32_t)EPOLLOUT : 0u);
+    if (events != conn.events) {
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = conn.Fd();
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn.Fd(), &event) != 0) {
+            warn("Fail to update fd %d in epoll.\n", conn.Fd());
+        }
+        conn.events = events;
+    }
+}
+
+void accept_connections(
+    int epoll_fd, std::unordered_map<int, std::unique_ptr<Connection>>& conns) {
+    std::lock_guard<std::mutex> lock(sockfd_mtx);
+    while (!sockfd_queue.empty()) {
+        int fd = sockfd_queue.front();
+        sockfd_queue.pop();
+
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        auto conn = std::make_unique<Connection>(fd);
+        conn->events = EPOLLIN;
+        struct epoll_event event;
+        event.events = conn->events;
+        event.data.fd = fd;
+        if (!Connection::SetNonBlocking(fd, true) ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            warn("Fail to add fd to epoll.\n");
+            close(fd);
+            continue;
+        }
+        conns[fd] = std::move(conn);
+    }
+}
+
+void collect_completions(
+    int epoll_fd, std::unordered_map<int, std::unique_ptr<Connection>>& conns,
+    ShardedWorkerPool& workers) {
+    std::vector<Completion> done;
+    {
+        std::lock_guard<std::mutex> lock(completion_mtx);
+        done.swap(completions);
+    }
+    for (auto& completion : done) {
+        auto it = conns.find(completion.fd);
+        if (it == conns.end()) {
+            continue;
+        }
+        Connection& conn = *it->second;
+        conn.busy = false;
+        conn.QueueMessage(completion.reply, std::move(completion.value));
+        serve_connection(epoll_fd, conns, conn, workers);
+    }
+}
+
 void* handle_connect(void* arg) {
     int epoll_fd = epoll_create1(0);
     if (epoll_fd < 0) {
         error("epoll_create error.\n");
     }
 
+    // New fds from getting_request and finished commands from the workers
+    // are announced through reactor_event_fd
     struct epoll_event event;
     event.events = EPOLLIN;
+    event.data.fd = reactor_event_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor_event_fd, &event) != 0) {
+        error("Fail to add eventfd to epoll.\n");
+    }
 
-    std::string msg;
-    last_checkpoint_time = 1;
+    struct epoll_event events[kMaxEvents];
+    std::unordered_map<int, std::unique_ptr<Connection>> conns;
+    ShardedWorkerPool workers(WORKER_THREADS, FAIR_QUEUE_QUANTUM);
+    workers.SetOrdered(!isPrimary);
+    for (const auto& [user, weight] : USER_WEIGHTS) {
+        workers.SetWeight(user, weight);
+    }
 
     debug_v2("[KvStore %s]: Start handling requests\n", my_addr.name.c_str());
 
-    kv_command command;
     while (true) {
-        // Pop fds and add them into epoll
-        sockfd_mtx.lock();
-        while (!sockfd_queue.empty()) {
-            event.data.fd = sockfd_queue.front();
-            sockfd_queue.pop();
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) !=
-                0) {
-                warn("Fail to add fd to epoll.\n");
-            }
-        }
-        sockfd_mtx.unlock();
-
         // Wait for commands from frontend,
-        int ret = epoll_wait(epoll_fd, &event, 1, 100);
+        int ret = epoll_wait(epoll_fd, events, kMaxEvents, 100);
 
-        if (ret < 0) {
+        if (ret < 0 && errno != EINTR) {
             warn("epoll_wait error.\n");
         }
 
-        if (ret > 0) {
-            // Read commands and process them
-            if (tcp_read_msg(event.data.fd, msg)) {
-                last_checkpoint_time += 1;
-                command.ParseFromString(msg);
-
-                kv_ret ret;
-                ret.set_status(FINISHED);
-                run_command(command, event.data.fd, ret);
+        // Retire a finished background checkpoint
+        cache.ReapCheckpoint();
 
-                if (isPrimary) {
-                    ret.SerializeToString(&msg);
-                    tcp_write_msg(event.data.fd, msg);
-                }
+        for (int i = 0; i < ret; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == reactor_event_fd) {
+                eventfd_t count;
+                eventfd_read(reactor_event_fd, &count);
+                accept_connections(epoll_fd, conns);
+                continue;
+            }
 
-                if (isPrimary && last_checkpoint_time % 20 == 0) {
-                    debug("Primary checkpt\n");
-                    checkpoint(cache);
-                }
+            auto it = conns.find(fd);
+            if (it == conns.end()) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            uint32_t ready = events[i].events;
+            if (conn.busy && (ready & (EPOLLHUP | EPOLLERR))) {
+                // The connection is closed once its command has finished
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                conn.peer_closed = true;
+                conn.events = 0;
+                continue;
+            }
+            // Read commands and process them
+            if (!conn.busy && (ready & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                !conn.Receive()) {
+                close_connection(epoll_fd, conns, fd);
+                continue;
             }
-            // Close the connection which is closed by frontend servers
-            else {
-                close(event.data.fd);
-                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, event.data.fd, &event);
+            serve_connection(epoll_fd, conns, conn, workers);
+        }
+
+        collect_completions(epoll_fd, conns, workers);
+
+        // A secondary that missed a forwarded write refuses writes until it
+        // has synced with the primary again. Retried until it succeeds.
+        if (!isPrimary && !killed && init && cache.NeedsResync()) {
+            workers.Drain();
+            if (sync_from_primary()) {
+                cache.SetNeedsResync(false);
+                debug("[KvStore %s]: Resynced with primary\n",
+                      my_addr.name.c_str());
             }
         }
+
+        // Checkpoint by buffered bytes, log size and age of the updates. Also
+        // checked when idle so that old updates get flushed.
+        if (isPrimary && cache.ShouldCheckpoint()) {
+            debug("Primary checkpt\n");
+            workers.Drain();
+            checkpoint(cache);
+        }
     }
 }
 
@@ -236,6 +556,7 @@ void* getting_request(void* arg) {
         sockfd_mtx.lock();
         sockfd_queue.push(fd);
         sockfd_mtx.unlock();
+        eventfd_write(reactor_event_fd, 1);
     }
 }
 
@@ -252,12 +573,19 @@ void RunServer() {
     }
 
     init = false;
+    // A secondary that went away fails the write to it instead
+    signal(SIGPIPE, SIG_IGN);
 
     debug_v2(
         "[KvStore %s]: Initiating KV store server with storage location %s\n.",
         my_addr.name.c_str(), PREFIX.c_str());
     cache.UpdateLogging(PREFIX + "logging");
 
+    reactor_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor_event_fd < 0) {
+        error("Error: Cannot create eventfd (%s)\n", strerror(errno));
+    }
+
     int listen_fd = tcp_server_socket(my_addr.port);
     if (listen_fd < 0) {
         error("Error: Cannot open listen socket (%s)\n", strerror(errno));
@@ -345,13 +673,70 @@ int main(int argc, char* argv[]) {
     std::ios::sync_with_stdio(false);  // to speed up
 
     int c;
-    while ((c = getopt(argc, argv, "p:")) != -1) {
+    while ((c = getopt(argc, argv, "p:w:t:c:e:u:")) != -1) {
         switch (c) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            // Log durability: none, batch or always
+            case 'w':
+                if (strcmp(optarg, "none") == 0)
+                    wal_sync_mode = WAL_SYNC_NONE;
+                else if (strcmp(optarg, "batch") == 0)
+                    wal_sync_mode = WAL_SYNC_BATCH;
+                else if (strcmp(optarg, "always") == 0)
+                    wal_sync_mode = WAL_SYNC_ALWAYS;
+                else {
+                    printf("Unknown log durability `%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Threads running frontend requests
+            case 't':
+                if (atoi(optarg) < 1) {
+                    printf("Worker threads must be positive.\n");
+                    exit(1);
+                }
+                WORKER_THREADS = atoi(optarg);
+                break;
+            // Value compression: off, fast or auto
+            case 'c':
+                if (strcmp(optarg, "off") == 0)
+                    compression_mode = COMPRESSION_OFF;
+                else if (strcmp(optarg, "fast") == 0)
+                    compression_mode = COMPRESSION_FAST;
+                else if (strcmp(optarg, "auto") == 0)
+                    compression_mode = COMPRESSION_AUTO;
+                else {
+                    printf("Unknown compression `%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Storage engine: chunk or lsm
+            case 'e':
+                if (strcmp(optarg, "chunk") == 0)
+                    storage_engine = STORAGE_CHUNK;
+                else if (strcmp(optarg, "lsm") == 0)
+                    storage_engine = STORAGE_LSM;
+                else {
+                    printf("Unknown storage engine `%s'.\n", optarg);
+                    exit(1);
+                }
+                break;
+            // Fair queuing weight of a user, as user:weight. May be repeated.
+            case 'u': {
+                const char* colon = strrchr(optarg, ':');
+                if (colon == NULL || colon == optarg || atoi(colon + 1) < 1) {
+                    printf("User weight `%s' is not user:weight.\n", optarg);
+                    exit(1);
+                }
+                USER_WEIGHTS[std::string(optarg, colon - optarg)] =
+                    atoi(colon + 1);
+                break;
+            }
             case '?':
-                if (optopt == 'p')
+                if (optopt == 'p' || optopt == 'w' || optopt == 't' ||
+                    optopt == 'c' || optopt == 'e' || optopt == 'u')
                     printf("Option -%c requires an argument.\n", optopt);
                 else if (isprint(optopt))
                     printf("Unknown option `-%c'.\n", optopt);
@@ -363,6 +748,7 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    cache.SetStorageEngine(storage_engine);
     RunServer();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,911 @@
+#ifndef LSM_H_
+#define LSM_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "chunk.h"
+#include "compression.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+#include "storage_engine.h"
+#include "wal.h"
+
+namespace KvCache {
+// Log-structured merge tree holding the flushed pairs of all users.
+//
+// Entries are keyed by user, a zero byte and key, so that the keys of a user
+// are contiguous. Each checkpoint writes its generation of updates, which
+// serves as the memtable, as a sorted table in level 0. Tables of level 0 may
+// overlap. Every deeper level is a single sorted run of tables that do not
+// overlap, LSM_LEVEL_RATIO times the size of the level above. Level 0 is
+// merged into level 1 once it holds LSM_L0_TABLES tables; an overfull level
+// merges one table, taken round robin, into the tables of the next level it
+// overlaps.
+//
+// Tables are files named PREFIX/lsm-<number>.sst:
+//   Table:  blocks | filter | index | footer
+//   Block:  codec (uint8) | entries, packed with codec
+//   Entry:  key length (uint32) | value length (uint32) | type (uint8) |
+//           key | value
+//   Filter: Bloom filter over the keys, see BloomFilter::Encode
+//   Index:  per block: last key length (uint32) | last key | offset (uint64)
+//           | size (uint64) | crc32 of the block (uint32)
+//   Footer: filter offset, filter size, index offset, index size (uint64
+//           each) | kSstMagic
+//
+// The manifest PREFIX/lsm-manifest lists the live tables: the next table
+// number (uint64), level (uint8) and number (uint64) of each table with level
+// 0 newest first, and a crc32 of all that. It is replaced as a whole after
+// every flush and compaction. Tables it does not list are deleted on load.
+
+constexpr char kSstMagic[8] = {'K', 'V', 'S', 'S', 'T', '0', '0', '1'};
+constexpr size_t kSstFooterSize = 4 * sizeof(uint64_t) + sizeof(kSstMagic);
+constexpr size_t kSstEntryFixedSize = 2 * sizeof(uint32_t) + sizeof(uint8_t);
+constexpr size_t kSstHandleFixedSize = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+constexpr size_t kLsmManifestEntrySize = sizeof(uint8_t) + sizeof(uint64_t);
+constexpr int kLsmLevels = 7;
+
+enum LsmEntryType : uint8_t {
+    kLsmDelete = 0,
+    kLsmPut = 1,
+};
+
+enum LsmResult {
+    kLsmNotFound = 0,
+    kLsmFound = 1,
+    kLsmDeleted = 2,
+    kLsmCorrupted = 3,
+};
+
+std::string LsmKey(const std::string& user, std::string_view key) {
+    std::string out;
+    out.reserve(user.size() + 1 + key.size());
+    out.append(user);
+    out.push_back('\0');
+    out.append(key);
+    return out;
+}
+
+// Writes one table as I/O of class io. Keys must be added in increasing
+// order.
+class SstBuilder {
+   public:
+    SstBuilder(const std::string& path, IoClass io)
+        : path_(path),
+          io_(io),
+          file_(path, std::ios::binary | std::ios::trunc) {}
+
+    void Add(std::string_view key, std::string_view value,
+             LsmEntryType type) {
+        keys_.emplace_back(key);
+        AppendRaw<uint32_t>(block_, key.size());
+        AppendRaw<uint32_t>(block_, value.size());
+        AppendRaw<uint8_t>(block_, type);
+        block_.append(key);
+        block_.append(value);
+        if (block_.size() >= LSM_BLOCK_BYTES) {
+            FlushBlock();
+        }
+    }
+
+    // Bytes written so far, including the open block
+    uint64_t Bytes() const { return offset_ + block_.size(); }
+
+    // Write the filter, index and footer. Returns false if the table may
+    // not be complete on disk.
+    bool Finish() {
+        FlushBlock();
+        BloomFilter filter(keys_.size());
+        for (const auto& key : keys_) {
+            filter.Add(key);
+        }
+        std::string filter_data = filter.Encode();
+
+        std::string index;
+        for (const auto& handle : index_) {
+            AppendRaw<uint32_t>(index, handle.last_key.size());
+            index.append(handle.last_key);
+            AppendRaw<uint64_t>(index, handle.offset);
+            AppendRaw<uint64_t>(index, handle.size);
+            AppendRaw<uint32_t>(index, handle.crc);
+        }
+
+        std::string footer;
+        AppendRaw<uint64_t>(footer, offset_);
+        AppendRaw<uint64_t>(footer, filter_data.size());
+        AppendRaw<uint64_t>(footer, offset_ + filter_data.size());
+        AppendRaw<uint64_t>(footer, index.size());
+        footer.append(kSstMagic, sizeof(kSstMagic));
+
+        io_scheduler.Acquire(
+            io_, filter_data.size() + index.size() + footer.size());
+        file_.write(filter_data.data(), filter_data.size());
+        file_.write(index.data(), index.size());
+        file_.write(footer.data(), footer.size());
+        file_.flush();
+        bool ok = file_.good();
+        file_.close();
+        return ok && (wal_sync_mode == WAL_SYNC_NONE || sync_path(path_));
+    }
+
+   private:
+    struct BlockHandle {
+        std::string last_key;
+        uint64_t offset;
+        uint64_t size;
+        uint32_t crc;
+    };
+
+    // Blocks are read on every lookup, so only the fast codec is used
+    void FlushBlock() {
+        if (block_.empty()) {
+            return;
+        }
+        std::string packed;
+        Codec codec = PackValue(block_, /*background=*/false, packed);
+        std::string stored(1, (char)codec);
+        stored.append(codec == CODEC_NONE ? block_ : packed);
+        io_scheduler.Acquire(io_, stored.size());
+        file_.write(stored.data(), stored.size());
+
+        index_.push_back({keys_.back(), offset_, stored.size(),
+                          Crc32(stored.data(), stored.size())});
+        offset_ += stored.size();
+        block_.clear();
+    }
+
+    std::string path_;
+    IoClass io_;
+    std::ofstream file_;
+    // Entries of the block being filled
+    std::string block_;
+    uint64_t offset_ = 0;
+    std::vector<BlockHandle> index_;
+    std::vector<std::string> keys_;
+};
+
+// Table opened from its mapped file. The filter and index are decoded on
+// open. The file is deleted once the last reader drops a table marked
+// obsolete.
+class SstTable {
+   public:
+    SstTable(uint64_t number, const std::string& path)
+        : number_(number), path_(path) {}
+    SstTable(const SstTable&) = delete;
+    SstTable& operator=(const SstTable&) = delete;
+    ~SstTable() {
+        file_.Close();
+        if (obsolete_) {
+            std::remove(path_.c_str());
+        }
+    }
+
+    bool Open();
+
+    uint64_t number() const { return number_; }
+    const std::string& smallest() const { return smallest_; }
+    const std::string& largest() const { return largest_; }
+    uint64_t FileSize() const { return file_.View().size(); }
+    size_t NumBlocks() const { return index_.size(); }
+
+    // First block that may hold key
+    size_t FindBlock(std::string_view key) const {
+        return std::lower_bound(index_.begin(), index_.end(), key,
+                                [](const BlockHandle& handle,
+                                   std::string_view key) {
+                                    return handle.last_key < key;
+                                }) -
+               index_.begin();
+    }
+
+    // Entries of block i. Raw blocks are viewed in place, packed ones are
+    // unpacked into buffer. Returns false if the block is corrupted.
+    bool ReadBlock(size_t i, std::string& buffer,
+                   std::string_view& block) const {
+        const BlockHandle& handle = index_[i];
+        std::string_view stored =
+            file_.View().substr(handle.offset, handle.size);
+        if (Crc32(stored.data(), stored.size()) != handle.crc) {
+            return false;
+        }
+        Codec codec = (Codec)stored[0];
+        if (codec == CODEC_NONE) {
+            block = stored.substr(1);
+            return true;
+        }
+        if (!DecompressValue(codec, stored.substr(1), buffer)) {
+            return false;
+        }
+        block = buffer;
+        return true;
+    }
+
+    LsmResult Get(const std::string& key, std::string& value) const;
+
+    void MarkObsolete() { obsolete_ = true; }
+
+   private:
+    struct BlockHandle {
+        std::string last_key;
+        uint64_t offset;
+        uint64_t size;
+        uint32_t crc;
+    };
+
+    uint64_t number_;
+    std::string path_;
+    MappedFile file_;
+    std::shared_ptr<BloomFilter> filter_;
+    std::vector<BlockHandle> index_;
+    std::string smallest_;
+    std::string largest_;
+    std::atomic<bool> obsolete_{false};
+};
+
+// Walks the entries of a table in key order. The table must outlive it, and
+// the views it hands out are valid until it moves on.
+class SstIterator {
+   public:
+    explicit SstIterator(const SstTable* table) : table_(table) {}
+
+    void SeekToFirst() { LoadBlock(0); }
+
+    // Move to the first entry whose key is not less than target
+    void Seek(std::string_view target) {
+        LoadBlock(table_->FindBlock(target));
+        while (valid_ && key_ < target) {
+            Next();
+        }
+    }
+
+    void Next() {
+        if (pos_ < block_.size()) {
+            ParseEntry();
+        } else {
+            LoadBlock(block_index_ + 1);
+        }
+    }
+
+    bool Valid() const { return valid_; }
+    // Whether iteration stopped early at a corrupted block
+    bool Corrupted() const { return corrupted_; }
+    std::string_view key() const { return key_; }
+    std::string_view value() const { return value_; }
+    LsmEntryType type() const { return type_; }
+
+   private:
+    void LoadBlock(size_t i) {
+        valid_ = false;
+        block_index_ = i;
+        if (i >= table_->NumBlocks()) {
+            return;
+        }
+        if (!table_->ReadBlock(i, buffer_, block_)) {
+            corrupted_ = true;
+            return;
+        }
+        pos_ = 0;
+        ParseEntry();
+    }
+
+    void ParseEntry() {
+        valid_ = false;
+        if (block_.size() - pos_ < kSstEntryFixedSize) {
+            corrupted_ = true;
+            return;
+        }
+        const char* p = block_.data() + pos_;
+        uint32_t key_size = ReadRaw<uint32_t>(p);
+        uint32_t value_size = ReadRaw<uint32_t>(p + sizeof(uint32_t));
+        uint8_t type = ReadRaw<uint8_t>(p + 2 * sizeof(uint32_t));
+        size_t left = block_.size() - pos_ - kSstEntryFixedSize;
+        if (key_size > left || value_size > left - key_size ||
+            type > kLsmPut) {
+            corrupted_ = true;
+            return;
+        }
+        key_ = block_.substr(pos_ + kSstEntryFixedSize, key_size);
+        value_ =
+            block_.substr(pos_ + kSstEntryFixedSize + key_size, value_size);
+        type_ = (LsmEntryType)type;
+        pos_ += kSstEntryFixedSize + key_size + value_size;
+        valid_ = true;
+    }
+
+    const SstTable* table_;
+    size_t block_index_ = 0;
+    std::string buffer_;
+    std::string_view block_;
+    // Offset of the entry after the current one in block_
+    size_t pos_ = 0;
+    bool valid_ = false;
+    bool corrupted_ = false;
+    std::string_view key_;
+    std::string_view value_;
+    LsmEntryType type_ = kLsmPut;
+};
+
+inline bool SstTable::Open() {
+    if (!file_.Open(path_)) {
+        return false;
+    }
+    std::string_view data = file_.View();
+    if (data.size() < kSstFooterSize ||
+        memcmp(data.data() + data.size() - sizeof(kSstMagic), kSstMagic,
+               sizeof(kSstMagic)) != 0) {
+        return false;
+    }
+    const char* footer = data.data() + data.size() - kSstFooterSize;
+    uint64_t filter_offset = ReadRaw<uint64_t>(footer);
+    uint64_t filter_size = ReadRaw<uint64_t>(footer + sizeof(uint64_t));
+    uint64_t index_offset = ReadRaw<uint64_t>(footer + 2 * sizeof(uint64_t));
+    uint64_t index_size = ReadRaw<uint64_t>(footer + 3 * sizeof(uint64_t));
+    uint64_t body = data.size() - kSstFooterSize;
+    if (filter_offset > body || filter_size > body - filter_offset ||
+        index_offset > body || index_size > body - index_offset) {
+        return false;
+    }
+    filter_ = BloomFilter::Decode(data.substr(filter_offset, filter_size));
+    if (filter_ == nullptr) {
+        return false;
+    }
+
+    const char* p = data.data() + index_offset;
+    const char* end = p + index_size;
+    while (p < end) {
+        if ((size_t)(end - p) < sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t key_size = ReadRaw<uint32_t>(p);
+        p += sizeof(uint32_t);
+        if ((size_t)(end - p) < key_size + kSstHandleFixedSize) {
+            return false;
+        }
+        BlockHandle handle;
+        handle.last_key.assign(p, key_size);
+        p += key_size;
+        handle.offset = ReadRaw<uint64_t>(p);
+        handle.size = ReadRaw<uint64_t>(p + sizeof(uint64_t));
+        handle.crc = ReadRaw<uint32_t>(p + 2 * sizeof(uint64_t));
+        p += kSstHandleFixedSize;
+        if (handle.size == 0 || handle.offset > filter_offset ||
+            handle.size > filter_offset - handle.offset) {
+            return false;
+        }
+        index_.push_back(std::move(handle));
+    }
+    if (index_.empty()) {
+        return false;
+    }
+
+    SstIterator first(this);
+    first.SeekToFirst();
+    if (!first.Valid()) {
+        return false;
+    }
+    smallest_.assign(first.key());
+    largest_ = index_.back().last_key;
+    return true;
+}
+
+inline LsmResult SstTable::Get(const std::string& key,
+                               std::string& value) const {
+    if (!filter_->MayContain(key)) {
+        return kLsmNotFound;
+    }
+    // Tables are mapped, so this counts the block a lookup reads
+    io_scheduler.Charge(IO_FOREGROUND, LSM_BLOCK_BYTES);
+    SstIterator it(this);
+    it.Seek(key);
+    if (it.Corrupted()) {
+        return kLsmCorrupted;
+    }
+    if (!it.Valid() || it.key() != key) {
+        return kLsmNotFound;
+    }
+    if (it.type() == kLsmDelete) {
+        return kLsmDeleted;
+    }
+    value.assign(it.value());
+    return kLsmFound;
+}
+
+// Tables of the tree at one point in time. Readers keep the version they
+// started with while flushes and compactions install new ones.
+struct LsmVersion {
+    // Level 0 newest first, deeper levels ordered by key
+    std::array<std::vector<std::shared_ptr<SstTable>>, kLsmLevels> levels;
+};
+
+// Flushes, compactions and manifest writes only run on the checkpoint
+// thread. Lookups read the current version without blocking them.
+class LsmEngine : public StorageEngine {
+   public:
+    explicit LsmEngine(UserRegistry& users) : StorageEngine(users) {}
+
+    int Get(const std::string& user, const std::string& key,
+            std::string& value) override {
+        std::shared_ptr<const LsmVersion> version;
+        if (!Snapshot(user, version)) {
+            return USER_ERROR;
+        }
+        switch (Find(*version, LsmKey(user, key), value)) {
+            case kLsmFound:
+                return FINISHED;
+            case kLsmCorrupted:
+                warn("#KvCacheError: Lsm: corrupted table holding %s:%s.\n",
+                     user.c_str(), key.c_str());
+                return KEY_ERROR;
+            default:
+                return KEY_ERROR;
+        }
+    }
+
+    // Values are read with their block, so the size is checked afterwards
+    bool GetSmall(const std::string& user, const std::string& key,
+                  size_t max_size, std::string& value) override {
+        std::string found;
+        if (Get(user, key, found) != FINISHED || found.size() > max_size) {
+            return false;
+        }
+        value = std::move(found);
+        return true;
+    }
+
+    bool Contains(const std::string& user, const std::string& key) override {
+        std::string value;
+        return Get(user, key, value) == FINISHED;
+    }
+
+    int GetAll(const std::string& user, KV_Map& kvs) override {
+        std::shared_ptr<const LsmVersion> version;
+        if (!Snapshot(user, version)) {
+            return USER_ERROR;
+        }
+        std::string prefix = LsmKey(user, "");
+        kvs.clear();
+        // Oldest tables first, so that newer entries replace older ones
+        for (int level = kLsmLevels - 1; level >= 0; --level) {
+            const auto& tables = version->levels[level];
+            for (auto table = tables.rbegin(); table != tables.rend();
+                 ++table) {
+                if ((*table)->largest() < prefix ||
+                    (*table)->smallest().compare(0, prefix.size(), prefix) >
+                        0) {
+                    continue;
+                }
+                SstIterator it(table->get());
+                for (it.Seek(prefix);
+                     it.Valid() && it.key().substr(0, prefix.size()) == prefix;
+                     it.Next()) {
+                    std::string key(it.key().substr(prefix.size()));
+                    if (it.type() == kLsmDelete) {
+                        kvs.erase(key);
+                    } else {
+                        kvs[key] = std::string(it.value());
+                    }
+                }
+                if (it.Corrupted()) {
+                    warn("#KvCacheError: Lsm: corrupted table %lu read for "
+                         "user %s.\n",
+                         (unsigned long)(*table)->number(), user.c_str());
+                }
+            }
+        }
+        return FINISHED;
+    }
+
+    // The generation becomes one table of level 0, after which levels over
+    // their size are compacted.
+    bool Flush(const UpdatesMap& generation) override {
+        if (!Load()) {
+            return false;
+        }
+
+        std::vector<std::pair<std::string, std::string_view>> entries;
+        for (const auto& [user, kvs] : generation) {
+            if (!users_.Has(user)) {
+                warn("#KvCacheError: Ckpt: failed to find user %s.\n",
+                     user.c_str());
+                continue;
+            }
+            for (const auto& [key, value] : kvs) {
+                entries.emplace_back(LsmKey(user, key), value);
+            }
+        }
+        if (entries.empty()) {
+            return true;
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        size_t i = 0;
+        std::vector<std::shared_ptr<SstTable>> tables;
+        bool ok = WriteTables(
+            [&](std::string_view& key, std::string_view& value,
+                LsmEntryType& type) {
+                if (i == entries.size()) {
+                    return false;
+                }
+                key = entries[i].first;
+                value = entries[i].second;
+                type = value.empty() ? kLsmDelete : kLsmPut;
+                i += 1;
+                return true;
+            },
+            /*split=*/false, IO_FLUSH, tables);
+
+        auto version = std::make_shared<LsmVersion>(*Current());
+        auto& level0 = version->levels[0];
+        level0.insert(level0.begin(), tables.begin(), tables.end());
+        if (!ok || !Install(version)) {
+            warn("#KvCacheError: Lsm: failed to write a table of level 0.\n");
+            Discard(tables);
+            return false;
+        }
+
+        // The flushed updates are durable whether or not compaction works
+        Compact();
+        return true;
+    }
+
+    void Clear() override {
+        std::lock_guard<std::mutex> lock(mtx_);
+        current_.reset();
+        next_number_ = 0;
+        for (auto& pointer : compact_pointers_) {
+            pointer.clear();
+        }
+    }
+
+   private:
+    static std::string TablePath(uint64_t number) {
+        return PREFIX + "lsm-" + std::to_string(number) + ".sst";
+    }
+
+    static std::string ManifestPath() { return PREFIX + "lsm-manifest"; }
+
+    // Open the tables listed in the manifest, on first use
+    bool Load() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (current_ != nullptr) {
+            return true;
+        }
+
+        auto version = std::make_shared<LsmVersion>();
+        std::set<uint64_t> listed;
+        std::ifstream manifest(ManifestPath(), std::ios::binary);
+        if (manifest.is_open()) {
+            std::string data((std::istreambuf_iterator<char>(manifest)),
+                             std::istreambuf_iterator<char>());
+            size_t fixed = sizeof(uint64_t) + sizeof(uint32_t);
+            if (data.size() < fixed ||
+                (data.size() - fixed) % kLsmManifestEntrySize != 0 ||
+                Crc32(data.data(), data.size() - sizeof(uint32_t)) !=
+                    ReadRaw<uint32_t>(data.data() + data.size() -
+                                      sizeof(uint32_t))) {
+                warn("#KvCacheError: Lsm: corrupted manifest.\n");
+                return false;
+            }
+            next_number_ = ReadRaw<uint64_t>(data.data());
+            for (size_t p = sizeof(uint64_t);
+                 p + sizeof(uint32_t) < data.size();
+                 p += kLsmManifestEntrySize) {
+                uint8_t level = ReadRaw<uint8_t>(data.data() + p);
+                uint64_t number = ReadRaw<uint64_t>(data.data() + p + 1);
+                auto table = std::make_shared<SstTable>(number,
+                                                        TablePath(number));
+                if (level >= kLsmLevels || !table->Open()) {
+                    warn("#KvCacheError: Lsm: failed to open table %lu.\n",
+                         (unsigned long)number);
+                    return false;
+                }
+                version->levels[level].push_back(table);
+                listed.insert(number);
+            }
+        }
+
+        // Tables of flushes and compactions that did not finish
+        std::error_code code;
+        for (const auto& entry :
+             std::filesystem::directory_iterator(PREFIX, code)) {
+            std::string name = entry.path().filename().string();
+            if (name.size() > 8 && name.rfind("lsm-", 0) == 0 &&
+                name.compare(name.size() - 4, 4, ".sst") == 0 &&
+                name.find_first_not_of("0123456789", 4) == name.size() - 4) {
+                uint64_t number = std::stoull(name.substr(4));
+                next_number_ = std::max(next_number_, number + 1);
+                if (listed.count(number) == 0) {
+                    std::remove(entry.path().c_str());
+                }
+            }
+        }
+
+        current_ = version;
+        return true;
+    }
+
+    std::shared_ptr<const LsmVersion> Current() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return current_;
+    }
+
+    // Current version, if user exists
+    bool Snapshot(const std::string& user,
+                  std::shared_ptr<const LsmVersion>& version) {
+        if (!users_.Has(user) || !Load()) {
+            return false;
+        }
+        version = Current();
+        return true;
+    }
+
+    // Newest entry of key in version
+    static LsmResult Find(const LsmVersion& version, const std::string& key,
+                          std::string& value) {
+        for (const auto& table : version.levels[0]) {
+            if (key < table->smallest() || key > table->largest()) {
+                continue;
+            }
+            LsmResult result = table->Get(key, value);
+            if (result != kLsmNotFound) {
+                return result;
+            }
+        }
+        for (int level = 1; level < kLsmLevels; ++level) {
+            const auto& tables = version.levels[level];
+            auto table = std::lower_bound(
+                tables.begin(), tables.end(), key,
+                [](const std::shared_ptr<SstTable>& table,
+                   const std::string& key) { return table->largest() < key; });
+            if (table == tables.end() || key < (*table)->smallest()) {
+                continue;
+            }
+            LsmResult result = (*table)->Get(key, value);
+            if (result != kLsmNotFound) {
+                return result;
+            }
+        }
+        return kLsmNotFound;
+    }
+
+    // Write the entries next hands out to new tables as I/O of class io,
+    // split at LSM_TABLE_BYTES if split is set. Tables written are added to
+    // tables, also if a later one fails.
+    template <typename Next>
+    bool WriteTables(Next next, bool split, IoClass io,
+                     std::vector<std::shared_ptr<SstTable>>& tables) {
+        std::unique_ptr<SstBuilder> builder;
+        uint64_t number = 0;
+        auto finish = [&]() {
+            bool ok = builder->Finish();
+            builder.reset();
+            auto table = std::make_shared<SstTable>(number, TablePath(number));
+            tables.push_back(table);
+            return ok && table->Open();
+        };
+
+        std::string_view key, value;
+        LsmEntryType type;
+        while (next(key, value, type)) {
+            if (builder == nullptr) {
+                number = next_number_++;
+                builder = std::make_unique<SstBuilder>(TablePath(number), io);
+            }
+            builder->Add(key, value, type);
+            if (split && builder->Bytes() >= LSM_TABLE_BYTES && !finish()) {
+                return false;
+            }
+        }
+        return builder == nullptr || finish();
+    }
+
+    static void Discard(const std::vector<std::shared_ptr<SstTable>>& tables) {
+        for (const auto& table : tables) {
+            table->MarkObsolete();
+        }
+    }
+
+    static uint64_t LevelBytes(const LsmVersion& version, int level) {
+        uint64_t bytes = 0;
+        for (const auto& table : version.levels[level]) {
+            bytes += table->FileSize();
+        }
+        return bytes;
+    }
+
+    // Persist the tables of version in the manifest, then make it current
+    bool Install(const std::shared_ptr<LsmVersion>& version) {
+        std::string data;
+        AppendRaw<uint64_t>(data, next_number_);
+        for (int level = 0; level < kLsmLevels; ++level) {
+            for (const auto& table : version->levels[level]) {
+                AppendRaw<uint8_t>(data, level);
+                AppendRaw<uint64_t>(data, table->number());
+            }
+        }
+        AppendRaw<uint32_t>(data, Crc32(data.data(), data.size()));
+
+        std::string tmp = ManifestPath() + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            file.write(data.data(), data.size());
+            file.flush();
+            if (!file.good()) {
+                return false;
+            }
+        }
+        bool sync = wal_sync_mode != WAL_SYNC_NONE;
+        if ((sync && !sync_path(tmp)) ||
+            std::rename(tmp.c_str(), ManifestPath().c_str()) != 0 ||
+            (sync && !sync_path(PREFIX))) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        current_ = version;
+        return true;
+    }
+
+    // Level to compact next, or -1 if all are within their size
+    static int PickLevel(const LsmVersion& version) {
+        if (version.levels[0].size() >= LSM_L0_TABLES) {
+            return 0;
+        }
+        uint64_t max_bytes = LSM_LEVEL1_BYTES;
+        for (int level = 1; level + 1 < kLsmLevels; ++level) {
+            if (LevelBytes(version, level) > max_bytes) {
+                return level;
+            }
+            max_bytes *= LSM_LEVEL_RATIO;
+        }
+        return -1;
+    }
+
+    void Compact() {
+        for (int level = PickLevel(*Current()); level >= 0;
+             level = PickLevel(*Current())) {
+            if (!CompactLevel(level)) {
+                warn("#KvCacheError: Lsm: failed to compact level %d.\n",
+                     level);
+                return;
+            }
+        }
+    }
+
+    // Merge the tables of level 0, or one table of a deeper level, with the
+    // tables they overlap in the next level
+    bool CompactLevel(int level) {
+        auto version = Current();
+        std::vector<std::shared_ptr<SstTable>> inputs;
+        if (level == 0) {
+            inputs = version->levels[0];
+        } else {
+            const auto& tables = version->levels[level];
+            auto next = std::find_if(
+                tables.begin(), tables.end(), [&](const auto& table) {
+                    return table->smallest() > compact_pointers_[level];
+                });
+            inputs.push_back(next == tables.end() ? tables.front() : *next);
+        }
+        std::string smallest = inputs[0]->smallest();
+        std::string largest = inputs[0]->largest();
+        for (const auto& table : inputs) {
+            smallest = std::min(smallest, table->smallest());
+            largest = std::max(largest, table->largest());
+        }
+        for (const auto& table : version->levels[level + 1]) {
+            if (table->largest() >= smallest && table->smallest() <= largest) {
+                inputs.push_back(table);
+            }
+        }
+        // Deletions only need to hide entries of deeper levels
+        bool bottom = true;
+        for (int deeper = level + 2; deeper < kLsmLevels; ++deeper) {
+            bottom = bottom && version->levels[deeper].empty();
+        }
+
+        // Inputs are ordered newest first, so the first iterator at a key
+        // holds its newest entry
+        std::vector<SstIterator> its;
+        its.reserve(inputs.size());
+        for (const auto& table : inputs) {
+            its.emplace_back(table.get());
+            its.back().SeekToFirst();
+        }
+        SstIterator* emitted = nullptr;
+        std::vector<std::shared_ptr<SstTable>> outputs;
+        bool ok = WriteTables(
+            [&](std::string_view& key, std::string_view& value,
+                LsmEntryType& type) {
+                if (emitted != nullptr) {
+                    emitted->Next();
+                    emitted = nullptr;
+                }
+                while (true) {
+                    SstIterator* best = nullptr;
+                    for (auto& it : its) {
+                        if (it.Valid() &&
+                            (best == nullptr || it.key() < best->key())) {
+                            best = &it;
+                        }
+                    }
+                    if (best == nullptr) {
+                        return false;
+                    }
+                    for (auto& it : its) {
+                        if (&it != best && it.Valid() &&
+                            it.key() == best->key()) {
+                            it.Next();
+                        }
+                    }
+                    if (bottom && best->type() == kLsmDelete) {
+                        best->Next();
+                        continue;
+                    }
+                    key = best->key();
+                    value = best->value();
+                    type = best->type();
+                    emitted = best;
+                    return true;
+                }
+            },
+            /*split=*/true, IO_COMPACTION, outputs);
+        for (const auto& it : its) {
+            ok = ok && !it.Corrupted();
+        }
+
+        auto next_version = std::make_shared<LsmVersion>(*version);
+        for (int i : {level, level + 1}) {
+            auto& tables = next_version->levels[i];
+            tables.erase(std::remove_if(tables.begin(), tables.end(),
+                                        [&](const auto& table) {
+                                            return std::find(inputs.begin(),
+                                                             inputs.end(),
+                                                             table) !=
+                                                   inputs.end();
+                                        }),
+                         tables.end());
+        }
+        auto& target = next_version->levels[level + 1];
+        target.insert(target.end(), outputs.begin(), outputs.end());
+        std::sort(target.begin(), target.end(),
+                  [](const auto& a, const auto& b) {
+                      return a->smallest() < b->smallest();
+                  });
+        if (!ok || !Install(next_version)) {
+            Discard(outputs);
+            return false;
+        }
+
+        Discard(inputs);
+        compact_pointers_[level] = largest;
+        return true;
+    }
+
+    // Guards current_
+    std::mutex mtx_;
+    std::shared_ptr<const LsmVersion> current_;
+    uint64_t next_number_ = 0;
+    // Largest key of the last compaction of each level
+    std::array<std::string, kLsmLevels> compact_pointers_;
+};
+
+}  // namespace KvCache
+
+#endif
@@ -0,0 +1,618 @@
+#ifndef PACKED_STORE_H_
+#define PACKED_STORE_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "arena_map.h"
+#include "chunk.h"
+#include "compression.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+#include "value_log.h"
+#include "wal.h"
+
+namespace KvCache {
+// Small users packed together into shared segment files, so that a user
+// costs no files of its own.
+//
+// Segments are files named PREFIX/segment-<n> in the format of the value
+// log. Each value of a packed user is a record keyed by user and key. After
+// every change the user gets a kWalUserIndex record listing its keys:
+//   Index: per key: key length (uint32) | key | segment, offset and size of
+//          the value record (uint64 each)
+//
+// The global index PREFIX/segment_index points each packed user at its
+// latest index record. Records are appended to it, the last one of a user
+// wins, and it is rewritten once it holds twice as many records as users:
+//   Record: user length (uint32) | user | packed (uint8) | segment, offset
+//           and size of the index record (uint64 each)
+// A record with packed 0 drops the user, e.g. once it moved to a folder of
+// its own.
+
+constexpr size_t kPackedIndexEntryFixedSize =
+    sizeof(uint32_t) + 3 * sizeof(uint64_t);
+constexpr size_t kSegmentIndexRecordFixedSize =
+    sizeof(uint32_t) + sizeof(uint8_t) + 3 * sizeof(uint64_t);
+// The global index is rewritten once it holds this many records and more
+// than two per packed user
+constexpr size_t kSegmentIndexCompactMin = 1024;
+
+// Keys of one packed user and where their values are
+struct PackedUser {
+    std::unordered_map<std::string, ValuePointer> values;
+    // Bytes of the value records, to tell when the user outgrows packing
+    uint64_t bytes = 0;
+};
+
+bool SameLocation(const ValuePointer& a, const ValuePointer& b) {
+    return a.segment == b.segment && a.offset == b.offset && a.size == b.size;
+}
+
+// Reads run concurrently with a flush. Writes for different users may run
+// in parallel; garbage collection runs alone.
+class PackedStore {
+   public:
+    PackedStore() {}
+    PackedStore(const PackedStore&) = delete;
+    PackedStore& operator=(const PackedStore&) = delete;
+
+    // Whether user is packed
+    bool Has(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        LoadLocked();
+        return index_.count(user) > 0;
+    }
+
+    int Get(const std::string& user, const std::string& key,
+            std::string& value) {
+        auto packed = LoadUser(user);
+        if (packed == nullptr) {
+            return KEY_ERROR;
+        }
+        auto it = packed->values.find(key);
+        if (it == packed->values.end()) {
+            return KEY_ERROR;
+        }
+        if (!segments_.Read(it->second, value)) {
+            warn("#KvCacheError: Failed to read value of key %s, user %s "
+                 "from segment %lu.\n",
+                 key.c_str(), user.c_str(), it->second.segment);
+            return KEY_ERROR;
+        }
+        return FINISHED;
+    }
+
+    // Values are never stored larger than they are, so records too large
+    // for max_size are not read
+    bool GetSmall(const std::string& user, const std::string& key,
+                  size_t max_size, std::string& value) {
+        auto packed = LoadUser(user);
+        if (packed == nullptr) {
+            return false;
+        }
+        auto it = packed->values.find(key);
+        if (it == packed->values.end() ||
+            it->second.size > kWalFrameSize + kWalPayloadFixedSize +
+                                  user.size() + key.size() +
+                                  sizeof(uint8_t) + max_size) {
+            return false;
+        }
+        std::string found;
+        if (!segments_.Read(it->second, found) || found.size() > max_size) {
+            return false;
+        }
+        value = std::move(found);
+        return true;
+    }
+
+    bool Contains(const std::string& user, const std::string& key) {
+        auto packed = LoadUser(user);
+        return packed != nullptr && packed->values.count(key) > 0;
+    }
+
+    bool GetAll(const std::string& user, KV_Map& kvs) {
+        auto packed = LoadUser(user);
+        if (packed == nullptr) {
+            return false;
+        }
+        kvs.clear();
+        for (const auto& [key, location] : packed->values) {
+            if (!segments_.Read(location, kvs[key])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Merge updates into the values of user, packing user if it is new.
+    // Sets outgrown if the user should move to a folder of its own. The
+    // change is durable after the next Commit.
+    bool Write(const std::string& user, const CompactKvMap& updates,
+               bool& outgrown) {
+        auto current = LoadUser(user);
+        if (current == nullptr) {
+            return false;
+        }
+        auto next = std::make_shared<PackedUser>(*current);
+
+        std::vector<std::string> keys;
+        std::vector<std::string> records;
+        std::string packed;
+        for (const auto& [key, value] : updates) {
+            if (value.empty()) {
+                auto old = next->values.find(std::string(key));
+                if (old != next->values.end()) {
+                    next->bytes -= old->second.size;
+                    next->values.erase(old);
+                }
+                continue;
+            }
+            keys.emplace_back(key);
+            // Flushes run in the background, so values may use the dense
+            // codec
+            Codec codec = PackValue(value, /*background=*/true, packed);
+            if (codec == CODEC_NONE) {
+                records.push_back(EncodeWalRecordParts(kWalPuts, 0, user,
+                                                       keys.back(), {value}));
+            } else {
+                char codec_byte = codec;
+                records.push_back(EncodeWalRecordParts(
+                    kWalPutsPacked, 0, user, keys.back(),
+                    {std::string_view(&codec_byte, 1), packed}));
+            }
+        }
+
+        std::vector<ValuePointer> locations;
+        if (!records.empty() && !segments_.AppendRecords(records, locations)) {
+            return false;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            auto old = next->values.find(keys[i]);
+            if (old != next->values.end()) {
+                next->bytes -= old->second.size;
+            }
+            next->values[keys[i]] = locations[i];
+            next->bytes += locations[i].size;
+        }
+
+        outgrown = next->bytes > PACKED_USER_MAX_BYTES;
+        return Install(user, next);
+    }
+
+    // Move the records of user in segment to the head, from data holding
+    // that segment
+    bool Relocate(const std::string& user, uint64_t segment,
+                  std::string_view data) {
+        auto current = LoadUser(user);
+        if (current == nullptr) {
+            return false;
+        }
+        auto next = std::make_shared<PackedUser>(*current);
+
+        std::vector<std::string> keys;
+        std::vector<std::string> records;
+        for (const auto& [key, location] : next->values) {
+            if (location.segment == segment) {
+                keys.push_back(key);
+                records.emplace_back(
+                    data.substr(location.offset, location.size));
+            }
+        }
+        std::vector<ValuePointer> locations;
+        if (!records.empty() && !segments_.AppendRecords(records, locations)) {
+            return false;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            next->values[keys[i]] = locations[i];
+        }
+        return Install(user, next);
+    }
+
+    // Stop packing user, whose values are stored elsewhere now
+    void Remove(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        LoadLocked();
+        index_.erase(user);
+        EvictLocked(user);
+        EncodeIndexRecord(pending_, user, nullptr);
+    }
+
+    // Make the writes so far durable: the segments, then the global index
+    // pointing into them
+    bool Commit() {
+        bool sync = wal_sync_mode != WAL_SYNC_NONE;
+        if (sync && !segments_.Sync()) {
+            return false;
+        }
+
+        std::string data;
+        bool rewrite;
+        size_t committed;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (pending_.empty()) {
+                return true;
+            }
+            rewrite = index_records_ > kSegmentIndexCompactMin &&
+                      index_records_ > 2 * index_.size();
+            if (rewrite) {
+                for (const auto& [user, location] : index_) {
+                    EncodeIndexRecord(data, user, &location);
+                }
+            } else {
+                data = pending_;
+            }
+            committed = pending_.size();
+        }
+
+        bool ok;
+        size_t records = CountIndexRecords(data);
+        if (rewrite) {
+            std::string tmp = IndexPath() + ".tmp";
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            file.write(data.data(), data.size());
+            file.close();
+            ok = file && (!sync || sync_path(tmp)) &&
+                 std::rename(tmp.c_str(), IndexPath().c_str()) == 0 &&
+                 (!sync || sync_path(PREFIX));
+        } else {
+            bool created = !exist_file(IndexPath().c_str());
+            int fd = open(IndexPath().c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                          0644);
+            ok = fd >= 0 &&
+                 write(fd, data.data(), data.size()) == (ssize_t)data.size() &&
+                 (!sync || fdatasync(fd) == 0) &&
+                 (!sync || !created || sync_path(PREFIX));
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        // Records queued while this commit was written stay pending
+        pending_.erase(0, committed);
+        index_records_ = rewrite ? records : index_records_ + records;
+        return true;
+    }
+
+    // Rewrite the shared segments that are mostly garbage. Segments emptied
+    // by the previous call are deleted first, as readers have moved on by
+    // now.
+    void CollectGarbage() {
+        segments_.DropRetired();
+
+        std::vector<uint64_t> emptied;
+        for (uint64_t segment : segments_.GcCandidates(VALUE_LOG_GC_SEGMENTS)) {
+            MappedFile file;
+            if (!file.Open(segments_.SegmentPath(segment))) {
+                continue;
+            }
+
+            // A record is live if the index of its user points to it
+            std::string_view data = file.View();
+            io_scheduler.Acquire(IO_COMPACTION, data.size());
+            std::unordered_set<std::string> users;
+            size_t live_bytes = 0;
+            WalReader reader(data);
+            WalRecord record;
+            size_t offset = reader.Offset();
+            while (reader.Next(record)) {
+                ValuePointer location{segment, offset,
+                                      reader.Offset() - offset};
+                std::string user(record.user);
+                if (IsLive(user, record, location)) {
+                    live_bytes += location.size;
+                    users.insert(user);
+                }
+                offset = reader.Offset();
+            }
+            if (reader.Corrupted()) {
+                warn("#KvCacheError: Ckpt: segment %lu is corrupted.\n",
+                     segment);
+                continue;
+            }
+            if ((data.size() - live_bytes) * 100 <
+                data.size() * VALUE_LOG_GC_PERCENT) {
+                continue;
+            }
+
+            debug("#KvCache: Ckpt: moving %zu packed users out of segment "
+                  "%lu\n",
+                  users.size(), segment);
+            bool moved = true;
+            for (const auto& user : users) {
+                moved = moved && Relocate(user, segment, data);
+            }
+            if (moved) {
+                emptied.push_back(segment);
+            }
+        }
+
+        if (!emptied.empty() && Commit()) {
+            for (uint64_t segment : emptied) {
+                segments_.Retire(segment);
+            }
+        }
+    }
+
+    // Forget what was loaded, e.g. before a full sync replaces the files
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        loaded_ = false;
+        index_.clear();
+        pending_.clear();
+        index_records_ = 0;
+        resident_.clear();
+        lru_.clear();
+        resident_bytes_ = 0;
+        segments_.Close();
+    }
+
+   private:
+    static std::string IndexPath() { return PREFIX + "segment_index"; }
+
+    static void EncodeIndexRecord(std::string& out, const std::string& user,
+                                  const ValuePointer* location) {
+        AppendRaw<uint32_t>(out, user.size());
+        out.append(user);
+        AppendRaw<uint8_t>(out, location != nullptr);
+        ValuePointer none;
+        const ValuePointer& at = location != nullptr ? *location : none;
+        AppendRaw<uint64_t>(out, at.segment);
+        AppendRaw<uint64_t>(out, at.offset);
+        AppendRaw<uint64_t>(out, at.size);
+    }
+
+    // Parse records of the global index from data into index, returning the
+    // bytes they take. A torn record at the end is left out.
+    static size_t DecodeIndexRecords(
+        std::string_view data,
+        std::unordered_map<std::string, ValuePointer>* index,
+        size_t& records) {
+        size_t pos = 0;
+        records = 0;
+        while (data.size() - pos >= sizeof(uint32_t)) {
+            uint32_t user_size = ReadRaw<uint32_t>(data.data() + pos);
+            if (data.size() - pos < kSegmentIndexRecordFixedSize + user_size) {
+                break;
+            }
+            const char* p = data.data() + pos + sizeof(uint32_t);
+            std::string user(p, user_size);
+            p += user_size;
+            bool packed = ReadRaw<uint8_t>(p) != 0;
+            p += sizeof(uint8_t);
+            ValuePointer location{
+                ReadRaw<uint64_t>(p), ReadRaw<uint64_t>(p + sizeof(uint64_t)),
+                ReadRaw<uint64_t>(p + 2 * sizeof(uint64_t))};
+            if (index != nullptr && packed) {
+                (*index)[user] = location;
+            } else if (index != nullptr) {
+                index->erase(user);
+            }
+            pos += kSegmentIndexRecordFixedSize + user_size;
+            records += 1;
+        }
+        return pos;
+    }
+
+    static size_t CountIndexRecords(std::string_view data) {
+        size_t records;
+        DecodeIndexRecords(data, nullptr, records);
+        return records;
+    }
+
+    static std::string EncodeUserIndex(const PackedUser& packed) {
+        std::string out;
+        for (const auto& [key, location] : packed.values) {
+            AppendRaw<uint32_t>(out, key.size());
+            out.append(key);
+            AppendRaw<uint64_t>(out, location.segment);
+            AppendRaw<uint64_t>(out, location.offset);
+            AppendRaw<uint64_t>(out, location.size);
+        }
+        return out;
+    }
+
+    static bool DecodeUserIndex(std::string_view data, PackedUser& packed) {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            if (data.size() - pos < kPackedIndexEntryFixedSize) {
+                return false;
+            }
+            uint32_t key_size = ReadRaw<uint32_t>(data.data() + pos);
+            if (data.size() - pos < kPackedIndexEntryFixedSize + key_size) {
+                return false;
+            }
+            const char* p = data.data() + pos + sizeof(uint32_t);
+            ValuePointer location;
+            location.segment = ReadRaw<uint64_t>(p + key_size);
+            location.offset =
+                ReadRaw<uint64_t>(p + key_size + sizeof(uint64_t));
+            location.size =
+                ReadRaw<uint64_t>(p + key_size + 2 * sizeof(uint64_t));
+            packed.values[std::string(p, key_size)] = location;
+            packed.bytes += location.size;
+            pos += kPackedIndexEntryFixedSize + key_size;
+        }
+        return true;
+    }
+
+    // Load the global index and find the segments, on first use
+    void LoadLocked() {
+        if (loaded_) {
+            return;
+        }
+        loaded_ = true;
+        segments_.SetPrefix(PREFIX + "segment-");
+        // Commit syncs everything a flush wrote at once
+        segments_.SetSyncMode(WAL_SYNC_NONE);
+        segments_.SetIoClass(IO_FLUSH);
+
+        std::string data;
+        std::string path = IndexPath();
+        if (!read_file(path, data)) {
+            return;
+        }
+        size_t valid = DecodeIndexRecords(data, &index_, index_records_);
+        if (valid < data.size()) {
+            truncate(path.c_str(), valid);
+        }
+        if (!segments_.Open()) {
+            warn("#KvCacheError: Failed to open the packed segments.\n");
+        }
+    }
+
+    // Index of user, read from its index record unless it is resident. An
+    // unknown user has an empty index. Returns nullptr if the index record
+    // cannot be read.
+    std::shared_ptr<const PackedUser> LoadUser(const std::string& user) {
+        ValuePointer location;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            LoadLocked();
+            auto resident = resident_.find(user);
+            if (resident != resident_.end()) {
+                lru_.splice(lru_.begin(), lru_, resident->second.lru_pos);
+                return resident->second.packed;
+            }
+            auto it = index_.find(user);
+            if (it == index_.end()) {
+                return std::make_shared<const PackedUser>();
+            }
+            location = it->second;
+        }
+
+        std::string data;
+        WalRecord record;
+        auto packed = std::make_shared<PackedUser>();
+        if (!segments_.ReadRecord(location, data, record) ||
+            record.op != kWalUserIndex ||
+            !DecodeUserIndex(record.value, *packed)) {
+            warn("#KvCacheError: Failed to read the index of packed user "
+                 "%s.\n",
+                 user.c_str());
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = index_.find(user);
+        if (it != index_.end() && SameLocation(it->second, location) &&
+            resident_.count(user) == 0) {
+            ResideLocked(user, packed);
+        }
+        return packed;
+    }
+
+    // Append the index record of user and make it current
+    bool Install(const std::string& user,
+                 const std::shared_ptr<const PackedUser>& packed) {
+        std::vector<ValuePointer> locations;
+        if (!segments_.AppendRecords(
+                {EncodeWalRecordParts(kWalUserIndex, 0, user, "",
+                                      {EncodeUserIndex(*packed)})},
+                locations)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mtx_);
+        index_[user] = locations[0];
+        EncodeIndexRecord(pending_, user, &locations[0]);
+        EvictLocked(user);
+        ResideLocked(user, packed);
+        return true;
+    }
+
+    bool IsLive(const std::string& user, const WalRecord& record,
+                const ValuePointer& location) {
+        if (record.op == kWalUserIndex) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            auto it = index_.find(user);
+            return it != index_.end() && SameLocation(it->second, location);
+        }
+        auto packed = LoadUser(user);
+        if (packed == nullptr) {
+            return false;
+        }
+        auto it = packed->values.find(std::string(record.key));
+        return it != packed->values.end() &&
+               SameLocation(it->second, location);
+    }
+
+    // Rough cost of a resident index: the keys, their locations and the hash
+    // nodes around them
+    static size_t EstimateBytes(const std::string& user,
+                                const PackedUser& packed) {
+        size_t bytes = sizeof(ResidentUser) + user.size();
+        for (const auto& [key, location] : packed.values) {
+            bytes += key.size() + sizeof(ValuePointer) + kNodeOverhead_;
+        }
+        return bytes;
+    }
+
+    // Keep packed resident, dropping the least recently used indexes while
+    // over budget
+    void ResideLocked(const std::string& user,
+                      const std::shared_ptr<const PackedUser>& packed) {
+        lru_.push_front(user);
+        ResidentUser& entry = resident_[user];
+        entry.packed = packed;
+        entry.lru_pos = lru_.begin();
+        entry.bytes = EstimateBytes(user, *packed);
+        resident_bytes_ += entry.bytes;
+        while (resident_bytes_ > PACKED_INDEX_BUDGET && lru_.size() > 1) {
+            EvictLocked(lru_.back());
+        }
+    }
+
+    void EvictLocked(const std::string& user) {
+        auto it = resident_.find(user);
+        if (it == resident_.end()) {
+            return;
+        }
+        resident_bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru_pos);
+        resident_.erase(it);
+    }
+
+    struct ResidentUser {
+        std::shared_ptr<const PackedUser> packed;
+        std::list<std::string>::iterator lru_pos;
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kNodeOverhead_ = 64;
+
+    ValueLog segments_;
+    // Guards everything below
+    std::mutex mtx_;
+    bool loaded_ = false;
+    // Location of the index record of each packed user
+    std::unordered_map<std::string, ValuePointer> index_;
+    // Global index records not committed yet
+    std::string pending_;
+    // Records in the global index file
+    size_t index_records_ = 0;
+    // Recently used indexes, most recent at the front of lru_
+    std::unordered_map<std::string, ResidentUser> resident_;
+    std::list<std::string> lru_;
+    size_t resident_bytes_ = 0;
+};
+
+}  // namespace KvCache
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef READ_CACHE_H_
+#define READ_CACHE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "kv_config.h"
+#include "value_ref.h"
+
+namespace KvCache {
+
+struct ReadCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Entries pushed out of the cache to make room
+    uint64_t evictions = 0;
+    // Candidates refused by the admission filter
+    uint64_t rejections = 0;
+    // Entries compressed on their way into probation
+    uint64_t packed = 0;
+};
+
+// Approximate access counts for admission, with periodic halving so that
+// old popularity fades.
+class FrequencySketch {
+   public:
+    explicit FrequencySketch(size_t width) {
+        width_ = 1;
+        while (width_ < width) {
+            width_ <<= 1;
+        }
+        table_.assign(kDepth_ * width_, 0);
+        sample_limit_ = 10 * width_;
+    }
+
+    void Increment(size_t hash) {
+        bool added = false;
+        for (size_t i = 0; i < kDepth_; ++i) {
+            uint8_t& counter = table_[i * width_ + Index(hash, i)];
+            if (counter < kMaxCount_) {
+                counter += 1;
+                added = true;
+            }
+        }
+        if (added && ++samples_ >= sample_limit_) {
+            Age();
+        }
+    }
+
+    uint8_t Estimate(size_t hash) const {
+        uint8_t ret = kMaxCount_;
+        for (size_t i = 0; i < kDepth_; ++i) {
+            ret = std::min(ret, table_[i * width_ + Index(hash, i)]);
+        }
+        return ret;
+    }
+
+   private:
+    size_t Index(size_t hash, size_t row) const {
+        uint64_t h = (hash + kSeeds_[row]) * 0x9E3779B97F4A7C15ULL;
+        return (h >> 32) & (width_ - 1);
+    }
+
+    void Age() {
+        for (auto& counter : table_) {
+            counter >>= 1;
+        }
+        samples_ /= 2;
+    }
+
+    static constexpr size_t kDepth_ = 4;
+    static constexpr uint8_t kMaxCount_ = 15;
+    static constexpr uint64_t kSeeds_[kDepth_] = {
+        0xC3A5C85C97CB3127ULL, 0xB492B66FBE98F273ULL, 0x9AE16A3B2F90404FULL,
+        0xCBF29CE484222325ULL};
+
+    size_t width_;
+    std::vector<uint8_t> table_;
+    size_t samples_ = 0;
+    size_t sample_limit_;
+};
+
+// Byte-budgeted read cache with W-TinyLFU admission. New entries land in a
+// small LRU window. Entries leaving the window only enter the main segmented
+// LRU if they have been accessed more often than the entries they would
+// displace, so a burst of large one-off reads cannot flush small hot values.
+// With READ_CACHE_COMPRESS_COLD, entries in probation are held compressed
+// with the fast codec and unpacked when a hit promotes them. Values are
+// shared, not copied, with the callers. Safe to use from several threads.
+class ReadCache {
+   public:
+    explicit ReadCache(size_t budget_bytes = READ_CACHE_BUDGET)
+        : sketch_(std::max<size_t>(budget_bytes / kExpectedEntryBytes_,
+                                   1024)) {
+        window_budget_ = std::max<size_t>(budget_bytes / 100, 1);
+        main_budget_ = budget_bytes - window_budget_;
+        protected_budget_ = main_budget_ / 5 * 4;
+    }
+
+    bool Get(const std::string& user, const std::string& key,
+             ValueRef& value) {
+        std::string id = Id(user, key);
+        std::lock_guard<std::mutex> lock(mtx_);
+        sketch_.Increment(Hash(id));
+
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            stats_.misses += 1;
+            return false;
+        }
+
+        Touch(it->second);
+        if (it->second.codec != CODEC_NONE) {
+            // Only if the packed value was corrupted
+            Erase(id);
+            stats_.misses += 1;
+            return false;
+        }
+        stats_.hits += 1;
+        value = it->second.value;
+        return true;
+    }
+
+    void Put(const std::string& user, const std::string& key,
+             ValueRef value) {
+        std::string id = Id(user, key);
+        std::lock_guard<std::mutex> lock(mtx_);
+        Erase(id);
+
+        size_t bytes = id.size() + value->size() + kEntryOverhead_;
+        if (bytes > main_budget_) {
+            stats_.rejections += 1;
+            return;
+        }
+
+        Entry& entry = entries_[id];
+        entry.value = std::move(value);
+        entry.bytes = bytes;
+        Link(entry, kWindow, id);
+        EvictWindow();
+    }
+
+    void Erase(const std::string& user, const std::string& key) {
+        std::string id = Id(user, key);
+        std::lock_guard<std::mutex> lock(mtx_);
+        Erase(id);
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        entries_.clear();
+        for (auto& segment : segments_) {
+            segment.clear();
+        }
+        for (auto& used : used_bytes_) {
+            used = 0;
+        }
+    }
+
+    size_t UsedBytes() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return used_bytes_[kWindow] + used_bytes_[kProbation] +
+               used_bytes_[kProtected];
+    }
+
+    ReadCacheStats Stats() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return stats_;
+    }
+
+   private:
+    enum Segment { kWindow = 0, kProbation = 1, kProtected = 2 };
+
+    struct Entry {
+        // Packed with codec unless it is CODEC_NONE
+        ValueRef value;
+        Codec codec = CODEC_NONE;
+        size_t bytes = 0;
+        Segment segment = kWindow;
+        std::list<std::string>::iterator pos;
+    };
+
+    static std::string Id(const std::string& user, const std::string& key) {
+        std::string id;
+        id.reserve(user.size() + key.size() + 1);
+        id.append(user);
+        id.push_back('\0');
+        id.append(key);
+        return id;
+    }
+
+    static size_t Hash(const std::string& id) {
+        return std::hash<std::string>{}(id);
+    }
+
+    void Link(Entry& entry, Segment segment, const std::string& id) {
+        segments_[segment].push_front(id);
+        entry.segment = segment;
+        entry.pos = segments_[segment].begin();
+        used_bytes_[segment] += entry.bytes;
+    }
+
+    void Unlink(Entry& entry) {
+        segments_[entry.segment].erase(entry.pos);
+        used_bytes_[entry.segment] -= entry.bytes;
+    }
+
+    void Erase(const std::string& id) {
+        auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            return;
+        }
+        Unlink(it->second);
+        entries_.erase(it);
+    }
+
+    // Compress the value of an unlinked entry if that saves memory.
+    void Pack(Entry& entry, const std::string& id) {
+        if (!READ_CACHE_COMPRESS_COLD || entry.codec != CODEC_NONE ||
+            entry.value->size() > kMaxPackBytes_) {
+            return;
+        }
+        std::string packed;
+        Codec codec = PackValue(*entry.value, /*background=*/false, packed);
+        if (codec == CODEC_NONE) {
+            return;
+        }
+        entry.value = std::make_shared<const std::string>(std::move(packed));
+        entry.codec = codec;
+        entry.bytes = id.size() + entry.value->size() + kEntryOverhead_;
+        stats_.packed += 1;
+    }
+
+    // Restore the raw value of an unlinked entry.
+    void Unpack(Entry& entry, const std::string& id) {
+        std::string value;
+        if (entry.codec == CODEC_NONE ||
+            !DecompressValue(entry.codec, *entry.value, value)) {
+            return;
+        }
+        entry.value = std::make_shared<const std::string>(std::move(value));
+        entry.codec = CODEC_NONE;
+        entry.bytes = id.size() + entry.value->size() + kEntryOverhead_;
+    }
+
+    // A hit moves the entry to the front of its segment. Hits in probation
+    // promote to protected, whose overflow falls back into probation.
+    void Touch(Entry& entry) {
+        std::string id = *entry.pos;
+        Segment segment = entry.segment == kProbation ? kProtected
+                                                      : entry.segment;
+        Unlink(entry);
+        Unpack(entry, id);
+        Link(entry, segment, id);
+
+        while (used_bytes_[kProtected] > protected_budget_ &&
+               segments_[kProtected].size() > 1) {
+            std::string demoted = segments_[kProtected].back();
+            Entry& victim = entries_[demoted];
+            Unlink(victim);
+            Pack(victim, demoted);
+            Link(victim, kProbation, demoted);
+        }
+
+        // Unpacking may have pushed the main cache over its budget
+        while (used_bytes_[kProbation] + used_bytes_[kProtected] >
+                   main_budget_ &&
+               !segments_[kProbation].empty()) {
+            Erase(std::string(segments_[kProbation].back()));
+            stats_.evictions += 1;
+        }
+    }
+
+    // Entries overflowing the window compete for a place in the main cache.
+    void EvictWindow() {
+        while (used_bytes_[kWindow] > window_budget_ &&
+               !segments_[kWindow].empty()) {
+            std::string id = segments_[kWindow].back();
+            Entry& candidate = entries_[id];
+            Unlink(candidate);
+            Pack(candidate, id);
+            Admit(id, candidate);
+        }
+    }
+
+    void Admit(const std::string& id, Entry& candidate) {
+        // Pick the least recently used main entries that would have to go
+        std::vector<std::string> victims;
+        size_t freed = 0;
+        size_t needed = used_bytes_[kProbation] + used_bytes_[kProtected] +
+                        candidate.bytes;
+        uint8_t victim_freq = 0;
+        for (Segment segment : {kProbation, kProtected}) {
+            for (auto it = segments_[segment].rbegin();
+                 it != segments_[segment].rend() && needed - freed > main_budget_;
+                 ++it) {
+                victims.push_back(*it);
+                freed += entries_[*it].bytes;
+                victim_freq = std::max(victim_freq, sketch_.Estimate(Hash(*it)));
+            }
+        }
+
+        if (!victims.empty() && sketch_.Estimate(Hash(id)) <= victim_freq) {
+            stats_.rejections += 1;
+            entries_.erase(id);
+            return;
+        }
+
+        for (const auto& victim : victims) {
+            Erase(victim);
+            stats_.evictions += 1;
+        }
+        Link(candidate, kProbation, id);
+    }
+
+    // Used to size the frequency sketch
+    static constexpr size_t kExpectedEntryBytes_ = 4096;
+    // Hash node, list node and bookkeeping of one entry
+    static constexpr size_t kEntryOverhead_ = 96;
+    // Larger values are not compressed, to bound the time spent under mtx_
+    static constexpr size_t kMaxPackBytes_ = 1 << 20;
+
+    std::mutex mtx_;
+    size_t window_budget_;
+    size_t main_budget_;
+    size_t protected_budget_;
+    FrequencySketch sketch_;
+    std::list<std::string> segments_[3];
+    size_t used_bytes_[3] = {0, 0, 0};
+    std::unordered_map<std::string, Entry> entries_;
+    ReadCacheStats stats_;
+};
+
+}  // namespace KvCache
+
+#endif
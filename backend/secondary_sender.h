@@ -0,0 +1,121 @@
+#ifndef SECONDARY_SENDER_H_
+#define SECONDARY_SENDER_H_
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../common/address_parse.h"
+#include "../common/tcp_operation.h"
+
+// Sends the commands the primary forwards to one secondary, in the order
+// they were queued, over one connection kept open between them. Sending
+// happens on a thread of its own, so that the connection thread of the
+// primary never waits for a secondary.
+//
+// A message that cannot be sent is retried over a new connection, with a
+// growing wait between attempts, until it gets through. Messages that
+// still cannot be sent when the sender is destroyed, because the secondary
+// left the cluster, are dropped; the secondary syncs with the primary when
+// it comes back.
+class SecondarySender {
+   public:
+    explicit SecondarySender(const Address& addr)
+        : addr_(addr), thread_(&SecondarySender::Run, this) {}
+    SecondarySender(const SecondarySender&) = delete;
+    SecondarySender& operator=(const SecondarySender&) = delete;
+
+    ~SecondarySender() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    // Queue a serialized kv_command behind the ones queued before
+    void Send(std::string msg) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            queue_.push_back(std::move(msg));
+        }
+        cv_.notify_one();
+    }
+
+    const Address& Addr() const { return addr_; }
+
+   private:
+    void Run() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (true) {
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                // One last attempt each, without waiting
+                while (!queue_.empty() && Write(queue_.front())) {
+                    queue_.pop_front();
+                }
+                if (!queue_.empty()) {
+                    warn("#KvServerError: Dropped %zu commands forwarded to "
+                         "secondary %s.\n",
+                         queue_.size(), addr_.name.c_str());
+                }
+                return;
+            }
+            std::string msg = std::move(queue_.front());
+            lock.unlock();
+            bool sent = Write(msg);
+            lock.lock();
+            if (sent) {
+                queue_.pop_front();
+                backoff_ = kMinBackoff_;
+                continue;
+            }
+            warn("#KvServerError: Cannot reach secondary %s, retrying in "
+                 "%ld ms.\n",
+                 addr_.name.c_str(), (long)backoff_.count());
+            queue_.front() = std::move(msg);
+            cv_.wait_for(lock, backoff_, [this] { return stopping_; });
+            backoff_ = std::min(backoff_ * 2, kMaxBackoff_);
+        }
+    }
+
+    bool Write(std::string& msg) {
+        if (fd_ < 0) {
+            fd_ = tcp_client_socket(addr_);
+        }
+        if (fd_ >= 0 && tcp_write_msg(fd_, msg)) {
+            return true;
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+        return false;
+    }
+
+    static constexpr std::chrono::milliseconds kMinBackoff_{10};
+    static constexpr std::chrono::milliseconds kMaxBackoff_{1000};
+
+    Address addr_;
+    // Connection to the secondary, -1 while closed. Only used by thread_.
+    int fd_ = -1;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::string> queue_;
+    bool stopping_ = false;
+    // Wait before the next attempt after a failed one
+    std::chrono::milliseconds backoff_ = kMinBackoff_;
+    std::thread thread_;
+};
+
+#endif
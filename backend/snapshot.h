@@ -0,0 +1,83 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include "arena_map.h"
+#include "chunk.h"
+#include "compression.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+#include "wal.h"
+
+namespace KvCache {
+// Memory image of a frozen generation of updates, written at checkpoint so
+// that a restart loads the generation in one pass instead of replaying the
+// log it was built from.
+//
+// A snapshot has the format of the binary log. Its header holds the
+// sequence id the generation was frozen at, which every record carries as
+// well. There is one record per key with its latest value as buffered: a
+// kWalPuts record, or a kWalDele record for a deletion. Value pointers and
+// blob references are kept as they are.
+
+// Write generation as the snapshot at path. The file is replaced in one
+// rename, so a crash leaves either the old snapshot or the new one.
+bool WriteSnapshot(const std::string& path, int seq,
+                   const UpdatesMap& generation) {
+    std::string data = EncodeWalHeader(seq);
+    std::string packed;
+    for (const auto& [user, kvs] : generation) {
+        for (const auto& [key, value] : kvs) {
+            if (value.empty()) {
+                data += EncodeWalRecord(kWalDele, seq, user, std::string(key),
+                                        "");
+                continue;
+            }
+            // Written on the checkpoint thread, so the dense codec is fine
+            Codec codec = PackValue(value, /*background=*/true, packed);
+            data += EncodeWalRecord(kWalPuts, seq, user, std::string(key),
+                                    codec == CODEC_NONE ? std::string(value)
+                                                        : packed,
+                                    codec);
+        }
+    }
+
+    io_scheduler.Acquire(IO_FLUSH, data.size());
+    bool sync = wal_sync_mode != WAL_SYNC_NONE;
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        sent += n;
+    }
+    bool ok = sent == data.size() && (!sync || fdatasync(fd) == 0);
+    close(fd);
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return !sync ||
+           sync_path(std::filesystem::path(path).parent_path().string());
+}
+
+}  // namespace KvCache
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef STORAGE_ENGINE_H_
+#define STORAGE_ENGINE_H_
+
+#include <string>
+
+#include "arena_map.h"
+#include "chunk.h"
+#include "kv_config.h"
+#include "user_registry.h"
+
+namespace KvCache {
+
+// On-disk store below the buffered updates of KvCache. The log, the updates
+// and replication are shared by all engines; an engine only keeps what
+// checkpoints flush to it. An empty value is a deletion. Users are those in
+// the registry of KvCache. Safe to use from several threads; reads run
+// concurrently with a flush.
+class StorageEngine {
+   public:
+    explicit StorageEngine(UserRegistry& users) : users_(users) {}
+    virtual ~StorageEngine() {}
+
+    // Value of key as stored. Returns USER_ERROR if user does not exist and
+    // KEY_ERROR if key is not stored.
+    virtual int Get(const std::string& user, const std::string& key,
+                    std::string& value) = 0;
+    // Value of key if it is stored in at most max_size bytes. Larger values
+    // are not read.
+    virtual bool GetSmall(const std::string& user, const std::string& key,
+                          size_t max_size, std::string& value) = 0;
+    // Whether key is stored, without reading its value if possible
+    virtual bool Contains(const std::string& user, const std::string& key) = 0;
+    // Every stored pair of user. Returns USER_ERROR if user does not exist.
+    virtual int GetAll(const std::string& user, KV_Map& kvs) = 0;
+
+    // Write a frozen generation of updates. Runs on the checkpoint thread.
+    // Returns false if part of it may not be durable; it is then flushed
+    // again with the next generation.
+    virtual bool Flush(const UpdatesMap& generation) = 0;
+    // Forget what was loaded from disk, e.g. before a full sync replaces the
+    // files
+    virtual void Clear() = 0;
+
+   protected:
+    UserRegistry& users_;
+};
+
+}  // namespace KvCache
+
+#endif
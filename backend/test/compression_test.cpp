@@ -0,0 +1,153 @@
+// Checks that both codecs give back the bytes they were given, and that
+// truncated or corrupted input is refused without reading or writing out
+// of bounds.
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+
+#include "../compression.h"
+
+const Codec kCodecs[] = {CODEC_FAST, CODEC_DENSE};
+
+// Words from a small vocabulary, which compress well
+std::string Text(size_t size, unsigned seed) {
+    const char* words[] = {"key ", "value ", "user ", "chunk ", "log ",
+                           "primary ", "secondary ", "\n"};
+    std::mt19937 rng(seed);
+    std::string text;
+    while (text.size() < size) {
+        text += words[rng() % 8];
+    }
+    text.resize(size);
+    return text;
+}
+
+std::string Noise(size_t size, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::string noise(size, '\0');
+    for (char& c : noise) {
+        c = (char)rng();
+    }
+    return noise;
+}
+
+void RoundTrip(Codec codec, const std::string& raw) {
+    std::string packed, restored;
+    assert(CompressValue(codec, raw, packed));
+    assert(packed.size() < raw.size());
+    assert(DecompressValue(codec, packed, restored));
+    assert(restored == raw);
+}
+
+// Text, a single repeated byte, whose matches overlap their own output, and
+// a long match far back
+void TestRoundTrip() {
+    for (Codec codec : kCodecs) {
+        for (size_t size : {300, 4096, 65536 + 7, 1 << 20}) {
+            RoundTrip(codec, Text(size, size));
+            RoundTrip(codec, std::string(size, 'x'));
+        }
+        std::string far = Noise(30000, 1);
+        RoundTrip(codec, far + far);
+    }
+}
+
+// Values that would not shrink by an eighth are kept raw
+void TestIncompressible() {
+    std::string packed, restored;
+    for (Codec codec : kCodecs) {
+        assert(!CompressValue(codec, Noise(4096, 2), packed));
+        assert(!CompressValue(codec, "", packed));
+    }
+    assert(!CompressValue(CODEC_NONE, Text(4096, 3), packed));
+    assert(DecompressValue(CODEC_NONE, "raw", restored));
+    assert(restored == "raw");
+}
+
+// Small and random values skip compression, large ones flushed in the
+// background get the dense codec
+void TestPackValue() {
+    std::string packed;
+    assert(PackValue(Text(COMPRESS_MIN_BYTES - 1, 4), true, packed) ==
+           CODEC_NONE);
+    assert(PackValue(Noise(8192, 5), true, packed) == CODEC_NONE);
+    assert(PackValue(Text(1024, 6), true, packed) == CODEC_FAST);
+    assert(PackValue(Text(COMPRESS_DENSE_BYTES, 7), false, packed) ==
+           CODEC_FAST);
+    assert(PackValue(Text(COMPRESS_DENSE_BYTES, 8), true, packed) ==
+           CODEC_DENSE);
+
+    compression_mode = COMPRESSION_FAST;
+    assert(PackValue(Text(COMPRESS_DENSE_BYTES, 9), true, packed) ==
+           CODEC_FAST);
+    compression_mode = COMPRESSION_OFF;
+    assert(PackValue(Text(COMPRESS_DENSE_BYTES, 10), true, packed) ==
+           CODEC_NONE);
+    compression_mode = COMPRESSION_AUTO;
+}
+
+// A cut packed value is refused, unless all that was cut is the empty last
+// sequence of the fast codec
+void TestTruncated() {
+    std::string raw = Text(5000, 11);
+    for (Codec codec : kCodecs) {
+        std::string packed, restored;
+        assert(CompressValue(codec, raw, packed));
+        for (size_t size = 0; size < packed.size(); ++size) {
+            if (DecompressValue(codec, packed.substr(0, size), restored)) {
+                assert(codec == CODEC_FAST && size == packed.size() - 1);
+                assert(restored == raw);
+            }
+        }
+    }
+}
+
+// A flipped bit either is refused or yields a value of the recorded size.
+// The fast codec has no checksum, so some flips go unnoticed.
+void TestBitFlip() {
+    std::string raw = Text(5000, 12);
+    for (Codec codec : kCodecs) {
+        std::string packed, restored;
+        assert(CompressValue(codec, raw, packed));
+        for (size_t i = kPackedHeaderSize; i < packed.size(); ++i) {
+            for (int bit = 0; bit < 8; bit += 3) {
+                std::string flipped = packed;
+                flipped[i] ^= 1 << bit;
+                if (DecompressValue(codec, flipped, restored)) {
+                    assert(restored.size() == raw.size());
+                    assert(codec == CODEC_FAST || restored == raw);
+                }
+            }
+        }
+    }
+}
+
+// A size header over the message limit is refused before allocating it,
+// and a wrong one does not match the codec output
+void TestBadSize() {
+    std::string raw = Text(5000, 13);
+    for (Codec codec : kCodecs) {
+        std::string packed, restored;
+        assert(CompressValue(codec, raw, packed));
+        for (uint64_t size : {(uint64_t)MAX_MESSAGE_BYTES + 1, ~(uint64_t)0,
+                              (uint64_t)raw.size() - 1,
+                              (uint64_t)raw.size() + 1}) {
+            memcpy(packed.data(), &size, sizeof(size));
+            assert(!DecompressValue(codec, packed, restored));
+        }
+    }
+    std::string restored;
+    assert(!DecompressValue((Codec)7, Text(100, 14), restored));
+}
+
+int main() {
+    TestRoundTrip();
+    TestIncompressible();
+    TestPackValue();
+    TestTruncated();
+    TestBitFlip();
+    TestBadSize();
+    printf("compression_test passed\n");
+    return 0;
+}
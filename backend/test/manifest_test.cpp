@@ -0,0 +1,154 @@
+// Checks that chunk manifests read back what was written, and that a torn
+// or corrupted tail is cut off at the last good record.
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "../chunk.h"
+
+const std::string kUser = "alice";
+
+std::string ManifestPath() { return user_folder(kUser) + "/chunk_manifest"; }
+
+size_t ManifestSize() { return std::filesystem::file_size(ManifestPath()); }
+
+void Reset() {
+    std::filesystem::remove_all(PREFIX);
+    std::filesystem::create_directories(user_folder(kUser));
+}
+
+void Write(const KV_Map& kvs) {
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(chunk.append_kvs(kvs) == FINISHED);
+}
+
+void FlipByte(size_t offset) {
+    std::fstream file(ManifestPath(),
+                      std::ios::binary | std::ios::in | std::ios::out);
+    file.seekg(offset);
+    char c = file.get();
+    file.seekp(offset);
+    file.put(c ^ 0x40);
+}
+
+bool Has(Chunk& chunk, const std::string& key, const std::string& value) {
+    std::string stored;
+    return chunk.get_value(key, stored) == FINISHED && stored == value;
+}
+
+// Puts and deletes come back after a reload
+void TestRoundTrip() {
+    Reset();
+    Write({{"a", "1"}, {"b", "2"}});
+    Write({{"b", ""}, {"c", std::string(5000, 'c')}});
+
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(chunk.metadata.size() == 2);
+    assert(Has(chunk, "a", "1"));
+    assert(chunk.metadata.count("b") == 0);
+    assert(Has(chunk, "c", std::string(5000, 'c')));
+}
+
+// A record torn by a crash is dropped and cut off the file, and later
+// records follow the last good one
+void TestTornTail() {
+    Reset();
+    Write({{"a", "1"}, {"b", "2"}});
+    size_t first = ManifestSize();
+    Write({{"c", "3"}});
+    assert(ManifestSize() > first);
+    truncate(ManifestPath().c_str(), ManifestSize() - 3);
+
+    {
+        Chunk chunk;
+        assert(chunk.init(kUser) == FINISHED);
+        assert(chunk.metadata.size() == 2);
+        assert(chunk.metadata.count("c") == 0);
+        assert(ManifestSize() == first);
+    }
+
+    Write({{"d", "4"}});
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(Has(chunk, "a", "1"));
+    assert(Has(chunk, "d", "4"));
+}
+
+// A flipped bit fails the checksum of its record, which ends the manifest
+void TestBitFlip() {
+    Reset();
+    Write({{"a", "1"}, {"b", "2"}});
+    size_t first = ManifestSize();
+    Write({{"c", "3"}});
+    Write({{"d", "4"}});
+
+    FlipByte(first + 6);
+    {
+        Chunk chunk;
+        assert(chunk.init(kUser) == FINISHED);
+        assert(chunk.metadata.size() == 2);
+        assert(chunk.metadata.count("c") == 0);
+        assert(chunk.metadata.count("d") == 0);
+        assert(ManifestSize() == first);
+    }
+
+    // In the first record, nothing is left but the magic
+    FlipByte(sizeof(kManifestMagic) + 1);
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(chunk.metadata.empty());
+    assert(ManifestSize() == sizeof(kManifestMagic));
+}
+
+// A file that is not a manifest is moved aside rather than appended to
+void TestUnknownFormat() {
+    Reset();
+    {
+        std::ofstream file(ManifestPath(), std::ios::binary);
+        file << "not a manifest at all";
+    }
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(chunk.metadata.empty());
+    assert(!std::filesystem::exists(ManifestPath()));
+    assert(std::filesystem::exists(ManifestPath() + ".bad"));
+}
+
+// Rewriting the same keys grows the manifest until it is compacted to one
+// record per key, which reads back the same
+void TestCompaction() {
+    Reset();
+    Write({{"a", "0"}, {"b", "b"}});
+    size_t largest = 0;
+    int i = 1;
+    for (; ManifestSize() >= largest; ++i) {
+        assert(i <= MANIFEST_COMPACT_MIN);
+        largest = ManifestSize();
+        Write({{"a", std::to_string(i)}, {"b", "b"}});
+    }
+
+    Chunk chunk;
+    assert(chunk.init(kUser) == FINISHED);
+    assert(chunk.manifest_records == 2);
+    assert(Has(chunk, "a", std::to_string(i - 1)));
+    assert(Has(chunk, "b", "b"));
+}
+
+int main() {
+    PREFIX = std::filesystem::temp_directory_path().string() +
+             "/manifest_test_" + std::to_string(getpid()) + "/";
+    TestRoundTrip();
+    TestTornTail();
+    TestBitFlip();
+    TestUnknownFormat();
+    TestCompaction();
+    std::filesystem::remove_all(PREFIX);
+    printf("manifest_test passed\n");
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Checks that binary log records read back as written, and that the reader
+// stops at the first torn or corrupted record.
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include "../wal.h"
+
+using namespace KvCache;
+
+const std::string kHash(kBlobHashSize, 'h');
+
+// A log of one record of each kind
+std::string Log(std::vector<size_t>& ends) {
+    std::string log = EncodeWalHeader(41);
+    log += EncodeWalRecord(kWalPuts, 42, "alice", "a", "1");
+    ends.push_back(log.size());
+    log += EncodeWalRecord(kWalDele, 43, "alice", "a", "");
+    ends.push_back(log.size());
+    log += EncodeWalRecord(kWalPuts, 44, "bob", "b", "packed", CODEC_FAST);
+    ends.push_back(log.size());
+    log += EncodeWalBlobRecord(45, "bob", "c", kHash, "blob", CODEC_DENSE);
+    ends.push_back(log.size());
+    log += EncodeWalBlobRecord(46, "bob", "d", kHash, "", CODEC_NONE);
+    ends.push_back(log.size());
+    return log;
+}
+
+// Reads to the end and returns how many records the reader got
+int ReadAll(WalReader& reader) {
+    WalRecord record;
+    int count = 0;
+    while (reader.Next(record)) {
+        assert(record.seq == 42 + count);
+        count += 1;
+    }
+    return count;
+}
+
+void TestRoundTrip() {
+    std::vector<size_t> ends;
+    std::string log = Log(ends);
+    int checkpoint_seq = 0;
+    assert(IsBinaryWal(log));
+    assert(DecodeWalHeader(log, checkpoint_seq));
+    assert(checkpoint_seq == 41);
+    assert(!DecodeWalHeader(log.substr(0, kWalHeaderSize - 1),
+                            checkpoint_seq));
+
+    WalReader reader(log);
+    WalRecord record;
+    assert(reader.Next(record));
+    assert(record.op == kWalPuts && record.user == "alice" &&
+           record.key == "a" && record.value == "1" &&
+           record.codec == CODEC_NONE);
+    assert(reader.Next(record));
+    assert(record.op == kWalDele && record.key == "a" &&
+           record.value.empty());
+    assert(reader.Next(record));
+    assert(record.op == kWalPuts && record.value == "packed" &&
+           record.codec == CODEC_FAST);
+    assert(reader.Next(record));
+    assert(record.op == kWalPutsBlob && record.key == "c" &&
+           record.blob_hash == kHash && record.value == "blob" &&
+           record.codec == CODEC_DENSE);
+    assert(reader.Next(record));
+    assert(record.op == kWalPutsBlob && record.blob_hash == kHash &&
+           record.value.empty());
+    assert(!reader.Next(record));
+    assert(!reader.Corrupted());
+    assert(reader.Offset() == log.size());
+}
+
+// Every cut stops the reader after the last whole record
+void TestTornTail() {
+    std::vector<size_t> ends;
+    std::string log = Log(ends);
+    size_t whole = 0;
+    for (size_t size = kWalHeaderSize; size < log.size(); ++size) {
+        while (whole < ends.size() && ends[whole] <= size) {
+            whole += 1;
+        }
+        WalReader reader(std::string_view(log).substr(0, size));
+        assert(ReadAll(reader) == (int)whole);
+        size_t offset = whole ? ends[whole - 1] : kWalHeaderSize;
+        assert(reader.Offset() == offset);
+        assert(reader.Corrupted() == (size > offset));
+    }
+}
+
+// Any flipped bit stops the reader at the record holding it
+void TestBitFlip() {
+    std::vector<size_t> ends;
+    std::string log = Log(ends);
+    size_t record = 0;
+    for (size_t i = kWalHeaderSize; i < log.size(); ++i) {
+        if (i >= ends[record]) {
+            record += 1;
+        }
+        for (int bit = 0; bit < 8; ++bit) {
+            std::string flipped = log;
+            flipped[i] ^= 1 << bit;
+            WalReader reader(flipped);
+            assert(ReadAll(reader) == (int)record);
+            assert(reader.Corrupted());
+            assert(reader.Offset() ==
+                   (record ? ends[record - 1] : kWalHeaderSize));
+        }
+    }
+}
+
+// Rewrite a field of the payload of record and fix up its checksum, as a
+// buggy writer would
+std::string Forge(std::string record, size_t field, uint64_t value,
+                  size_t size) {
+    memcpy(record.data() + kWalFrameSize + field, &value, size);
+    uint32_t payload_size = record.size() - kWalFrameSize;
+    uint32_t crc = Crc32(record.data() + kWalFrameSize, payload_size);
+    memcpy(record.data() + sizeof(uint32_t), &crc, sizeof(crc));
+    return record;
+}
+
+// Lengths that disagree with the payload are refused even with a good
+// checksum, including ones that wrap around when added up
+void TestBadLength() {
+    std::string record = EncodeWalRecord(kWalPuts, 1, "alice", "key", "value");
+    const size_t user_field = sizeof(uint8_t) + sizeof(int64_t);
+    const size_t key_field = user_field + sizeof(uint32_t);
+    const size_t value_field = key_field + sizeof(uint32_t);
+    WalRecord decoded;
+    size_t size;
+    assert(DecodeWalRecord(record, decoded, size));
+    assert(size == record.size());
+
+    assert(!DecodeWalRecord(Forge(record, user_field, 6, 4), decoded, size));
+    assert(!DecodeWalRecord(Forge(record, key_field, 0xFFFFFFFF, 4), decoded,
+                            size));
+    assert(!DecodeWalRecord(Forge(record, value_field, 4, 8), decoded, size));
+    // A key length grown by 2^32 - 8 and a value length shrunk by as much,
+    // wrapping around below zero
+    std::string wrapped = Forge(record, key_field, 3 + 0xFFFFFFF8, 4);
+    wrapped = Forge(wrapped, value_field, (uint64_t)5 - 0xFFFFFFF8, 8);
+    assert(!DecodeWalRecord(wrapped, decoded, size));
+
+    // A payload shorter than its fixed fields, or longer than the data
+    std::string frame = record;
+    uint32_t payload_size = 3;
+    memcpy(frame.data(), &payload_size, sizeof(payload_size));
+    assert(!DecodeWalRecord(frame, decoded, size));
+    payload_size = 0xFFFFFFFF;
+    memcpy(frame.data(), &payload_size, sizeof(payload_size));
+    assert(!DecodeWalRecord(frame, decoded, size));
+
+    // Blob records too short for their hash and codec
+    std::string blob = EncodeWalRecord(kWalPutsBlob, 1, "bob", "k",
+                                       std::string(kBlobHashSize, 'h'));
+    assert(!DecodeWalRecord(blob, decoded, size));
+    std::string packed = EncodeWalRecord(kWalPutsPacked, 1, "bob", "k", "");
+    assert(!DecodeWalRecord(packed, decoded, size));
+}
+
+// Text logs convert to the same records
+void TestConvertText() {
+    std::string text =
+        "KvStoreLogEntry Checkpointed at SequenceID: 41\n"
+        "KvStoreLogEntry Seq 42 user alice key a op Puts length 3\nx\ny\n"
+        "KvStoreLogEntry Seq 43 user alice key a op Dele length 0\n";
+    std::string binary;
+    assert(ConvertTextWal(text, binary));
+    int checkpoint_seq = 0;
+    assert(DecodeWalHeader(binary, checkpoint_seq));
+    assert(checkpoint_seq == 41);
+
+    WalReader reader(binary);
+    WalRecord record;
+    assert(reader.Next(record));
+    assert(record.op == kWalPuts && record.value == "x\ny");
+    assert(reader.Next(record));
+    assert(record.op == kWalDele && record.seq == 43);
+    assert(!reader.Next(record));
+    assert(!reader.Corrupted());
+    assert(!ConvertTextWal("not a log", binary));
+}
+
+int main() {
+    TestRoundTrip();
+    TestTornTail();
+    TestBitFlip();
+    TestBadLength();
+    TestConvertText();
+    printf("wal_test passed\n");
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Checks that sequenced writes of users sharing a worker cannot wait on each
+// other forever, with a quantum smaller than one request so that the worker
+// switches users after every task.
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../worker_pool.h"
+
+// Stands in for the sequence turn of KvCache: a write waits until the ones
+// numbered before it have finished, and gives up after a timeout.
+struct Sequencer {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int next = 0;
+    int finished = 0;
+    int timeouts = 0;
+    std::vector<int> order;
+
+    int Take() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return ++next;
+    }
+
+    void Run(int seq) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!cv.wait_for(lock, std::chrono::milliseconds(500),
+                         [&] { return seq == finished + 1; })) {
+            timeouts += 1;
+            return;
+        }
+        finished = seq;
+        order.push_back(seq);
+        cv.notify_all();
+    }
+};
+
+// Two users hashed to the only worker, each with a burst of writes. Taking
+// turns runs the writes of bob before the earlier ones of alice.
+const char* kUsers[] = {"alice", "bob"};
+const int kWrites = 20;
+const size_t kRequestBytes = 100;
+
+// The primary numbers writes once the worker starts them
+void TestSequencedOnDequeue() {
+    ShardedWorkerPool pool(1, /*quantum=*/10);
+    pool.SetWeight("alice", 3);
+    Sequencer seq;
+    for (const char* user : kUsers) {
+        for (int i = 0; i < kWrites; ++i) {
+            pool.Submit(user, kRequestBytes, [&seq] {
+                seq.Run(seq.Take());
+                return kRequestBytes;
+            });
+        }
+    }
+    pool.Drain();
+    assert(seq.timeouts == 0);
+    assert(seq.finished == 2 * kWrites);
+}
+
+// Secondaries get writes numbered and run them in submission order
+void TestOrderedSequencedOnSubmit() {
+    ShardedWorkerPool pool(1, /*quantum=*/10);
+    pool.SetOrdered(true);
+    Sequencer seq;
+    for (const char* user : kUsers) {
+        for (int i = 0; i < kWrites; ++i) {
+            int number = seq.Take();
+            pool.Submit(user, kRequestBytes, [&seq, number] {
+                seq.Run(number);
+                return kRequestBytes;
+            });
+        }
+    }
+    pool.Drain();
+    assert(seq.timeouts == 0);
+    for (int i = 0; i < 2 * kWrites; ++i) {
+        assert(seq.order[i] == i + 1);
+    }
+}
+
+// Without ordering the worker takes turns between the users
+void TestFairTurns() {
+    ShardedWorkerPool pool(1, /*quantum=*/10);
+    std::mutex mtx;
+    std::string order;
+    // Hold the worker until both users have queued their tasks
+    std::mutex gate;
+    gate.lock();
+    pool.Submit("warmup", 0, [&gate] {
+        std::lock_guard<std::mutex> lock(gate);
+        return (size_t)0;
+    });
+    for (const char* user : kUsers) {
+        for (int i = 0; i < 3; ++i) {
+            pool.Submit(user, kRequestBytes, [&, user] {
+                std::lock_guard<std::mutex> lock(mtx);
+                order += user[0];
+                return kRequestBytes;
+            });
+        }
+    }
+    gate.unlock();
+    pool.Drain();
+    assert(order == "ababab");
+}
+
+int main() {
+    TestSequencedOnDequeue();
+    TestOrderedSequencedOnSubmit();
+    TestFairTurns();
+    printf("worker_pool_test passed\n");
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef USER_REGISTRY_H_
+#define USER_REGISTRY_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "chunk.h"
+#include "kv_config.h"
+
+namespace KvCache {
+
+// Users created on this node, listed in PREFIX/users one name per line.
+// Folders under PREFIX/users.d are users as well, since every user had one
+// before small users were packed into shared segment files. Loaded on first
+// use. Safe to use from several threads.
+class UserRegistry {
+   public:
+    bool Has(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        LoadLocked();
+        return users_.count(user) > 0;
+    }
+
+    // Record user, durably unless the log is not synced either
+    bool Add(const std::string& user) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        LoadLocked();
+        if (users_.count(user) > 0) {
+            return true;
+        }
+
+        std::string path = Path();
+        bool created = !exist_file(path.c_str());
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        std::string line = user + "\n";
+        bool ok = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+        if (ok && wal_sync_mode != WAL_SYNC_NONE) {
+            ok = fdatasync(fd) == 0 && (!created || sync_path(PREFIX));
+        }
+        close(fd);
+        if (ok) {
+            users_.insert(user);
+        }
+        return ok;
+    }
+
+    // Forget what was loaded, e.g. before a full sync replaces the files
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        users_.clear();
+        loaded_ = false;
+    }
+
+   private:
+    static std::string Path() { return PREFIX + "users"; }
+
+    // A crash may have torn the last line, which is cut off
+    void LoadLocked() {
+        if (loaded_) {
+            return;
+        }
+        loaded_ = true;
+
+        std::string text;
+        std::string path = Path();
+        if (read_file(path, text)) {
+            size_t start = 0;
+            for (size_t end = text.find('\n'); end != std::string::npos;
+                 end = text.find('\n', start)) {
+                users_.insert(text.substr(start, end - start));
+                start = end + 1;
+            }
+            if (start < text.size()) {
+                truncate(path.c_str(), start);
+            }
+        }
+
+        MoveUserFolders();
+        std::error_code code;
+        for (const auto& entry :
+             std::filesystem::directory_iterator(PREFIX + USER_DIR, code)) {
+            if (entry.is_directory(code)) {
+                users_.insert(entry.path().filename().string());
+            }
+        }
+    }
+
+    // User folders used to be right under PREFIX, where no other folder
+    // lives. Move them into USER_DIR.
+    static void MoveUserFolders() {
+        std::error_code code;
+        std::string user_dir = PREFIX + USER_DIR;
+        std::vector<std::filesystem::path> folders;
+        for (const auto& entry :
+             std::filesystem::directory_iterator(PREFIX, code)) {
+            if (entry.is_directory(code) &&
+                entry.path() != std::filesystem::path(user_dir).parent_path()) {
+                folders.push_back(entry.path());
+            }
+        }
+        if (folders.empty()) {
+            return;
+        }
+        std::filesystem::create_directories(user_dir, code);
+        for (const auto& folder : folders) {
+            std::filesystem::path to = user_dir;
+            std::filesystem::rename(folder, to / folder.filename(), code);
+            if (code) {
+                warn("#KvCacheError: Failed to move user folder %s.\n",
+                     folder.c_str());
+            }
+        }
+        if (wal_sync_mode != WAL_SYNC_NONE) {
+            sync_path(user_dir);
+            sync_path(PREFIX);
+        }
+    }
+
+    std::mutex mtx_;
+    bool loaded_ = false;
+    std::unordered_set<std::string> users_;
+};
+
+}  // namespace KvCache
+
+#endif
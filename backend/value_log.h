@@ -0,0 +1,391 @@
+#ifndef VALUE_LOG_H_
+#define VALUE_LOG_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "chunk.h"
+#include "compression.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+#include "wal.h"
+
+namespace KvCache {
+// Append-only log of large values, written once on their way in.
+//
+// The log, the buffered updates and the chunk files hold a value pointer in
+// place of such a value: kValuePointerMagic followed by the segment, offset
+// and size (uint64 each) of the record holding it. Values starting with
+// kValuePointerMagic are reserved for pointers.
+//
+// Segments are files named after the log followed by their number. Each
+// starts with a log header and holds records in the log format, with
+// sequence number 0, so that garbage collection can tell from the user and
+// key of a record whether it is still pointed to.
+
+const std::string kValuePointerMagic = std::string("\0KvValuePtr\0", 12);
+constexpr size_t kValuePointerSize = 12 + 3 * sizeof(uint64_t);
+
+struct ValuePointer {
+    uint64_t segment = 0;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+};
+
+bool HasValuePointerMagic(std::string_view value) {
+    return value.substr(0, kValuePointerMagic.size()) == kValuePointerMagic;
+}
+
+bool IsValuePointer(std::string_view value) {
+    return value.size() == kValuePointerSize && HasValuePointerMagic(value);
+}
+
+std::string EncodeValuePointer(const ValuePointer& pointer) {
+    std::string out = kValuePointerMagic;
+    AppendRaw<uint64_t>(out, pointer.segment);
+    AppendRaw<uint64_t>(out, pointer.offset);
+    AppendRaw<uint64_t>(out, pointer.size);
+    return out;
+}
+
+bool DecodeValuePointer(std::string_view value, ValuePointer& pointer) {
+    if (!IsValuePointer(value)) {
+        return false;
+    }
+    const char* p = value.data() + kValuePointerMagic.size();
+    pointer.segment = ReadRaw<uint64_t>(p);
+    pointer.offset = ReadRaw<uint64_t>(p + sizeof(uint64_t));
+    pointer.size = ReadRaw<uint64_t>(p + 2 * sizeof(uint64_t));
+    return true;
+}
+
+// Appends go to the newest segment through a WalWriter, so concurrent
+// appends share their writes and syncs. Reads and appends may run
+// concurrently. Packed users keep their values in segments of the same kind,
+// see packed_store.h.
+class ValueLog {
+   public:
+    ValueLog() {}
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    // Segments are named prefix followed by their number
+    void SetPrefix(const std::string& prefix) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        CloseLocked();
+        prefix_ = prefix;
+    }
+
+    void SetSyncMode(WalSyncMode mode) { writer_.SetSyncMode(mode); }
+    void SetIoClass(IoClass io) { writer_.SetIoClass(io); }
+
+    // Find the segments on disk and continue appending to the newest one,
+    // cutting off a torn record at its tail.
+    bool Open() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        CloseLocked();
+        return OpenLocked();
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        CloseLocked();
+    }
+
+    // Write value of key to the log, packed with the fast codec if that
+    // pays off. Returns once it is as durable as the sync mode asks, with
+    // the pointer to it set in pointer.
+    bool Append(const std::string& user, const std::string& key,
+                const std::string& value, std::string& pointer) {
+        std::string packed;
+        Codec codec = PackValue(value, /*background=*/false, packed);
+        return AppendRecord(
+            EncodeWalRecord(kWalPuts, 0, user, key,
+                            codec == CODEC_NONE ? value : packed, codec),
+            pointer);
+    }
+
+    // Append an encoded record, e.g. one moved by garbage collection
+    bool AppendRecord(const std::string& record, std::string& pointer) {
+        std::vector<ValuePointer> locations;
+        if (!AppendRecords({record}, locations)) {
+            return false;
+        }
+        pointer = EncodeValuePointer(locations[0]);
+        return true;
+    }
+
+    // Append encoded records next to each other with a single write, setting
+    // the location of each in locations
+    bool AppendRecords(const std::vector<std::string>& records,
+                       std::vector<ValuePointer>& locations) {
+        size_t bytes = 0;
+        for (const auto& record : records) {
+            bytes += record.size();
+        }
+        std::string batch;
+        batch.reserve(bytes);
+        locations.clear();
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (!opened_ && !OpenLocked()) {
+                return false;
+            }
+            if (head_bytes_ > kWalHeaderSize &&
+                head_bytes_ + bytes > VALUE_LOG_SEGMENT_BYTES &&
+                !RollLocked()) {
+                return false;
+            }
+            for (const auto& record : records) {
+                locations.push_back({head_, head_bytes_ + batch.size(),
+                                     record.size()});
+                batch.append(record);
+            }
+            ticket = writer_.Enqueue(batch);
+            head_bytes_ += bytes;
+            unsynced_.insert(head_);
+        }
+        return writer_.Wait(ticket);
+    }
+
+    // Read the value pointer points to
+    bool Read(std::string_view pointer, std::string& value) {
+        ValuePointer location;
+        return DecodeValuePointer(pointer, location) && Read(location, value);
+    }
+
+    bool Read(const ValuePointer& location, std::string& value) {
+        std::string data;
+        WalRecord record;
+        return ReadRecord(location, data, record) &&
+               DecompressValue(record.codec, record.value, value);
+    }
+
+    // Read and decode the record at location into data
+    bool ReadRecord(const ValuePointer& location, std::string& data,
+                    WalRecord& record) {
+        auto file = ReadFile(location.segment);
+        if (file == nullptr) {
+            return false;
+        }
+        data.resize(location.size);
+        io_scheduler.Charge(IO_FOREGROUND, data.size());
+        ssize_t n =
+            pread(file->fd, data.data(), data.size(), location.offset);
+        size_t size;
+        return n == (ssize_t)data.size() &&
+               DecodeWalRecord(data, record, size);
+    }
+
+    // Make the segments appended to since the last call durable, for logs
+    // whose writer does not sync
+    bool Sync() {
+        std::set<uint64_t> segments;
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            segments.swap(unsynced_);
+        }
+        bool ok = true;
+        for (uint64_t segment : segments) {
+            ok = sync_path(SegmentPath(segment)) && ok;
+        }
+        // New segments live in the directory entry
+        std::string dir = std::filesystem::path(prefix_).parent_path();
+        ok = segments.empty() || (sync_path(dir) && ok);
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(mtx_);
+            unsynced_.insert(segments.begin(), segments.end());
+        }
+        return ok;
+    }
+
+    std::string SegmentPath(uint64_t segment) const {
+        return prefix_ + std::to_string(segment);
+    }
+
+    // Up to count segments that no longer take appends, to be checked for
+    // garbage. Each call continues where the previous one stopped.
+    std::vector<uint64_t> GcCandidates(size_t count) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::vector<uint64_t> sealed;
+        for (uint64_t segment : segments_) {
+            if (segment != head_ && retired_.count(segment) == 0) {
+                sealed.push_back(segment);
+            }
+        }
+
+        std::vector<uint64_t> ret;
+        auto next = std::upper_bound(sealed.begin(), sealed.end(), gc_cursor_);
+        for (size_t i = 0; i < std::min(count, sealed.size()); ++i) {
+            if (next == sealed.end()) {
+                next = sealed.begin();
+            }
+            ret.push_back(*next++);
+        }
+        if (!ret.empty()) {
+            gc_cursor_ = ret.back();
+        }
+        return ret;
+    }
+
+    // Nothing points into segment any more once the current updates are
+    // durable. It is deleted by the next DropRetired.
+    void Retire(uint64_t segment) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        retired_.insert(segment);
+    }
+
+    void DropRetired() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (uint64_t segment : retired_) {
+            std::remove(SegmentPath(segment).c_str());
+            segments_.erase(segment);
+            readers_.erase(segment);
+        }
+        retired_.clear();
+    }
+
+   private:
+    // Descriptor kept open for reads of one segment, closed once the last
+    // reader is done with it
+    struct ReadFd {
+        int fd;
+        explicit ReadFd(int fd) : fd(fd) {}
+        ~ReadFd() { close(fd); }
+    };
+
+    std::shared_ptr<ReadFd> ReadFile(uint64_t segment) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        auto it = readers_.find(segment);
+        if (it != readers_.end()) {
+            return it->second;
+        }
+        int fd = open(SegmentPath(segment).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        auto file = std::make_shared<ReadFd>(fd);
+        readers_[segment] = file;
+        return file;
+    }
+
+    bool OpenLocked() {
+        if (prefix_.empty()) {
+            return false;
+        }
+        std::filesystem::path prefix{prefix_};
+        std::string name = prefix.filename().string();
+        std::error_code code;
+        for (const auto& entry : std::filesystem::directory_iterator(
+                 prefix.parent_path(), code)) {
+            std::string file = entry.path().filename().string();
+            if (file.size() > name.size() && file.rfind(name, 0) == 0 &&
+                file.find_first_not_of("0123456789", name.size()) ==
+                    std::string::npos) {
+                segments_.insert(std::stoull(file.substr(name.size())));
+            }
+        }
+        if (code) {
+            return false;
+        }
+
+        if (segments_.empty()) {
+            head_ = 0;
+            segments_.insert(head_);
+            writer_.SetPath(SegmentPath(head_));
+            if (!writer_.Reset(EncodeWalHeader(0))) {
+                return false;
+            }
+            head_bytes_ = kWalHeaderSize;
+            opened_ = true;
+            return true;
+        }
+
+        // A crash may have torn the last record of the newest segment
+        head_ = *segments_.rbegin();
+        std::string path = SegmentPath(head_);
+        MappedFile file;
+        if (!file.Open(path)) {
+            return false;
+        }
+        writer_.SetPath(path);
+        if (file.View().size() < kWalHeaderSize) {
+            if (!writer_.Reset(EncodeWalHeader(0))) {
+                return false;
+            }
+            head_bytes_ = kWalHeaderSize;
+        } else {
+            WalReader reader(file.View());
+            WalRecord record;
+            while (reader.Next(record)) {
+            }
+            head_bytes_ = reader.Offset();
+            if (reader.Corrupted() &&
+                truncate(path.c_str(), head_bytes_) != 0) {
+                return false;
+            }
+            if (!writer_.Open()) {
+                return false;
+            }
+        }
+        opened_ = true;
+        return true;
+    }
+
+    void CloseLocked() {
+        writer_.Close();
+        opened_ = false;
+        segments_.clear();
+        retired_.clear();
+        unsynced_.clear();
+        readers_.clear();
+    }
+
+    bool RollLocked() {
+        writer_.SetPath(SegmentPath(head_ + 1));
+        if (!writer_.Reset(EncodeWalHeader(0))) {
+            // Found again by the next append
+            CloseLocked();
+            return false;
+        }
+        head_ += 1;
+        segments_.insert(head_);
+        head_bytes_ = kWalHeaderSize;
+        return true;
+    }
+
+    std::mutex mtx_;
+    std::string prefix_;
+    bool opened_ = false;
+    WalWriter writer_;
+    // Segments on disk. The newest one, head_, takes the appends.
+    std::set<uint64_t> segments_;
+    uint64_t head_ = 0;
+    // Size of head_ including the records queued for it
+    uint64_t head_bytes_ = 0;
+    // Segments waiting to be deleted
+    std::set<uint64_t> retired_;
+    // Segments appended to since the last Sync
+    std::set<uint64_t> unsynced_;
+    // Open descriptors of the segments read so far
+    std::map<uint64_t, std::shared_ptr<ReadFd>> readers_;
+    // Last segment handed out by GcCandidates
+    uint64_t gc_cursor_ = 0;
+};
+
+}  // namespace KvCache
+
+#endif
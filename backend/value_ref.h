@@ -0,0 +1,12 @@
+#ifndef VALUE_REF_H_
+#define VALUE_REF_H_
+
+#include <memory>
+#include <string>
+
+// Immutable value shared between the buffered updates, the read cache and
+// the replies being written out, so that a large value is read or received
+// once and then only passed around by reference.
+typedef std::shared_ptr<const std::string> ValueRef;
+
+#endif
@@ -0,0 +1,551 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+
+#include "blob_ref.h"
+#include "compression.h"
+#include "io_scheduler.h"
+#include "kv_config.h"
+
+namespace KvCache {
+// Binary write-ahead log.
+//
+// Header:  magic (8 bytes) | checkpoint sequence id (int64)
+// Record:  payload length (uint32) | crc32 of payload (uint32) | payload
+// Payload: op (uint8) | seq (int64) | user length (uint32) |
+//          key length (uint32) | value length (uint64) | user | key | value
+//
+// The value of a kWalPutsPacked record is the codec (uint8) followed by the
+// packed value, see compression.h. The value of a kWalPutsBlob record is the
+// blob hash, the codec and the content, which is empty when the blob was
+// already stored, see blob_ref.h.
+
+constexpr char kWalMagic[8] = {'K', 'V', 'W', 'A', 'L', '0', '0', '1'};
+constexpr size_t kWalHeaderSize = sizeof(kWalMagic) + sizeof(int64_t);
+constexpr size_t kWalFrameSize = 2 * sizeof(uint32_t);
+constexpr size_t kWalPayloadFixedSize = sizeof(uint8_t) + sizeof(int64_t) +
+                                        2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+enum WalOp : uint8_t {
+    kWalPuts = 1,
+    kWalDele = 2,
+    kWalPutsPacked = 3,
+    kWalPutsBlob = 4,
+    // Keys of a packed user and where their values are. Only found in
+    // packed segment files, see packed_store.h.
+    kWalUserIndex = 5,
+};
+
+// Text log format used before the binary log, kept for conversion.
+// KvStoreLogEntry Seq 123 user XXX key XXX Op XXX
+const std::string kTextPuts = "Puts";
+const std::string kTextDele = "Dele";
+const std::regex kLoggingHeaderRegex = std::regex(
+    "KvStoreLogEntry\\sSeq\\s([0-9]+)\\suser\\s([a-zA-Z0-9\\.\\-\\+\\_=]+)"
+    "\\skey\\s([a-"
+    "zA-Z0-9\\.\\-\\+\\_=]+)\\sop\\s([a-zA-Z]+)\\slength\\s([0-9]+)\n");
+const std::regex kLoggingSequenceIdHeader = std::regex(
+    "KvStoreLogEntry\\sCheckpointed\\sat\\sSequenceID:\\s([0-9]+)\n");
+
+// CRC-32 (IEEE 802.3)
+uint32_t Crc32(const char* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFU;
+}
+
+template <typename T>
+void AppendRaw(std::string& out, T value) {
+    out.append((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+T ReadRaw(const char* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+std::string EncodeWalHeader(int checkpoint_seq) {
+    std::string out(kWalMagic, sizeof(kWalMagic));
+    AppendRaw<int64_t>(out, checkpoint_seq);
+    return out;
+}
+
+bool IsBinaryWal(std::string_view log) {
+    return log.size() >= sizeof(kWalMagic) &&
+           memcmp(log.data(), kWalMagic, sizeof(kWalMagic)) == 0;
+}
+
+bool DecodeWalHeader(std::string_view log, int& checkpoint_seq) {
+    if (!IsBinaryWal(log) || log.size() < kWalHeaderSize) {
+        return false;
+    }
+    checkpoint_seq = ReadRaw<int64_t>(log.data() + sizeof(kWalMagic));
+    return true;
+}
+
+// Record whose value is the concatenation of parts
+std::string EncodeWalRecordParts(WalOp op, int seq, const std::string& user,
+                                 const std::string& key,
+                                 std::initializer_list<std::string_view> parts) {
+    size_t value_size = 0;
+    for (std::string_view part : parts) {
+        value_size += part.size();
+    }
+    std::string out;
+    out.reserve(kWalFrameSize + kWalPayloadFixedSize + user.size() +
+                key.size() + value_size);
+    out.resize(kWalFrameSize);
+    AppendRaw<uint8_t>(out, op);
+    AppendRaw<int64_t>(out, seq);
+    AppendRaw<uint32_t>(out, user.size());
+    AppendRaw<uint32_t>(out, key.size());
+    AppendRaw<uint64_t>(out, value_size);
+    out.append(user);
+    out.append(key);
+    for (std::string_view part : parts) {
+        out.append(part);
+    }
+
+    uint32_t payload_size = out.size() - kWalFrameSize;
+    uint32_t crc = Crc32(out.data() + kWalFrameSize, payload_size);
+    memcpy(out.data(), &payload_size, sizeof(uint32_t));
+    memcpy(out.data() + sizeof(uint32_t), &crc, sizeof(uint32_t));
+    return out;
+}
+
+// A codec other than CODEC_NONE turns a kWalPuts record into a
+// kWalPutsPacked one holding value as packed with that codec.
+std::string EncodeWalRecord(WalOp op, int seq, const std::string& user,
+                            const std::string& key, const std::string& value,
+                            Codec codec = CODEC_NONE) {
+    if (codec == CODEC_NONE) {
+        return EncodeWalRecordParts(op, seq, user, key, {value});
+    }
+    char codec_byte = codec;
+    return EncodeWalRecordParts(kWalPutsPacked, seq, user, key,
+                                {std::string_view(&codec_byte, 1), value});
+}
+
+// Binds key to the blob of hash. content is empty if the blob is stored
+// already, and otherwise packed with codec.
+std::string EncodeWalBlobRecord(int seq, const std::string& user,
+                                const std::string& key, const std::string& hash,
+                                const std::string& content, Codec codec) {
+    char codec_byte = codec;
+    return EncodeWalRecordParts(kWalPutsBlob, seq, user, key,
+                                {hash, std::string_view(&codec_byte, 1),
+                                 content});
+}
+
+// One decoded record. Fields point into the buffer given to WalReader.
+// Packed puts are reported as kWalPuts with the codec of their value. For
+// kWalPutsBlob, value is the content of the blob of blob_hash.
+struct WalRecord {
+    WalOp op;
+    int seq;
+    std::string_view user;
+    std::string_view key;
+    std::string_view value;
+    Codec codec = CODEC_NONE;
+    std::string_view blob_hash;
+};
+
+// Decode the record at the start of data. Sets size to the bytes it takes.
+// Returns false if the record is torn or corrupted.
+bool DecodeWalRecord(std::string_view data, WalRecord& record, size_t& size) {
+    if (data.size() < kWalFrameSize) {
+        return false;
+    }
+
+    uint32_t payload_size = ReadRaw<uint32_t>(data.data());
+    uint32_t crc = ReadRaw<uint32_t>(data.data() + sizeof(uint32_t));
+    if (data.size() - kWalFrameSize < payload_size ||
+        payload_size < kWalPayloadFixedSize) {
+        return false;
+    }
+
+    const char* p = data.data() + kWalFrameSize;
+    if (Crc32(p, payload_size) != crc) {
+        return false;
+    }
+
+    record.op = (WalOp)ReadRaw<uint8_t>(p);
+    p += sizeof(uint8_t);
+    record.seq = ReadRaw<int64_t>(p);
+    p += sizeof(int64_t);
+    uint32_t user_size = ReadRaw<uint32_t>(p);
+    p += sizeof(uint32_t);
+    uint32_t key_size = ReadRaw<uint32_t>(p);
+    p += sizeof(uint32_t);
+    uint64_t value_size = ReadRaw<uint64_t>(p);
+    p += sizeof(uint64_t);
+    // Compared part by part, so that no sum of lengths can wrap around
+    uint64_t rest = payload_size - kWalPayloadFixedSize;
+    if (user_size > rest || key_size > rest - user_size ||
+        value_size != rest - user_size - key_size) {
+        return false;
+    }
+
+    record.user = std::string_view(p, user_size);
+    record.key = std::string_view(p + user_size, key_size);
+    record.value = std::string_view(p + user_size + key_size, value_size);
+    record.codec = CODEC_NONE;
+    record.blob_hash = std::string_view();
+    if (record.op == kWalPutsBlob) {
+        if (record.value.size() < kBlobHashSize) {
+            return false;
+        }
+        record.blob_hash = record.value.substr(0, kBlobHashSize);
+        record.value.remove_prefix(kBlobHashSize);
+    }
+    if (record.op == kWalPutsPacked || record.op == kWalPutsBlob) {
+        if (record.value.empty()) {
+            return false;
+        }
+        if (record.op == kWalPutsPacked) {
+            record.op = kWalPuts;
+        }
+        record.codec = (Codec)record.value[0];
+        record.value.remove_prefix(sizeof(uint8_t));
+    }
+    size = kWalFrameSize + payload_size;
+    return true;
+}
+
+// Walks the records of a binary log in one pass without copying. Stops at the
+// first torn or corrupted record.
+class WalReader {
+   public:
+    explicit WalReader(std::string_view log)
+        : log_(log), pos_(kWalHeaderSize) {}
+
+    bool Next(WalRecord& record) {
+        if (pos_ >= log_.size()) {
+            return false;
+        }
+        size_t size;
+        if (!DecodeWalRecord(log_.substr(pos_), record, size)) {
+            corrupted_ = true;
+            return false;
+        }
+        pos_ += size;
+        return true;
+    }
+
+    // Whether reading stopped before the end of the log
+    bool Corrupted() const { return corrupted_; }
+    // Bytes of the log consumed so far
+    size_t Offset() const { return pos_; }
+
+   private:
+    std::string_view log_;
+    size_t pos_;
+    bool corrupted_ = false;
+};
+
+// Convert a text log into the binary format in a single pass.
+bool ConvertTextWal(const std::string& text, std::string& binary) {
+    std::smatch match;
+    if (!std::regex_search(text, match, kLoggingSequenceIdHeader)) {
+        return false;
+    }
+    binary = EncodeWalHeader(std::stoi(match[1]));
+
+    auto it = text.cbegin();
+    while (std::regex_search(it, text.cend(), match, kLoggingHeaderRegex)) {
+        int seq = std::stoi(match[1]);
+        std::string user = match[2];
+        std::string key = match[3];
+        std::string op = match[4];
+        size_t length = std::stoull(match[5]);
+        it = match[0].second;
+
+        if (op.compare(kTextPuts) == 0) {
+            if ((size_t)(text.cend() - it) < length) {
+                return false;
+            }
+            binary += EncodeWalRecord(kWalPuts, seq, user, key,
+                                      std::string(it, it + length));
+            // Plus one for the newline char
+            it += std::min(length + 1, (size_t)(text.cend() - it));
+        } else if (op.compare(kTextDele) == 0) {
+            binary += EncodeWalRecord(kWalDele, seq, user, key, "");
+        }
+    }
+    return true;
+}
+
+// Appends records to the log through one long-lived file descriptor.
+// Concurrent appends are grouped: whichever caller finds no write in flight
+// writes everything queued so far with one write() and, under
+// WAL_SYNC_BATCH, one fdatasync(). The others wait until their records are
+// covered. Under WAL_SYNC_ALWAYS every record is written and synced on its
+// own. A failed write poisons the writer until the log is reset.
+class WalWriter {
+   public:
+    WalWriter() {}
+    WalWriter(const WalWriter&) = delete;
+    WalWriter& operator=(const WalWriter&) = delete;
+    ~WalWriter() { Close(); }
+
+    void SetPath(const std::string& path) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        WaitIdle(lock);
+        CloseLocked();
+        path_ = path;
+    }
+
+    void SetSyncMode(WalSyncMode mode) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        mode_ = mode;
+    }
+
+    // Class the writes are scheduled as, IO_WAL unless the log is written
+    // in the background
+    void SetIoClass(IoClass io) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        io_ = io;
+    }
+
+    // Reopen the log file, e.g. after it was replaced on disk.
+    bool Open() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        WaitIdle(lock);
+        CloseLocked();
+        return OpenLocked(O_WRONLY | O_CREAT | O_APPEND);
+    }
+
+    void Close() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        WaitIdle(lock);
+        CloseLocked();
+    }
+
+    // Replace the whole log with content, e.g. a fresh header at checkpoint.
+    bool Reset(const std::string& content) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        WaitIdle(lock);
+        CloseLocked();
+        failed_ = false;
+        if (!OpenLocked(O_WRONLY | O_CREAT | O_TRUNC | O_APPEND)) {
+            return false;
+        }
+        failed_ = !WriteAll(content) || !SyncLocked();
+        return !failed_;
+    }
+
+    // Size of the log file as written through this writer
+    size_t Bytes() const { return bytes_; }
+
+    // Returns once record is written, and synced if the mode asks for it.
+    bool Append(const std::string& record) { return Wait(Enqueue(record)); }
+
+    // Queue record behind everything enqueued before it and return a ticket
+    // for Wait, or 0 on failure. Records reach the file in the order they
+    // were enqueued.
+    uint64_t Enqueue(const std::string& record) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (fd_ < 0 && !OpenLocked(O_WRONLY | O_CREAT | O_APPEND)) {
+            return 0;
+        }
+        if (failed_) {
+            return 0;
+        }
+
+        if (mode_ == WAL_SYNC_ALWAYS) {
+            WaitIdle(lock);
+            failed_ = !WriteAll(pending_ + record) || !SyncLocked();
+            pending_.clear();
+            written_ = ++queued_;
+            return failed_ ? 0 : queued_;
+        }
+
+        pending_.append(record);
+        return ++queued_;
+    }
+
+    // Returns once the record of ticket is written, and synced if the mode
+    // asks for it. Whoever finds no write in progress writes everything
+    // queued so far on behalf of the others.
+    bool Wait(uint64_t ticket) {
+        if (ticket == 0) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (written_ < ticket && !failed_) {
+            if (writing_) {
+                cv_.wait(lock);
+                continue;
+            }
+
+            // Lead a group write of everything queued so far
+            writing_ = true;
+            std::string batch;
+            batch.swap(pending_);
+            uint64_t last = queued_;
+            lock.unlock();
+            bool ok = WriteAll(batch) &&
+                      (mode_ != WAL_SYNC_BATCH || fdatasync(fd_) == 0);
+            lock.lock();
+            writing_ = false;
+            written_ = last;
+            failed_ = failed_ || !ok;
+            cv_.notify_all();
+        }
+        return !failed_;
+    }
+
+   private:
+    void WaitIdle(std::unique_lock<std::mutex>& lock) {
+        cv_.wait(lock, [this] { return !writing_; });
+    }
+
+    bool OpenLocked(int flags) {
+        if (path_.empty()) {
+            return false;
+        }
+        fd_ = open(path_.c_str(), flags, 0644);
+        if (fd_ < 0) {
+            return false;
+        }
+        bytes_ = lseek(fd_, 0, SEEK_END);
+        return true;
+    }
+
+    // Queued records are written before the descriptor goes away.
+    void CloseLocked() {
+        if (fd_ >= 0) {
+            if (!pending_.empty()) {
+                failed_ = failed_ || !WriteAll(pending_) || !SyncLocked();
+            }
+            close(fd_);
+        }
+        fd_ = -1;
+        pending_.clear();
+        written_ = queued_;
+        cv_.notify_all();
+    }
+
+    bool SyncLocked() {
+        return mode_ == WAL_SYNC_NONE || fdatasync(fd_) == 0;
+    }
+
+    bool WriteAll(const std::string& data) {
+        io_scheduler.Acquire(io_, data.size());
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = write(fd_, data.data() + sent, data.size() - sent);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            sent += n;
+        }
+        bytes_ += sent;
+        return true;
+    }
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::string path_;
+    WalSyncMode mode_ = WAL_SYNC_BATCH;
+    IoClass io_ = IO_WAL;
+    int fd_ = -1;
+    // Records waiting for the next group write
+    std::string pending_;
+    // Tickets handed out to appended records, and the last one written
+    uint64_t queued_ = 0;
+    uint64_t written_ = 0;
+    bool writing_ = false;
+    bool failed_ = false;
+    std::atomic<size_t> bytes_{0};
+};
+
+// Read-only memory map of a whole file.
+class MappedFile {
+   public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::string& path) {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+
+        size_ = st.st_size;
+        if (size_ > 0) {
+            void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                size_ = 0;
+                return false;
+            }
+            data_ = (const char*)addr;
+        }
+        close(fd);
+        return true;
+    }
+
+    void Close() {
+        if (data_ != nullptr) {
+            munmap((void*)data_, size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    std::string_view View() const { return std::string_view(data_, size_); }
+
+   private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+}  // namespace KvCache
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Fixed set of threads, each serving the tasks of the shards hashed to it.
+// Tasks with the same shard key go to the same thread and run one at a time
+// in the order they were submitted; tasks of other shards run in parallel.
+//
+// Each thread keeps a queue per shard and takes turns between the shards
+// with work by deficit round robin, so that a busy shard cannot hold up the
+// others on its thread. A turn lasts while the shard has credit: every
+// round adds quantum times the weight of the shard, and every task takes
+// away the bytes it reports having moved. A shard that goes idle keeps any
+// debt, so splitting heavy work into separate submissions does not help.
+//
+// In ordered mode each thread instead runs its tasks in the order they were
+// submitted, whatever their shard. Tasks that wait on each other in
+// submission order, such as writes carrying sequence numbers, need it.
+class ShardedWorkerPool {
+   public:
+    // Runs a task and returns the bytes it moved
+    using Task = std::function<size_t()>;
+
+    ShardedWorkerPool(size_t num_workers, size_t quantum)
+        : quantum_(std::max<size_t>(quantum, 1)) {
+        for (size_t i = 0; i < std::max<size_t>(num_workers, 1); ++i) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+        for (auto& worker : workers_) {
+            worker->thread = std::thread(&ShardedWorkerPool::Run, this,
+                                         worker.get());
+        }
+    }
+    ShardedWorkerPool(const ShardedWorkerPool&) = delete;
+    ShardedWorkerPool& operator=(const ShardedWorkerPool&) = delete;
+
+    ~ShardedWorkerPool() {
+        for (auto& worker : workers_) {
+            std::lock_guard<std::mutex> lock(worker->mtx);
+            worker->stopping = true;
+            worker->cv.notify_one();
+        }
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    // Share of its thread shard_key gets relative to the others, 1 unless
+    // set. Takes effect from the next task submitted.
+    void SetWeight(const std::string& shard_key, size_t weight) {
+        std::lock_guard<std::mutex> lock(weights_mtx_);
+        weights_[shard_key] = std::max<size_t>(weight, 1);
+    }
+
+    // Whether threads run their tasks in submission order. Only changed
+    // while no task is queued or running.
+    void SetOrdered(bool ordered) {
+        for (auto& worker : workers_) {
+            std::lock_guard<std::mutex> lock(worker->mtx);
+            worker->ordered = ordered;
+        }
+    }
+
+    // Queue task behind the other tasks of shard_key. bytes are counted as
+    // in flight for the shard until the task has finished.
+    void Submit(const std::string& shard_key, size_t bytes, Task task) {
+        {
+            std::lock_guard<std::mutex> lock(pending_mtx_);
+            pending_ += 1;
+        }
+        size_t weight = Weight(shard_key);
+        Worker& worker = WorkerOf(shard_key);
+        std::lock_guard<std::mutex> lock(worker.mtx);
+        auto [it, created] = worker.flows.try_emplace(shard_key);
+        Flow& flow = it->second;
+        if (created) {
+            flow.key = shard_key;
+        }
+        flow.weight = weight;
+        flow.tasks.push_back({std::move(task), bytes, worker.submitted++});
+        flow.in_flight += bytes;
+        if (!flow.active) {
+            flow.active = true;
+            worker.active.push_back(&flow);
+        }
+        worker.cv.notify_one();
+    }
+
+    // Bytes of the tasks of shard_key queued or running
+    size_t InFlightBytes(const std::string& shard_key) {
+        Worker& worker = WorkerOf(shard_key);
+        std::lock_guard<std::mutex> lock(worker.mtx);
+        auto it = worker.flows.find(shard_key);
+        return it == worker.flows.end() ? 0 : it->second.in_flight;
+    }
+
+    // Block until every task submitted so far has finished.
+    void Drain() {
+        std::unique_lock<std::mutex> lock(pending_mtx_);
+        idle_cv_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+   private:
+    struct QueuedTask {
+        Task run;
+        size_t bytes;
+        // Position among the tasks submitted to the thread
+        uint64_t ticket;
+    };
+
+    // Queue and credit of one shard on its thread
+    struct Flow {
+        std::string key;
+        std::deque<QueuedTask> tasks;
+        size_t weight = 1;
+        // Bytes the shard may still move in its turn; negative once it has
+        // overrun the turn
+        int64_t deficit = 0;
+        size_t in_flight = 0;
+        // Whether the flow is in the round of its thread
+        bool active = false;
+    };
+
+    struct Worker {
+        std::mutex mtx;
+        std::condition_variable cv;
+        // Flows with queued tasks or debt. Nodes keep their address, which
+        // active points to.
+        std::unordered_map<std::string, Flow> flows;
+        std::deque<Flow*> active;
+        uint64_t submitted = 0;
+        bool ordered = false;
+        bool stopping = false;
+        std::thread thread;
+    };
+
+    Worker& WorkerOf(const std::string& shard_key) {
+        return *workers_[std::hash<std::string>{}(shard_key) %
+                         workers_.size()];
+    }
+
+    size_t Weight(const std::string& shard_key) {
+        std::lock_guard<std::mutex> lock(weights_mtx_);
+        auto it = weights_.find(shard_key);
+        return it == weights_.end() ? 1 : it->second;
+    }
+
+    void Run(Worker* worker) {
+        std::unique_lock<std::mutex> lock(worker->mtx);
+        while (true) {
+            worker->cv.wait(lock, [worker] {
+                return worker->stopping || !worker->active.empty();
+            });
+            if (worker->active.empty()) {
+                return;
+            }
+
+            // In ordered mode the flow holding the oldest task goes first
+            if (worker->ordered) {
+                auto oldest = std::min_element(
+                    worker->active.begin(), worker->active.end(),
+                    [](const Flow* a, const Flow* b) {
+                        return a->tasks.front().ticket <
+                               b->tasks.front().ticket;
+                    });
+                Flow* flow = *oldest;
+                worker->active.erase(oldest);
+                worker->active.push_front(flow);
+            }
+
+            // A flow out of credit gets the next round's and waits for its
+            // turn behind the others
+            Flow* flow = worker->active.front();
+            if (flow->deficit <= 0 && !worker->ordered) {
+                flow->deficit += (int64_t)(quantum_ * flow->weight);
+                worker->active.pop_front();
+                worker->active.push_back(flow);
+                continue;
+            }
+
+            // The flow stays at the front while its task runs, so tasks
+            // submitted meanwhile queue behind it
+            QueuedTask task = std::move(flow->tasks.front());
+            flow->tasks.pop_front();
+            lock.unlock();
+            size_t moved = task.run();
+            lock.lock();
+            if (!worker->ordered) {
+                flow->deficit -= (int64_t)moved;
+            }
+            flow->in_flight -= task.bytes;
+            if (flow->tasks.empty()) {
+                worker->active.pop_front();
+                flow->active = false;
+                // Leftover credit does not carry over to a later burst
+                if (flow->deficit >= 0) {
+                    worker->flows.erase(flow->key);
+                }
+            }
+
+            std::lock_guard<std::mutex> pending_lock(pending_mtx_);
+            if (--pending_ == 0) {
+                idle_cv_.notify_all();
+            }
+        }
+    }
+
+    size_t quantum_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::mutex weights_mtx_;
+    std::unordered_map<std::string, size_t> weights_;
+    std::mutex pending_mtx_;
+    std::condition_variable idle_cv_;
+    // Tasks submitted and not finished yet
+    size_t pending_ = 0;
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include <vector>
 #include <string>
 
+#include "sha256.h"
 #include "tcp_operation.h"
 #include "proto_gen/proto.pb.h"
 
@@ -19,6 +20,8 @@ enum KV_State{
     LOG_ERROR = -6,  // Error when logging KV operations
     REC_ERROR = -7,  // Error when recovering from logging
     SYNC_ERROR = -8,  // Error when syncing recovered node with primary
+    BUSY_ERROR = -9,  // Write buffer of the storage node is full, retry later
+    BLOB_ERROR = -10,  // Blob of a PUTB is not stored, resend with the value
 };
 
 // Send kv_command to KV store and wait for kv_ret
@@ -68,6 +71,31 @@ int kv_puts(int fd, std::string usr, std::string key,
 		return LINK_ERROR;
 }
 
+// PUTB(usr, key, value): Stores "value" in column "key" of row "usr" as a
+// reference to a blob shared by all keys with the same value. Only the hash
+// of value is sent at first; value itself follows if the store lacks it.
+int kv_put_blob(int fd, std::string usr, std::string key,
+				const std::string& value){
+	kv_command command;
+	kv_ret ret;
+
+	command.set_com("PUTB");
+	command.set_usr(usr);
+	command.set_key(key);
+	command.set_value2(sha256_hex(value));
+
+	if(!kv_trans(fd, command, ret))
+		return LINK_ERROR;
+	if(ret.status() != BLOB_ERROR)
+		return ret.status();
+
+	command.set_value1(value);
+	if(kv_trans(fd, command, ret))
+		return ret.status();
+	else
+		return LINK_ERROR;
+}
+
 // CPUT(usr, key, value1, value2): Stores "value2" in column "key" of row "usr",
 // but only if the current value is "value1"
 int kv_cput(int fd, std::string usr, std::string key, 
@@ -449,8 +449,8 @@ void StorageHandler::HandleCreationAndQuery(const StorageServiceReq& req,
             HandleCreationAndQuery(req, resp, max_attempt - 1);
         } else {
             metadata_str_ = new_metadata;
-            if (is_file && kv_puts(backend_fd_, usr_, std::to_string(id),
-                                   req.file_upload_req().content()) != 0) {
+            if (is_file && kv_put_blob(backend_fd_, usr_, std::to_string(id),
+                                       req.file_upload_req().content()) != 0) {
                 if (!ReadMetadata()) {
                     resp.set_status(StorageServiceResp::FAIL);
                     resp.set_error_msg(